@@ -0,0 +1,1011 @@
+/*
+
+  EV3 brick emulator - see EV3_Emulator.h for what it does and how to run it.
+
+  Build with:  ./compile.sh -e
+
+  Usage: ev3emu map.ppm listen_address [-p x,y,heading] [-s seed] [-l latency_ms]
+
+    listen_address - tcp:port, tcp:host:port, or unix:/path/to/socket
+    -p             - starting pose of the robot in map pixels, heading in degrees clockwise
+                     from 'up' (default: centre of the top-left intersection, facing right)
+    -s             - seed for the sensor noise (default 1)
+    -l             - extra delay before each reply, to mimic the Bluetooth link
+
+  Connections are served one at a time. The robot keeps its pose between connections, like the
+  real one would. Counts of commands and round trips are printed when each connection closes.
+
+*/
+
+#include "EV3_Emulator.h"
+#include "EV3_Localization.h"
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/un.h>
+#include <time.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+// Simulated robot
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+typedef struct {
+  int power;             // -100..100
+  int running;           // 1 after opOUTPUT_START, 0 after opOUTPUT_STOP
+  double speed;          // actual speed as a fraction of full speed, lags behind power
+  double stop_at;        // time at which a timed/stepped move ends, 0 if none
+  double steps_left;     // degrees left in a synchronized step move, 0 if none
+  int sync_with;         // motor that stops along with this one (-1 if none)
+  double tacho;          // degrees turned since the last reset
+} emu_motor;
+
+static unsigned char *emu_map = NULL;
+static int emu_rx, emu_ry;
+
+static double emu_x, emu_y;          // axle centre, map pixels
+static double emu_heading;           // degrees clockwise from 'up', not wrapped (this is the gyro)
+static double emu_rate;              // current turn rate, deg/s
+static double emu_slide;             // colour sensor slide position, 0=retracted
+static emu_motor emu_motors[4];
+static int emu_colour_mode = 2;
+static int emu_gyro_mode = 0;
+static double emu_sim_time;          // time the simulation was last advanced to
+static double emu_sound_end;         // time the current tone finishes
+static int emu_latency_ms = 0;
+static EMU_stats emu_stats;
+
+// Raw RGB the sensor reports over each map colour, indexed like the EV3 colour codes (1-6).
+// Entry 0 is the table under the map.
+static const double emu_raw_rgb[7][3] = {
+    {60, 45, 30},    // off the map
+    {20, 20, 22},    // black
+    {30, 60, 140},   // blue
+    {25, 75, 40},    // green
+    {260, 230, 60},  // yellow
+    {255, 40, 45},   // red
+    {300, 290, 280}, // white
+};
+static const unsigned char emu_map_rgb[7][3] = {
+    {0, 0, 0}, {0, 0, 0}, {0, 0, 255}, {0, 255, 0}, {255, 255, 0}, {255, 0, 0}, {255, 255, 255},
+};
+
+static double emu_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((double)ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static void emu_sleep_until(double t) {
+  double dt = t - emu_now();
+  if (dt > 0) usleep((useconds_t)(dt * 1e6));
+}
+
+static double emu_gauss(void) {
+  // Box-Muller, unit variance
+  double u = drand48(), v = drand48();
+  if (u < 1e-12) u = 1e-12;
+  return (sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v));
+}
+
+static void emu_step(double dt) {
+  // Move the robot for dt seconds with the current motor settings
+  double vl = 0, vr = 0, vs = 0, v, w, h;
+
+  for (int i = 0; i < 4; i++) {
+    // Power below the deadband does not overcome friction; above it the motor speeds up (or
+    // brakes) towards its target speed with a first order lag
+    emu_motor *m = &emu_motors[i];
+    double target = 0, mag = abs(m->power) - EMU_MOTOR_DEADBAND;
+    if (m->running && mag > 0) target = (m->power > 0 ? mag : -mag) / (100.0 - EMU_MOTOR_DEADBAND);
+    m->speed += (target - m->speed) * MIN(1.0, dt / EMU_MOTOR_LAG);
+    m->tacho += m->speed * EMU_MOTOR_DEG_PER_S * dt;
+    if (m->running && m->steps_left > 0) {
+      // a synchronized step move ends when its master motor has turned far enough
+      m->steps_left -= fabs(m->speed) * EMU_MOTOR_DEG_PER_S * dt;
+      if (m->steps_left <= 0) {
+        m->running = 0;
+        m->steps_left = 0;
+        if (m->sync_with >= 0) emu_motors[m->sync_with].running = 0;
+      }
+    }
+  }
+  vl = emu_motors[EMU_LEFT_WHEEL].speed * EMU_WHEEL_SPEED;
+  vr = emu_motors[EMU_RIGHT_WHEEL].speed * EMU_WHEEL_SPEED;
+  vs = emu_motors[EMU_SLIDE_MOTOR].speed * EMU_SLIDE_SPEED;
+
+  v = (vl + vr) / 2.0;
+  w = (vl - vr) / EMU_AXLE_WIDTH * 180.0 / M_PI;  // left wheel faster -> clockwise
+  h = (emu_heading + w * dt / 2.0) * M_PI / 180.0;
+  emu_x += v * dt * sin(h);
+  emu_y -= v * dt * cos(h);
+  emu_heading += w * dt;
+  emu_rate = w;
+
+  emu_slide -= vs * dt;
+  if (emu_slide < 0) emu_slide = 0;
+  if (emu_slide > EMU_SLIDE_TRAVEL) emu_slide = EMU_SLIDE_TRAVEL;
+}
+
+static void emu_advance(void) {
+  // Bring the simulation up to the current time. Motors only change when a command arrives or a
+  // timed move ends, so the motion is integrated in small steps between those events.
+  double now = emu_now(), next, dt;
+
+  while (emu_sim_time < now) {
+    next = now;
+    for (int i = 0; i < 4; i++)
+      if (emu_motors[i].running && emu_motors[i].stop_at > 0 && emu_motors[i].stop_at < next)
+        next = emu_motors[i].stop_at;
+    while (emu_sim_time < next) {
+      dt = MIN(0.002, next - emu_sim_time);
+      emu_step(dt);
+      emu_sim_time += dt;
+    }
+    for (int i = 0; i < 4; i++) {
+      if (emu_motors[i].running && emu_motors[i].stop_at > 0 && emu_motors[i].stop_at <= emu_sim_time) {
+        emu_motors[i].running = 0;
+        emu_motors[i].stop_at = 0;
+      }
+    }
+  }
+}
+
+static int emu_map_colour(int x, int y) {
+  // EV3 colour code of the map pixel closest in RGB to the one at x,y, 0 when off the map
+  unsigned char *p;
+  int best = 0, best_d = 1 << 30, d;
+
+  if (x < 0 || y < 0 || x >= emu_rx || y >= emu_ry) return (0);
+  p = emu_map + ((x + (y * emu_rx)) * 3);
+  for (int c = 1; c <= 6; c++) {
+    d = 0;
+    for (int k = 0; k < 3; k++) d += (p[k] - emu_map_rgb[c][k]) * (p[k] - emu_map_rgb[c][k]);
+    if (d < best_d) {
+      best_d = d;
+      best = c;
+    }
+  }
+  return (best);
+}
+
+static void emu_sensor_spot(int *sx, int *sy) {
+  double d = EMU_SENSOR_OFFSET + emu_slide, h = emu_heading * M_PI / 180.0;
+  *sx = (int)lround(emu_x + d * sin(h));
+  *sy = (int)lround(emu_y - d * cos(h));
+}
+
+static void emu_read_rgb(double rgb[3]) {
+  // Raw RGB averaged over the sensor spot, plus noise
+  int sx, sy, n = 0, c;
+
+  emu_sensor_spot(&sx, &sy);
+  rgb[0] = rgb[1] = rgb[2] = 0;
+  for (int j = -EMU_SENSOR_RADIUS; j <= EMU_SENSOR_RADIUS; j++)
+    for (int i = -EMU_SENSOR_RADIUS; i <= EMU_SENSOR_RADIUS; i++) {
+      if (i * i + j * j > EMU_SENSOR_RADIUS * EMU_SENSOR_RADIUS) continue;
+      c = emu_map_colour(sx + i, sy + j);
+      for (int k = 0; k < 3; k++) rgb[k] += emu_raw_rgb[c][k];
+      n++;
+    }
+  for (int k = 0; k < 3; k++) {
+    rgb[k] = rgb[k] / n + EMU_COLOUR_NOISE * emu_gauss();
+    if (rgb[k] < 0) rgb[k] = 0;
+  }
+}
+
+static int emu_read_colour_index(void) {
+  // Indexed colour: the reference colour closest to the (noisy) raw reading
+  double rgb[3], d, best_d = 1e30;
+  int best = 0;
+
+  emu_read_rgb(rgb);
+  for (int c = 0; c <= 6; c++) {
+    d = 0;
+    for (int k = 0; k < 3; k++) d += (rgb[k] - emu_raw_rgb[c][k]) * (rgb[k] - emu_raw_rgb[c][k]);
+    if (d < best_d) {
+      best_d = d;
+      best = c;
+    }
+  }
+  return (best);
+}
+
+static int emu_port_type(int port) {
+  if (port == EMU_COLOUR_PORT) return (EV3_COLOUR);
+  if (port == EMU_GYRO_PORT) return (EV3_GYRO);
+  if (port == EMU_BACK_TOUCH_PORT || port == EMU_TOP_TOUCH_PORT) return (16);
+  return (126);  // nothing connected
+}
+
+static int emu_port_mode(int port) {
+  if (port == EMU_COLOUR_PORT) return (emu_colour_mode);
+  if (port == EMU_GYRO_PORT) return (emu_gyro_mode);
+  return (0);
+}
+
+static int emu_sensor_values(int port, int mode, double values[8]) {
+  // Read the sensor on a port in the given mode (-1 keeps the current one).
+  // Values are in raw units; returns the number of values the mode produces.
+  double rgb[3];
+
+  emu_advance();
+  if (port == EMU_COLOUR_PORT) {
+    if (mode >= 0 && mode != emu_colour_mode) emu_stats.mode_switches++;
+    if (mode >= 0) emu_colour_mode = mode;
+    switch (emu_colour_mode) {
+      case 0:  // reflected light, %
+        emu_read_rgb(rgb);
+        values[0] = MIN(100.0, (rgb[0] + rgb[1] + rgb[2]) / 9.0);
+        return (1);
+      case 1:  // ambient light, %
+        values[0] = 5;
+        return (1);
+      case 2:  // colour index
+        values[0] = emu_read_colour_index();
+        return (1);
+      default:  // 4 - raw RGB
+        emu_read_rgb(rgb);
+        for (int k = 0; k < 3; k++) values[k] = floor(rgb[k]);
+        return (3);
+    }
+  }
+  if (port == EMU_GYRO_PORT) {
+    if (mode >= 0 && mode != emu_gyro_mode) emu_stats.mode_switches++;
+    if (mode >= 0) emu_gyro_mode = mode;
+    if (emu_gyro_mode == 1) {
+      values[0] = lround(emu_rate);
+      return (1);
+    }
+    values[0] = lround(emu_heading);
+    values[1] = lround(emu_rate);
+    return (emu_gyro_mode == 3 ? 2 : 1);
+  }
+  if (port == EMU_BACK_TOUCH_PORT) {
+    values[0] = emu_slide <= 0.0 ? 1 : 0;
+    return (1);
+  }
+  if (port == EMU_TOP_TOUCH_PORT) {
+    values[0] = emu_slide >= EMU_SLIDE_TRAVEL ? 1 : 0;
+    return (1);
+  }
+  values[0] = 0;
+  return (1);
+}
+
+static double emu_to_pct(int port, double raw) {
+  // Percent scaling used by READY_PCT / DATA_PCT
+  if (port == EMU_BACK_TOUCH_PORT || port == EMU_TOP_TOUCH_PORT) return (raw ? 100 : 0);
+  if (port == EMU_COLOUR_PORT && emu_colour_mode == 4) return (MIN(100.0, raw / 4.0));
+  return (raw);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+// Direct command interpreter
+//
+// Parameters are decoded as described in bytecodes.h (PRIMPAR_*): short constants and variable
+// references in one byte, long constants/variables with 1, 2 or 4 bytes following, and strings.
+// Results go to the global (reply) or local variable area named by the parameter.
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+typedef struct {
+  const unsigned char *pc, *end;
+  unsigned char globals[1024];
+  unsigned char locals[64];
+  const unsigned char *start;  // first opcode, for jump range checks
+  int n_globals, n_locals;
+  int error;
+  double started;              // time the command started, to cut off runaway loops
+} emu_vm;
+
+typedef struct {
+  int is_var, is_global;
+  int value;  // constant value, or variable offset
+  const char *str;
+} emu_param;
+
+enum { EMU_DATA8 = 1, EMU_DATA16 = 2, EMU_DATA32 = 4, EMU_DATAF = 8 };
+static const int emu_op_types[4] = {EMU_DATA8, EMU_DATA16, EMU_DATA32, EMU_DATAF};
+
+#define EMU_LOOP_LIMIT 120.0  // seconds a direct command may loop before it is abandoned
+#define EMU_MAX_GLOBALS 1019  // largest global area whose reply fits in 1024 bytes
+
+static int emu_fetch(emu_vm *vm) {
+  if (vm->pc >= vm->end) {
+    vm->error = 1;
+    return (0);
+  }
+  return (*(vm->pc++));
+}
+
+static emu_param emu_param_read(emu_vm *vm) {
+  emu_param p = {0, 0, 0, NULL};
+  int b = emu_fetch(vm), n, v;
+
+  if (!(b & PRIMPAR_LONG)) {
+    if (b & PRIMPAR_VARIABEL) {
+      p.is_var = 1;
+      p.is_global = (b & PRIMPAR_GLOBAL) != 0;
+      p.value = b & PRIMPAR_INDEX;
+    } else {
+      p.value = b & PRIMPAR_VALUE;
+      if (p.value & PRIMPAR_CONST_SIGN) p.value -= 64;
+    }
+    return (p);
+  }
+
+  n = b & PRIMPAR_BYTES;
+  if (!(b & PRIMPAR_VARIABEL) && (n == PRIMPAR_STRING || n == PRIMPAR_STRING_OLD)) {
+    p.str = (const char *)vm->pc;
+    while (vm->pc < vm->end && *vm->pc) vm->pc++;
+    emu_fetch(vm);  // terminator
+    return (p);
+  }
+  n = n == PRIMPAR_4_BYTES ? 4 : n;
+  v = 0;
+  for (int i = 0; i < n; i++) v |= emu_fetch(vm) << (8 * i);
+  p.is_var = (b & PRIMPAR_VARIABEL) != 0;
+  if (!p.is_var && n == 1) v = (signed char)v;  // constants are signed, variable offsets are not
+  if (!p.is_var && n == 2) v = (short)v;
+  p.is_global = (b & PRIMPAR_GLOBAL) != 0;
+  p.value = v;
+  return (p);
+}
+
+static unsigned char *emu_var(emu_vm *vm, emu_param *p, int size) {
+  // Address of a variable, NULL (and an error) if it falls outside its area
+  int limit = p->is_global ? vm->n_globals : vm->n_locals;
+  if (!p->is_var || p->value < 0 || p->value + size > limit) {
+    vm->error = 1;
+    return (NULL);
+  }
+  return ((p->is_global ? vm->globals : vm->locals) + p->value);
+}
+
+static double emu_get(emu_vm *vm, emu_param p, int type) {
+  // Value of an input parameter of the given data type
+  unsigned char *a;
+  int32_t i = 0;
+  float f;
+
+  if (!p.is_var) return (p.value);
+  a = emu_var(vm, &p, type == EMU_DATAF ? 4 : type);
+  if (a == NULL) return (0);
+  if (type == EMU_DATAF) {
+    memcpy(&f, a, 4);
+    return (f);
+  }
+  for (int k = 0; k < type; k++) i |= (int32_t)a[k] << (8 * k);
+  if (type == EMU_DATA8) return ((signed char)i);
+  if (type == EMU_DATA16) return ((short)i);
+  return (i);
+}
+
+static void emu_set(emu_vm *vm, emu_param p, int type, double value) {
+  // Store a result in an output parameter. Like the brick, a value that runs past the end of the
+  // variable area is cut short (btcomm.c reads 32-bit indexed colours into a 1-byte area).
+  int size = type == EMU_DATAF ? 4 : type;
+  int limit = p.is_global ? vm->n_globals : vm->n_locals;
+  unsigned char bytes[4], *a;
+  int32_t i;
+  float f;
+
+  if (!p.is_var || p.value < 0 || p.value >= limit) {
+    vm->error = 1;
+    return;
+  }
+  a = (p.is_global ? vm->globals : vm->locals) + p.value;
+  if (type == EMU_DATAF) {
+    f = (float)value;
+    memcpy(bytes, &f, 4);
+  } else {
+    i = (int32_t)lround(value);
+    for (int k = 0; k < 4; k++) bytes[k] = (i >> (8 * k)) & 0xFF;
+  }
+  memcpy(a, bytes, MIN(size, limit - p.value));
+}
+
+static int emu_format_type(int format) {
+  // opINPUT_READEXT format -> storage type
+  switch (format) {
+    case DATA_8:
+    case DATA_PCT: return (EMU_DATA8);
+    case DATA_16: return (EMU_DATA16);
+    case DATA_F:
+    case DATA_SI: return (EMU_DATAF);
+    default: return (EMU_DATA32);
+  }
+}
+
+static void emu_input(emu_vm *vm, int port, int mode, int format, int n) {
+  // Shared tail of the sensor read opcodes: read n values and store them in the next n params
+  double values[8];
+  int got = emu_sensor_values(port, mode, values);
+
+  for (int i = 0; i < n; i++) {
+    double v = i < got ? values[i] : 0;
+    if (format == DATA_PCT) v = emu_to_pct(port, v);
+    emu_set(vm, emu_param_read(vm), emu_format_type(format), v);
+  }
+}
+
+static void emu_motors_do(int nos, void (*fn)(emu_motor *m, int arg), int arg) {
+  for (int i = 0; i < 4; i++)
+    if (nos & (1 << i)) fn(&emu_motors[i], arg);
+}
+static void emu_set_power(emu_motor *m, int power) { m->power = power; }
+static void emu_start(emu_motor *m, int unused) { m->running = 1; m->stop_at = 0; m->steps_left = 0; }
+static void emu_stop(emu_motor *m, int unused) { m->running = 0; m->stop_at = 0; m->steps_left = 0; }
+
+static int emu_motor_busy(int nos) {
+  // 1 while a timed or stepped move is still running on any of the motors
+  for (int i = 0; i < 4; i++)
+    if ((nos & (1 << i)) && emu_motors[i].running &&
+        (emu_motors[i].stop_at > 0 || emu_motors[i].steps_left > 0))
+      return (1);
+  return (0);
+}
+
+static void emu_sync(int nos, int power, int turn, double steps, double secs) {
+  // opOUTPUT_STEP_SYNC / opOUTPUT_TIME_SYNC on two motors. A positive turn ratio slows the higher
+  // numbered motor (100: stopped, 200: full speed backwards), a negative one the lower numbered.
+  int lo = -1, hi = -1;
+  for (int i = 0; i < 4; i++) {
+    if (!(nos & (1 << i))) continue;
+    if (lo < 0) lo = i;
+    else if (hi < 0) hi = i;
+  }
+  if (hi < 0) return;
+  emu_motors[lo].power = lround(power * (turn < 0 ? (100.0 + turn) / 100.0 : 1.0));
+  emu_motors[hi].power = lround(power * (turn > 0 ? (100.0 - turn) / 100.0 : 1.0));
+  emu_start(&emu_motors[lo], 0);
+  emu_start(&emu_motors[hi], 0);
+  emu_motors[lo].sync_with = turn >= 0 ? hi : -1;
+  emu_motors[hi].sync_with = turn >= 0 ? -1 : lo;
+  if (steps > 0) emu_motors[turn >= 0 ? lo : hi].steps_left = steps;
+  if (secs > 0) emu_motors[lo].stop_at = emu_motors[hi].stop_at = emu_sim_time + secs;
+}
+static void emu_reset(emu_motor *m, int unused) { m->tacho = 0; }
+
+static void emu_jump(emu_vm *vm, int taken, int offset) {
+  // Relative jump from the end of the jump opcode. A brick-side loop jumps backwards once per
+  // pass; give the simulation a millisecond per pass (about what the brick's sensor update
+  // rate allows) rather than spinning, and give up on loops that never end.
+  const unsigned char *target = vm->pc + offset;
+
+  if (!taken || vm->error) return;
+  if (target < vm->start || target > vm->end) {
+    vm->error = 1;
+    return;
+  }
+  if (offset < 0) {
+    if (emu_now() - vm->started > EMU_LOOP_LIMIT) {
+      fprintf(stderr, "ev3emu: Direct command looped for %.0f s, abandoned\n", EMU_LOOP_LIMIT);
+      vm->error = 1;
+      return;
+    }
+    usleep(1000);
+  }
+  vm->pc = target;
+}
+
+static int emu_compare(int op, double a, double b) {
+  // opJR_LT* .. opJR_GTEQ* come in groups of four (8, 16, 32 bit and float)
+  switch ((op - opJR_LT8) / 4) {
+    case 0: return (a < b);
+    case 1: return (a > b);
+    case 2: return (a == b);
+    case 3: return (a != b);
+    case 4: return (a <= b);
+    default: return (a >= b);
+  }
+}
+
+static void emu_layer(emu_vm *vm) {
+  // Read a layer parameter. Only the brick itself (layer 0) is emulated, not daisy-chained ones
+  if (emu_get(vm, emu_param_read(vm), EMU_DATA8) != 0) vm->error = 1;
+}
+
+static int emu_exec(emu_vm *vm) {
+  // Execute one opcode. Returns 0 to continue, -1 on an unsupported opcode or bad parameter.
+  int op = emu_fetch(vm), sub, nos, port, type, mode, n, power;
+  double t1, t2, t3, rate;
+
+  if (vm->error) return (-1);
+  emu_stats.opcodes[op]++;
+  switch (op) {
+    case opNOP:
+      break;
+
+    // Motors - position changes are computed lazily, so bring the simulation up to date first
+    case opOUTPUT_POWER:
+    case opOUTPUT_SPEED:
+      emu_layer(vm);
+      nos = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      power = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      emu_advance();
+      emu_motors_do(nos, emu_set_power, MAX(-100, MIN(100, power)));
+      break;
+    case opOUTPUT_START:
+      emu_layer(vm);
+      nos = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      emu_advance();
+      emu_motors_do(nos, emu_start, 0);
+      break;
+    case opOUTPUT_STOP:
+      emu_layer(vm);
+      nos = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      emu_get(vm, emu_param_read(vm), EMU_DATA8);  // brake - the simulated motors stop dead
+      emu_advance();
+      emu_motors_do(nos, emu_stop, 0);
+      break;
+    case opOUTPUT_RESET:
+    case opOUTPUT_CLR_COUNT:
+      emu_layer(vm);
+      nos = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      emu_advance();
+      emu_motors_do(nos, emu_reset, 0);
+      break;
+    case opOUTPUT_TIME_POWER:
+    case opOUTPUT_TIME_SPEED:
+    case opOUTPUT_STEP_POWER:
+    case opOUTPUT_STEP_SPEED:
+      // Ramp up / constant / ramp down given in ms (TIME) or degrees (STEP); ramps are run at
+      // full power, which is close enough for the short ramps btcomm.c uses
+      emu_layer(vm);
+      nos = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      power = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      t1 = emu_get(vm, emu_param_read(vm), EMU_DATA32);
+      t2 = emu_get(vm, emu_param_read(vm), EMU_DATA32);
+      t3 = emu_get(vm, emu_param_read(vm), EMU_DATA32);
+      emu_get(vm, emu_param_read(vm), EMU_DATA8);  // brake
+      if (vm->error) return (-1);
+      emu_advance();
+      power = MAX(-100, MIN(100, power));
+      emu_motors_do(nos, emu_set_power, power);
+      emu_motors_do(nos, emu_start, 0);
+      rate = fabs(power) / 100.0 * EMU_MOTOR_DEG_PER_S;
+      t1 = (op == opOUTPUT_TIME_POWER || op == opOUTPUT_TIME_SPEED)
+               ? (t1 + t2 + t3) / 1000.0
+               : (rate > 0 ? (t1 + t2 + t3) / rate : 0);
+      for (int i = 0; i < 4; i++)
+        if (nos & (1 << i)) emu_motors[i].stop_at = emu_sim_time + MAX(t1, 1e-6);
+      break;
+
+    case opOUTPUT_STEP_SYNC:
+    case opOUTPUT_TIME_SYNC:
+      emu_layer(vm);
+      nos = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      power = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      t1 = emu_get(vm, emu_param_read(vm), EMU_DATA16);  // turn ratio
+      t2 = emu_get(vm, emu_param_read(vm), EMU_DATA32);  // degrees or ms, 0 for no limit
+      emu_get(vm, emu_param_read(vm), EMU_DATA8);        // brake
+      if (vm->error) return (-1);
+      emu_advance();
+      emu_sync(nos, MAX(-100, MIN(100, power)), MAX(-200, MIN(200, (int)t1)),
+               op == opOUTPUT_STEP_SYNC ? t2 : 0, op == opOUTPUT_TIME_SYNC ? t2 / 1000.0 : 0);
+      break;
+    case opOUTPUT_READY:
+      emu_layer(vm);
+      nos = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      for (emu_advance(); emu_motor_busy(nos) && !vm->error; emu_advance()) {
+        if (emu_now() - vm->started > EMU_LOOP_LIMIT) vm->error = 1;
+        usleep(1000);
+      }
+      break;
+    case opOUTPUT_GET_COUNT:
+      emu_layer(vm);
+      port = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      if (vm->error || port < 0 || port > 3) return (-1);
+      emu_advance();
+      emu_set(vm, emu_param_read(vm), EMU_DATA32, emu_motors[port].tacho);
+      break;
+
+    // Sensors
+    case opINPUT_DEVICE:
+      sub = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      if (sub == GET_TYPEMODE) {
+        emu_layer(vm);
+        port = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+        emu_set(vm, emu_param_read(vm), EMU_DATA8, emu_port_type(port));
+        emu_set(vm, emu_param_read(vm), EMU_DATA8, emu_port_mode(port));
+      } else if (sub == READY_PCT || sub == READY_RAW || sub == READY_SI) {
+        emu_layer(vm);
+        port = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+        type = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+        mode = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+        n = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+        if (vm->error || n < 0 || n > 8) return (-1);
+        emu_input(vm, port, mode, sub == READY_PCT ? DATA_PCT : sub == READY_RAW ? DATA_RAW : DATA_SI, n);
+      } else {
+        return (-1);
+      }
+      break;
+    case opINPUT_READ:
+    case opINPUT_READSI:
+      emu_layer(vm);
+      port = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      type = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      mode = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      if (vm->error) return (-1);
+      emu_input(vm, port, mode, op == opINPUT_READ ? DATA_PCT : DATA_SI, 1);
+      break;
+    case opINPUT_READEXT:
+      emu_layer(vm);
+      port = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      type = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      mode = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      sub = emu_get(vm, emu_param_read(vm), EMU_DATA8);  // format
+      n = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      if (vm->error || n < 0 || n > 8) return (-1);
+      emu_input(vm, port, mode, sub, n);
+      break;
+
+    // Sound - tones are not played, but take as long as they would
+    case opSOUND:
+      sub = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      if (sub == TONE) {
+        emu_get(vm, emu_param_read(vm), EMU_DATA8);  // volume
+        emu_get(vm, emu_param_read(vm), EMU_DATA16);  // frequency
+        t1 = emu_get(vm, emu_param_read(vm), EMU_DATA16);
+        emu_sound_end = emu_now() + t1 / 1000.0;
+      } else if (sub == PLAY || sub == REPEAT) {
+        emu_get(vm, emu_param_read(vm), EMU_DATA8);  // volume
+        emu_param_read(vm);                           // file name
+        emu_sound_end = emu_now();
+      } else if (sub == BREAK) {
+        emu_sound_end = emu_now();
+      } else {
+        return (-1);
+      }
+      break;
+    case opSOUND_READY:
+      emu_sleep_until(emu_sound_end);
+      break;
+    case opSOUND_TEST:
+      emu_set(vm, emu_param_read(vm), EMU_DATA8, emu_now() < emu_sound_end);
+      break;
+
+    // Timers, in ms since the emulator started (they are only compared with each other)
+    case opTIMER_WAIT:
+      t1 = emu_get(vm, emu_param_read(vm), EMU_DATA32);
+      emu_set(vm, emu_param_read(vm), EMU_DATA32, fmod(emu_now() * 1000.0, 1e9) + t1);
+      break;
+    case opTIMER_READY:
+      t1 = emu_get(vm, emu_param_read(vm), EMU_DATA32);
+      t2 = fmod(emu_now() * 1000.0, 1e9);
+      if (t1 > t2) usleep((useconds_t)((t1 - t2) * 1000));
+      break;
+    case opTIMER_READ:
+      emu_set(vm, emu_param_read(vm), EMU_DATA32, fmod(emu_now() * 1000.0, 1e9));
+      break;
+    case opTIMER_READ_US:
+      emu_set(vm, emu_param_read(vm), EMU_DATA32, fmod(emu_now() * 1e6, 1e9));
+      break;
+
+    // Program flow and arithmetic, for loops running on the brick
+    case opJR:
+      t1 = emu_get(vm, emu_param_read(vm), EMU_DATA32);
+      emu_jump(vm, 1, t1);
+      break;
+    case opJR_FALSE:
+    case opJR_TRUE:
+      t1 = emu_get(vm, emu_param_read(vm), EMU_DATA8);
+      t2 = emu_get(vm, emu_param_read(vm), EMU_DATA32);
+      emu_jump(vm, (t1 != 0) == (op == opJR_TRUE), t2);
+      break;
+    case opJR_LT8 ... opJR_GTEQF:
+      type = emu_op_types[op & 3];
+      t1 = emu_get(vm, emu_param_read(vm), type);
+      t2 = emu_get(vm, emu_param_read(vm), type);
+      t3 = emu_get(vm, emu_param_read(vm), EMU_DATA32);
+      emu_jump(vm, emu_compare(op, t1, t2), t3);
+      break;
+    case opADD8 ... opSUBF:
+      type = emu_op_types[op & 3];
+      t1 = emu_get(vm, emu_param_read(vm), type);
+      t2 = emu_get(vm, emu_param_read(vm), type);
+      emu_set(vm, emu_param_read(vm), type, op < opSUB8 ? t1 + t2 : t1 - t2);
+      break;
+    case opMOVE8_8 ... opMOVEF_F:
+      t1 = emu_get(vm, emu_param_read(vm), emu_op_types[(op >> 2) & 3]);
+      emu_set(vm, emu_param_read(vm), emu_op_types[op & 3], t1);
+      break;
+
+    // Display and brick settings have nothing to simulate. Their parameter lists depend on the
+    // sub command, so accept them and skip the rest of the command.
+    case opUI_WRITE:
+    case opUI_DRAW:
+    case opCOM_SET:
+      vm->pc = vm->end;
+      break;
+
+    default:
+      fprintf(stderr, "ev3emu: Unsupported opcode 0x%02X\n", op);
+      return (-1);
+  }
+  return (vm->error ? -1 : 0);
+}
+
+static int emu_direct_command(const unsigned char *cmd, int len, unsigned char *reply) {
+  emu_vm vm;
+  int ok = 1, n;
+
+  vm.n_globals = (cmd[5] | (cmd[6] << 8)) & 0x3FF;
+  vm.n_locals = cmd[6] >> 2;
+  if (vm.n_globals > EMU_MAX_GLOBALS) {
+    // Its reply would not fit in the callers' 1024 byte buffers
+    fprintf(stderr, "ev3emu: Global area of %d bytes is too large\n", vm.n_globals);
+    vm.n_globals = 0;
+    ok = 0;
+  }
+  memset(vm.globals, 0, vm.n_globals);
+  memset(vm.locals, 0, sizeof(vm.locals));
+  vm.pc = vm.start = cmd + 7;
+  vm.end = cmd + len;
+  vm.error = 0;
+  vm.started = emu_now();
+
+  while (ok && vm.pc < vm.end) {
+    if (emu_exec(&vm) < 0) {
+      ok = 0;
+      break;
+    }
+  }
+  if (vm.error) ok = 0;  // a bad parameter in the last opcode
+  if (!ok) emu_stats.errors++;
+
+  n = 3 + vm.n_globals;
+  reply[0] = n & 0xFF;
+  reply[1] = (n >> 8) & 0xFF;
+  reply[2] = cmd[2];
+  reply[3] = cmd[3];
+  reply[4] = ok ? DIRECT_REPLY : DIRECT_REPLY_ERROR;
+  memcpy(reply + 5, vm.globals, vm.n_globals);
+  return (n + 2);
+}
+
+static int emu_download_left = 0;
+static int emu_download_handle = 0;  // handle of the download in progress, 0 if none
+
+static int emu_system_command(const unsigned char *cmd, int len, unsigned char *reply) {
+  // File downloads are accepted and thrown away, everything else just succeeds
+  int status = SUCCESS;
+
+  if (len > 9 && cmd[5] == BEGIN_DOWNLOAD) {
+    emu_download_left = cmd[6] | (cmd[7] << 8) | (cmd[8] << 16) | (cmd[9] << 24);
+    emu_download_handle = emu_download_handle % 250 + 1;
+  } else if (len > 6 && cmd[5] == CONTINUE_DOWNLOAD) {
+    if (cmd[6] != emu_download_handle) {
+      status = UNKNOWN_HANDLE;
+    } else {
+      emu_download_left -= len - 7;
+      if (emu_download_left <= 0) {
+        emu_download_left = 0;
+        status = END_OF_FILE;
+      }
+    }
+  }
+  memset(reply, 0, 9);
+  reply[0] = 7;
+  reply[2] = cmd[2];
+  reply[3] = cmd[3];
+  reply[4] = SYSTEM_REPLY;
+  reply[5] = cmd[5];
+  reply[6] = status;
+  reply[7] = emu_download_handle;
+  return (9);
+}
+
+int EMU_handle_command(const unsigned char *cmd, int len, unsigned char *reply, void *arg) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Run one command (len bytes, length field included) and build its reply. This has the
+  // signature of a BT_loopback_handler, so it can also serve the in-process "loop:" transport.
+  //
+  // Returns: length of the reply in reply[], 0 if the command asked for no reply
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  int n;
+
+  if (len < 7) return (0);
+  emu_stats.commands++;
+  if ((cmd[4] & 0x7F) == SYSTEM_COMMAND_REPLY)
+    n = emu_system_command(cmd, len, reply);
+  else
+    n = emu_direct_command(cmd, len, reply);
+
+  if (cmd[4] & 0x80) {
+    emu_stats.no_reply++;
+    return (0);
+  }
+  emu_stats.replies++;
+  if (emu_latency_ms > 0) usleep(emu_latency_ms * 1000);
+  return (n);
+}
+
+int EMU_init(const char *map_name, double x, double y, double heading) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Load the map and place the robot at x,y (pixels) facing heading (degrees clockwise from up).
+  // A negative x places it at the centre of the top-left intersection instead.
+  //
+  // Returns: 0 on success, -1 if the map can not be read
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  int w = 0, h = 0;
+
+  emu_map = readPPMimage(map_name, &emu_rx, &emu_ry);
+  if (emu_map == NULL) return (-1);
+
+  if (x < 0) {
+    // Scan for the first yellow pixel, as parse_map() does, and measure the intersection
+    x = y = 0;
+    for (int j = 0; j < emu_ry && w == 0; j++)
+      for (int i = 0; i < emu_rx && w == 0; i++)
+        if (emu_map_colour(i, j) == 4) {
+          while (emu_map_colour(i + w, j) == 4) w++;
+          while (emu_map_colour(i, j + h) == 4) h++;
+          x = i + w / 2.0;
+          y = j + h / 2.0;
+        }
+  }
+  emu_x = x;
+  emu_y = y;
+  emu_heading = heading;
+  emu_slide = 0;
+  memset(emu_motors, 0, sizeof(emu_motors));
+  emu_sim_time = emu_sound_end = emu_now();
+  EMU_reset_stats();
+  return (0);
+}
+
+void EMU_set_latency(int ms) { emu_latency_ms = ms > 0 ? ms : 0; }
+
+void EMU_get_pose(double *x, double *y, double *heading) {
+  emu_advance();
+  *x = emu_x;
+  *y = emu_y;
+  *heading = emu_heading;
+}
+
+void EMU_reset_stats(void) {
+  memset(&emu_stats, 0, sizeof(emu_stats));
+  emu_stats.start = emu_now();
+}
+
+void EMU_print_stats(FILE *f) {
+  double x, y, h;
+
+  EMU_get_pose(&x, &y, &h);
+  fprintf(f, "ev3emu: %.2fs, %d commands, %d round trips (reply requested), %d without reply, %d errors\n",
+          emu_now() - emu_stats.start, emu_stats.commands, emu_stats.replies, emu_stats.no_reply,
+          emu_stats.errors);
+  fprintf(f, "ev3emu: %d sensor mode switches\n", emu_stats.mode_switches);
+  fprintf(f, "ev3emu: opcodes:");
+  for (int i = 0; i < 256; i++)
+    if (emu_stats.opcodes[i]) fprintf(f, " 0x%02X:%d", i, emu_stats.opcodes[i]);
+  fprintf(f, "\nev3emu: robot at (%.1f, %.1f) heading %.1f, slide %.1f\n", x, y, h, emu_slide);
+}
+
+#ifndef EV3_EMULATOR_NO_MAIN
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+// Daemon
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+static volatile sig_atomic_t emu_quit = 0;
+
+static void emu_int_handler(int sig) { emu_quit = 1; }
+
+static int emu_listen(const char *address) {
+  // Open a listening socket for tcp:[host:]port or unix:/path
+  int fd, one = 1;
+
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, address + 5, sizeof(addr.sun_path) - 1);
+    unlink(addr.sun_path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+      perror("ev3emu: Unable to listen on unix socket ");
+      return (-1);
+    }
+    return (fd);
+  }
+  if (strncmp(address, "tcp:", 4) == 0) {
+    struct addrinfo hints, *res;
+    char host[256] = "";
+    const char *port = strrchr(address + 4, ':');
+    if (port == NULL) {
+      port = address + 4;
+    } else {
+      snprintf(host, sizeof(host), "%.*s", (int)(port - address - 4), address + 4);
+      port++;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0) {
+      fprintf(stderr, "ev3emu: Unable to resolve %s\n", address);
+      return (-1);
+    }
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (fd < 0 || bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, 1) < 0) {
+      perror("ev3emu: Unable to listen on tcp socket ");
+      freeaddrinfo(res);
+      return (-1);
+    }
+    freeaddrinfo(res);
+    return (fd);
+  }
+  fprintf(stderr, "ev3emu: Listen address must be tcp:[host:]port or unix:/path\n");
+  return (-1);
+}
+
+static int emu_read_full(int fd, unsigned char *buf, int n) {
+  int got = 0, r;
+  while (got < n) {
+    r = read(fd, buf + got, n - got);
+    if (r < 0 && errno == EINTR && !emu_quit) continue;
+    if (r <= 0) return (-1);
+    got += r;
+  }
+  return (0);
+}
+
+static void emu_serve(int fd) {
+  unsigned char cmd[1024], reply[1024], discard[256];
+  int len, keep, n, one = 1;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  EMU_reset_stats();
+  while (!emu_quit) {
+    if (emu_read_full(fd, cmd, 2) < 0) break;
+    len = cmd[0] | (cmd[1] << 8);
+    keep = MIN(len, 1022);
+    if (emu_read_full(fd, cmd + 2, keep) < 0) break;
+    for (int extra = len - keep; extra > 0; extra -= 256)
+      if (emu_read_full(fd, discard, MIN(extra, 256)) < 0) break;
+    n = EMU_handle_command(cmd, keep + 2, reply, NULL);
+    if (n > 0 && write(fd, reply, n) != n) break;
+  }
+  close(fd);
+  EMU_print_stats(stderr);
+}
+
+int main(int argc, char *argv[]) {
+  double x = -1, y = -1, heading = 90;
+  long seed = 1;
+  int lfd, fd, opt;
+
+  while ((opt = getopt(argc, argv, "p:s:l:")) != -1) {
+    if (opt == 'p') sscanf(optarg, "%lf,%lf,%lf", &x, &y, &heading);
+    else if (opt == 's') seed = atol(optarg);
+    else if (opt == 'l') EMU_set_latency(atoi(optarg));
+  }
+  if (argc - optind < 2) {
+    fprintf(stderr, "Usage: ev3emu map.ppm listen_address [-p x,y,heading] [-s seed] [-l latency_ms]\n");
+    fprintf(stderr, "    listen_address - tcp:port, tcp:host:port, or unix:/path\n");
+    exit(1);
+  }
+  srand48(seed);
+  if (EMU_init(argv[optind], x, y, heading) != 0) exit(1);
+  lfd = emu_listen(argv[optind + 1]);
+  if (lfd < 0) exit(1);
+
+  // No SA_RESTART, so Ctrl-C also breaks out of accept() and read()
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = emu_int_handler;
+  sigaction(SIGINT, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "ev3emu: Listening on %s, robot at (%.1f, %.1f) heading %.1f\n", argv[optind + 1], emu_x,
+          emu_y, emu_heading);
+  while (!emu_quit) {
+    fd = accept(lfd, NULL, NULL);
+    if (fd < 0) continue;
+    emu_serve(fd);
+  }
+  close(lfd);
+  free(emu_map);
+  exit(0);
+}
+#endif
@@ -0,0 +1,66 @@
+/*
+
+  EV3 brick emulator - a stand-in for the robot that speaks the EV3 direct-command protocol.
+
+  It implements the subset of the protocol used by btcomm.c (motor output opcodes, sensor reads
+  through opINPUT_DEVICE / opINPUT_READ / opINPUT_READEXT, sound, timers, and the file download
+  system commands), and answers it from a simulated robot driving in real time on a map image
+  loaded with readPPMimage().
+
+  The simulated robot is the one EV3_Localization.c drives: two drive wheels, a colour sensor on a
+  linear slide between two touch sensors, and a gyro. Port assignment and geometry are given by
+  the EMU_* constants below. Map pixels are taken to be 1mm.
+
+  Run it as a daemon and point the localization program at it:
+
+    ./ev3emu Map1.ppm tcp:5555 &
+    EV3_DEVICE=tcp:localhost:5555 ./localisation Map1.ppm 1 1
+
+  or link it in and serve the in-process "loop:" transport with EMU_handle_command().
+
+*/
+
+#ifndef __ev3_emulator_header
+#define __ev3_emulator_header
+
+#include "./EV3_RobotControl/btcomm.h"
+
+// Robot wiring - matches EV3_Localization.c
+#define EMU_COLOUR_PORT PORT_1
+#define EMU_GYRO_PORT PORT_2
+#define EMU_BACK_TOUCH_PORT PORT_3     // pushed when the colour sensor slide is fully retracted
+#define EMU_TOP_TOUCH_PORT PORT_4      // pushed when the colour sensor slide is fully extended
+#define EMU_RIGHT_WHEEL 0              // MOTOR_A
+#define EMU_SLIDE_MOTOR 1              // MOTOR_B
+#define EMU_LEFT_WHEEL 3               // MOTOR_D
+
+// Robot geometry and motor response (mm, mm/s, deg/s at 100% power)
+#define EMU_AXLE_WIDTH 120.0           // distance between the drive wheels
+#define EMU_WHEEL_SPEED 500.0          // wheel ground speed at full power
+#define EMU_MOTOR_DEG_PER_S 1000.0     // tacho rate at full power
+#define EMU_MOTOR_DEADBAND 5           // power (%) needed to get a motor moving
+#define EMU_MOTOR_LAG 0.08             // time constant (s) of motor speed changes
+#define EMU_SENSOR_OFFSET 60.0         // colour sensor ahead of the axle, slide retracted
+#define EMU_SLIDE_TRAVEL 50.0          // slide length between the two touch sensors
+#define EMU_SLIDE_SPEED 100.0          // slide speed at full power, positive power retracts
+#define EMU_SENSOR_RADIUS 3            // radius (pixels) of the spot the colour sensor averages
+#define EMU_COLOUR_NOISE 3.0           // std. deviation of raw RGB noise
+
+typedef struct {
+  int commands;          // direct + system commands received
+  int replies;           // commands that asked for a reply (= round trips)
+  int no_reply;          // commands sent without reply
+  int errors;            // commands answered with an error reply
+  int mode_switches;     // sensor reads that changed the colour or gyro sensor's mode
+  int opcodes[256];      // opcodes executed, by opcode
+  double start;          // time the connection was opened
+} EMU_stats;
+
+int EMU_init(const char *map_name, double x, double y, double heading);
+void EMU_set_latency(int ms);
+int EMU_handle_command(const unsigned char *cmd, int len, unsigned char *reply, void *arg);
+void EMU_get_pose(double *x, double *y, double *heading);
+void EMU_print_stats(FILE *f);
+void EMU_reset_stats(void);
+
+#endif
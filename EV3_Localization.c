@@ -90,6 +90,9 @@
 #include <signal.h>
 #include <time.h>
 #include <stdio.h>
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #define COLOUR_INPUT PORT_1
 #define GYRO_INPUT PORT_2
@@ -110,6 +113,10 @@
 #define SENSOR_WHEEL_POWER 50
 #define FORWARD_POWER 15
 #define TURN_POWER 10
+#define SLIGHT_TURN_DEGREES 3   // wheel rotation of one slight_robot_turn() step (about 1.5 degrees of heading)
+#define TURN_STEP_DEGREES 35    // wheel rotation between colour checks in turn_at_intersection()
+#define PUSH_STEP_DEGREES 15    // wheel rotation of one step off/onto an intersection
+#define TOUCH_DEBOUNCE_MS 5     // spacing of the touch reads that must all agree on a push
 #define whiteMax 305.0
 #define THRESHOLD_OF_CERTAINTY 0.8
 
@@ -118,18 +125,56 @@ typedef struct {
   int g;
   int b;
   int color;
-} colorReading;
-
-colorReading calibration_readings[30*6]; // 30 samples * 6 colors
-#define col_ptr(color) calibration_readings+(30*(color-1))
+} colorReading;             // One calibration sample, as stored in ./calibration
+
+// Calibration samples, one array per channel so the kNN kernel in colourFromRGB_kNN() works on 8
+// (AVX) or 4 (SSE2) samples per instruction. Colour c has the block of CALIBRATION_BLOCK entries
+// starting at (c-1)*CALIBRATION_BLOCK, the entries past its samples are padding far from any reading
+#define CALIBRATION_SAMPLES (30*6) // 30 samples * 6 colors
+#define CALIBRATION_BLOCK 32
+#define CALIBRATION_PAD (6*CALIBRATION_BLOCK)
+#define COLOUR_KNN_K 5
+struct {
+  float r[CALIBRATION_PAD] __attribute__((aligned(32)));
+  float g[CALIBRATION_PAD] __attribute__((aligned(32)));
+  float b[CALIBRATION_PAD] __attribute__((aligned(32)));
+  int n[6];                 // samples of each colour
+} calibration;
+
+// Per-colour model of the normalized readings: mean and spread of each channel over the colour's
+// calibration samples, so a reading can be scored against every colour instead of given just one.
+// The spread is kept at COLOUR_MODEL_MIN_SD or more - some colours were calibrated from samples that
+// barely vary, and would otherwise rule out a reading a few units away
+#define COLOUR_MODEL_MIN_SD 8.0
+#define COLOUR_LIKELIHOOD_FLOOR 0.02  // share of every reading's likelihood spread over all colours
+struct {
+  double mean[3];
+  double sd[3];
+} colour_model[6];
+int colour_models_ready = 0;
 
 int map[400][4];            // This holds the representation of the map, up to 20x20
                             // intersections, raster ordered, 4 building colours per
                             // intersection.
 int sx, sy;                 // Size of the map (number of intersections along x and y)
 double beliefs[400][4];     // Beliefs for each location and motion direction
+volatile int link_restored = 0;  // Set when btcomm reconnects to the EV3 after a dropped link
+double scan_likelihoods[4][7];   // Likelihood of each building colour from the last scan_intersection(),
+                                 // in the order of its tl, tr, br, bl results
+int sprt_decisions = 0, sprt_reads = 0;   // Totals over all confirm_colour() calls
+
+void link_restored_handler(void *arg){
+  // Called by btcomm once the link is back, the motors stopped and the sensor modes restored.
+  // beliefs[][] still hold, only the step that was under way has to be redone.
+  link_restored = 1;
+}
 
 void handle_out_of_bounds();
+void build_colour_table(void);
+int load_calibration(const char *path);
+void fit_colour_models(void);
+int normalizeBeliefs(int *robot_x, int *robot_y, int *direction);
+void sampler_stop(void);
 
 void playBeep(int mode){
   int tone_data[50][3];
@@ -163,10 +208,11 @@ void playBeep(int mode){
     tone_data[3][2]=1;
  }
  
- BT_play_tone_sequence(tone_data);
+ BT_play_tone_sequence_async(tone_data);  // queued, so scanning carries on while it plays
 }
 
 
+#ifndef EV3_LOCALIZATION_NO_MAIN   // Leave main() out when linking this file into other programs (e.g. ev3emu)
 int main(int argc, char *argv[])
 {
  char mapname[1024];
@@ -198,9 +244,9 @@ int main(int argc, char *argv[])
   * OPTIONAL TO DO: If you added code for sensor calibration, add just below this comment block any code needed to
   *   read your calibration data for use in your localization code. Skip this if you are not using calibration
   * ****************************************************************************************************************/
- FILE* f = fopen("./calibration", "r");
- fread(calibration_readings, sizeof(colorReading), 30*6, f);
- fclose(f);
+ if (load_calibration("./calibration") < 0)
+   fprintf(stderr,"No calibration data in ./calibration, colourFromRGB2() will not recognise any colour\n");
+ build_colour_table();   // colour lookup table, so classifying a reading costs one load
  
  // Your code for reading any calibration information should not go below this line //
  
@@ -243,6 +289,8 @@ int main(int argc, char *argv[])
   free(map_image);
   exit(1);
  }
+ BT_set_noreply_sync_interval(10);   // Pulsed motor loops send without reply; confirm the link every 10 commands
+ BT_set_reconnect_handler(link_restored_handler, NULL);   // A dropped link resumes the run instead of ending it
   
  fprintf(stderr,"All set, ready to go!\n");
  
@@ -290,16 +338,21 @@ int main(int argc, char *argv[])
  robot_localization(&x, &y, &dir);
  BT_all_stop(0);
  playBeep(1000);
+ if (sprt_decisions > 0) printf("Colour confirmations: %d, %.2f reads each\n", sprt_decisions, (double)sprt_reads / sprt_decisions);
 
+ BT_stats_tag("go_to_target");
  go_to_target(x, y, dir, dest_x, dest_y);
  BT_all_stop(0);
  playBeep(1000);
+ BT_audio_wait();
+ sampler_stop();
 
  // Cleanup and exit - DO NOT WRITE ANY CODE BELOW THIS LINE
  BT_close();
  free(map_image);
  exit(0);
 }
+#endif
 
 
 /*
@@ -333,38 +386,279 @@ int colourFromRGB(int RGB[3], int lastChosen){
 
  */
 
-int colourFromRGB2(int buf[3]) {
-  int min_sqdiff = 100, min_color = 7, curr_sqdiff;
-  for (int i = 0; i < 30*6; i++) {
-    curr_sqdiff = pow(buf[0] - calibration_readings[i].r, 2);
-    curr_sqdiff += pow(buf[1] - calibration_readings[i].g, 2);
-    curr_sqdiff += pow(buf[2] - calibration_readings[i].b, 2);
-    
-    if (curr_sqdiff < min_sqdiff) {
-      min_sqdiff = curr_sqdiff;
-      min_color = calibration_readings[i].color;
+int load_calibration(const char *path){
+  // Read the samples written by calibrate_sensor() into calibration. Returns how many were read,
+  // -1 if the file can not be opened
+  colorReading c;
+  FILE *f = fopen(path, "r");
+  int total = 0;
+  for (int i = 0; i < CALIBRATION_PAD; i++) calibration.r[i] = calibration.g[i] = calibration.b[i] = 1e6;
+  for (int i = 0; i < 6; i++) calibration.n[i] = 0;
+  colour_models_ready = 0;
+  if (f == NULL) return -1;
+  while (fread(&c, sizeof(colorReading), 1, f) == 1){
+    if (c.color < 1 || c.color > 6 || calibration.n[c.color-1] == CALIBRATION_BLOCK) continue;
+    int i = (c.color-1)*CALIBRATION_BLOCK + calibration.n[c.color-1]++;
+    calibration.r[i] = c.r;
+    calibration.g[i] = c.g;
+    calibration.b[i] = c.b;
+    total++;
+  }
+  fclose(f);
+  fit_colour_models();
+  return total;
+}
+
+// Samples each step of the kNN kernel works on
+#if defined(__AVX__)
+#define KNN_LANES 8
+#elif defined(__SSE2__)
+#define KNN_LANES 4
+#else
+#define KNN_LANES 1
+#endif
+
+void calibration_distances(int RGB[3], float *d, float *lane_d){
+  // Squared distance from the reading to every calibration sample (d[], padding included). Lane l
+  // of colour c's block also gets the closest of the samples it went through in lane_d[c*KNN_LANES
+  // + l]. The values are integers well below 2^24, so the float sums are exact
+#if defined(__AVX__)
+  __m256 r = _mm256_set1_ps(RGB[0]), g = _mm256_set1_ps(RGB[1]), b = _mm256_set1_ps(RGB[2]);
+  for (int c = 0; c < 6; c++){
+    __m256 m = _mm256_set1_ps(1e30);
+    for (int i = c*CALIBRATION_BLOCK; i < (c+1)*CALIBRATION_BLOCK; i += 8){
+      __m256 dr = _mm256_sub_ps(_mm256_load_ps(calibration.r + i), r);
+      __m256 dg = _mm256_sub_ps(_mm256_load_ps(calibration.g + i), g);
+      __m256 db = _mm256_sub_ps(_mm256_load_ps(calibration.b + i), b);
+      __m256 di = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)), _mm256_mul_ps(db, db));
+      _mm256_store_ps(d + i, di);
+      m = _mm256_min_ps(m, di);
+    }
+    _mm256_storeu_ps(lane_d + c*8, m);
+  }
+#elif defined(__SSE2__)
+  __m128 r = _mm_set1_ps(RGB[0]), g = _mm_set1_ps(RGB[1]), b = _mm_set1_ps(RGB[2]);
+  for (int c = 0; c < 6; c++){
+    __m128 m = _mm_set1_ps(1e30);
+    for (int i = c*CALIBRATION_BLOCK; i < (c+1)*CALIBRATION_BLOCK; i += 4){
+      __m128 dr = _mm_sub_ps(_mm_load_ps(calibration.r + i), r);
+      __m128 dg = _mm_sub_ps(_mm_load_ps(calibration.g + i), g);
+      __m128 db = _mm_sub_ps(_mm_load_ps(calibration.b + i), b);
+      __m128 di = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+      _mm_store_ps(d + i, di);
+      m = _mm_min_ps(m, di);
+    }
+    _mm_storeu_ps(lane_d + c*4, m);
+  }
+#else
+  for (int c = 0; c < 6; c++){
+    lane_d[c] = 1e30;
+    for (int i = c*CALIBRATION_BLOCK; i < (c+1)*CALIBRATION_BLOCK; i++){
+      float dr = calibration.r[i] - RGB[0], dg = calibration.g[i] - RGB[1], db = calibration.b[i] - RGB[2];
+      d[i] = dr*dr + dg*dg + db*db;
+      if (d[i] < lane_d[c]) lane_d[c] = d[i];
     }
   }
+#endif
+}
 
-  return min_color;
+void knn_insert(float *best_d, int *best_c, int *n, int k, float d, int colour){
+  // Add a sample to the k nearest found so far (*n of them, sorted by distance)
+  if (*n == k && d >= best_d[k-1]) return;
+  int j = *n < k ? (*n)++ : k-1;
+  for (; j > 0 && best_d[j-1] > d; j--){
+    best_d[j] = best_d[j-1];
+    best_c[j] = best_c[j-1];
+  }
+  best_d[j] = d;
+  best_c[j] = colour;
 }
 
-int colourFromRGB(int RGB[3]){
-  
-  if (RGB[0] < 0 || RGB[0] > 1020 || RGB[1] < 0 || RGB[1] > 1020 || RGB[2] < 0 || RGB[2] > 1020) return COLOUR_UNKNOWN;
+int colourFromRGB_kNN(int RGB[3], int k, double *nearest, double *margin){
+  // Classify a normalized reading by majority vote of the k (up to 6) nearest calibration samples.
+  // Ties go to the colour with the closer sample. *nearest gets the distance to the closest sample
+  // of the winning colour, and *margin how much further away the closest sample of any other colour
+  // is - a reading halfway between two colours has a margin near 0, and is worth reading again.
+  // Either pointer may be NULL
+  float d[CALIBRATION_PAD] __attribute__((aligned(32)));
+  float lane_d[6*KNN_LANES], class_d[6], best_d[6];
+  int best_c[6], votes[7] = {0}, n = 0, colour = COLOUR_UNKNOWN;
+
+  k = MAX(1, MIN(k, 6));
+  calibration_distances(RGB, d, lane_d);
+
+  // Each lane minimum is a different sample, so the k nearest are no further than the k-th
+  // smallest of them. Only samples within that bound are looked at one by one
+  for (int c = 0; c < 6; c++){
+    class_d[c] = 1e30;
+    for (int l = 0; l < KNN_LANES; l++){
+      class_d[c] = MIN(class_d[c], lane_d[c*KNN_LANES + l]);
+      knn_insert(best_d, best_c, &n, k, lane_d[c*KNN_LANES + l], 0);
+    }
+  }
+  float bound = best_d[n-1];
+  if (n < k || bound >= 1e12) return COLOUR_UNKNOWN;   // not enough samples calibrated
+  n = 0;
+
+#if defined(__AVX__)
+  __m256 bound8 = _mm256_set1_ps(bound);
+  for (int i = 0; i < CALIBRATION_PAD; i += 8)
+    for (int m = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_load_ps(d + i), bound8, _CMP_LE_OQ)); m; m &= m-1){
+      int at = i + __builtin_ctz(m);
+      knn_insert(best_d, best_c, &n, k, d[at], at/CALIBRATION_BLOCK + 1);
+    }
+#elif defined(__SSE2__)
+  __m128 bound4 = _mm_set1_ps(bound);
+  for (int i = 0; i < CALIBRATION_PAD; i += 4)
+    for (int m = _mm_movemask_ps(_mm_cmple_ps(_mm_load_ps(d + i), bound4)); m; m &= m-1){
+      int at = i + __builtin_ctz(m);
+      knn_insert(best_d, best_c, &n, k, d[at], at/CALIBRATION_BLOCK + 1);
+    }
+#else
+  for (int i = 0; i < CALIBRATION_PAD; i++)
+    if (d[i] <= bound) knn_insert(best_d, best_c, &n, k, d[i], i/CALIBRATION_BLOCK + 1);
+#endif
+
+  // Going from the nearest out, the first colour to reach the most votes wins the ties
+  for (int j = 0, most = 0; j < n; j++)
+    if (++votes[best_c[j]] > most){
+      most = votes[best_c[j]];
+      colour = best_c[j];
+    }
+
+  double runner_up = 1e30;
+  for (int c = 0; c < 6; c++)
+    if (c+1 != colour && class_d[c] < runner_up) runner_up = class_d[c];
+  if (nearest != NULL) *nearest = sqrt(class_d[colour-1]);
+  if (margin != NULL) *margin = sqrt(runner_up) - sqrt(class_d[colour-1]);
+  return colour;
+}
+
+int colourFromRGB2(int buf[3]) {
+  // Calibration based classifier: vote of the COLOUR_KNN_K nearest samples, unknown if the reading
+  // is 10 or more away from every sample of the winning colour
+  double nearest;
+  int colour = colourFromRGB_kNN(buf, COLOUR_KNN_K, &nearest, NULL);
+  return nearest < 10 ? colour : COLOUR_UNKNOWN;
+}
+
+int colourRules(int RGB[3]){
+  // The thresholds colourFromRGB() classifies by, for a normalized reading already range checked.
+  // Only used to fill in colour_table[]
   if (RGB[0] > 150 && RGB[1] > 150 && RGB[2] > 150) return COLOUR_WHITE;
   if (RGB[0] > 200 && RGB[1] < 100 && RGB[2] < 100) return COLOUR_RED;
   if (RGB[0] > 100 && RGB[1] > 100 && RGB[2] < 100) return COLOUR_YELLOW;
   if (RGB[0] < 50 && RGB[1] > 40 && RGB[2] < 60) return COLOUR_GREEN;
   if (RGB[2] > 75) return COLOUR_BLUE;
   if (RGB[0] < 50 && RGB[1] < 50 && RGB[2] < 50){
-    int c = BT_read_colour_sensor(COLOUR_INPUT);
-    return c == COLOUR_GREEN ? COLOUR_GREEN : COLOUR_BLACK;
+    // Dark green still has green well above red and above blue (about 22,38,34 against 12,12,18
+    // for black in the calibration data). Settling it from the RGB reading keeps the sensor in
+    // RGB mode - asking for the colour index would switch it over and back, settling each time
+    return (RGB[1] > 25 && RGB[1] > RGB[0] * 1.5 && RGB[1] > RGB[2]) ? COLOUR_GREEN : COLOUR_BLACK;
   }
   return COLOUR_UNKNOWN;
   //return BT_read_colour_sensor(COLOUR_INPUT);
 }
 
+// Colour of every normalized reading, looked up instead of running colourRules() each time. Each
+// channel is quantized to a level: one per value below 50, where the black/dark green test compares
+// channels with each other, then one per range of values colourRules() does not tell apart. The
+// ranges start at colour_level_edges[], the points where one of its thresholds flips - keep them in
+// step with the rules. Readings above 255 behave like 255, no threshold is that high.
+#define COLOUR_TABLE_BINS 64
+const int colour_level_edges[] = {50, 60, 76, 100, 101, 151, 201};
+unsigned char colour_level[256];   // level of each normalized channel value
+unsigned char colour_table[COLOUR_TABLE_BINS*COLOUR_TABLE_BINS*COLOUR_TABLE_BINS];
+int colour_table_ready = 0;
+
+void build_colour_table(void){
+  int first[COLOUR_TABLE_BINS];   // smallest value of each level, which it is classified at
+  int edges = sizeof(colour_level_edges)/sizeof(int), levels = 0, RGB[3];
+  for (int v=0, e=0; v<256; v++){
+    if (v < colour_level_edges[0]) first[levels++] = v;
+    else if (e < edges && v == colour_level_edges[e]){
+      first[levels++] = v;
+      e++;
+    }
+    colour_level[v] = levels - 1;
+  }
+  for (int r=0; r<levels; r++)
+    for (int g=0; g<levels; g++)
+      for (int b=0; b<levels; b++){
+        RGB[0] = first[r];
+        RGB[1] = first[g];
+        RGB[2] = first[b];
+        colour_table[(r*COLOUR_TABLE_BINS + g)*COLOUR_TABLE_BINS + b] = colourRules(RGB);
+      }
+  colour_table_ready = 1;
+}
+
+int colourFromRGB(int RGB[3]){
+  // Classify a normalized reading with one load from colour_table[]
+  if (RGB[0] < 0 || RGB[0] > 1020 || RGB[1] < 0 || RGB[1] > 1020 || RGB[2] < 0 || RGB[2] > 1020) return COLOUR_UNKNOWN;
+  if (!colour_table_ready) build_colour_table();
+  int r = colour_level[MIN(RGB[0], 255)];
+  int g = colour_level[MIN(RGB[1], 255)];
+  int b = colour_level[MIN(RGB[2], 255)];
+  return colour_table[(r*COLOUR_TABLE_BINS + g)*COLOUR_TABLE_BINS + b];
+}
+
+void fit_colour_models(void){
+  // Fit colour_model[] to the samples in calibration. Every colour needs at least 2 samples,
+  // otherwise colour_likelihoods() goes by colourFromRGB() alone
+  colour_models_ready = 1;
+  for (int c = 0; c < 6; c++){
+    int n = calibration.n[c];
+    float *channel[3] = {calibration.r, calibration.g, calibration.b};
+    if (n < 2){
+      colour_models_ready = 0;
+      continue;
+    }
+    for (int k = 0; k < 3; k++){
+      double sum = 0, sq = 0;
+      for (int i = c*CALIBRATION_BLOCK; i < c*CALIBRATION_BLOCK + n; i++){
+        sum += channel[k][i];
+        sq += channel[k][i] * channel[k][i];
+      }
+      colour_model[c].mean[k] = sum / n;
+      colour_model[c].sd[k] = MAX(COLOUR_MODEL_MIN_SD, sqrt(MAX(0.0, sq/n - (sum/n)*(sum/n))));
+    }
+  }
+}
+
+int colour_likelihoods(int RGB[3], double like[7]){
+  // Probability of each colour (like[COLOUR_BLACK] .. like[COLOUR_WHITE], like[0] and
+  // like[COLOUR_UNKNOWN] are left at 0) given a normalized reading, all colours equally likely
+  // beforehand. Returns the most likely colour. Without calibration data the colourFromRGB()
+  // answer gets most of the weight, and an unknown reading leaves every colour equally likely
+  int best = COLOUR_UNKNOWN;
+  like[0] = like[COLOUR_UNKNOWN] = 0;
+
+  if (!colour_models_ready){
+    best = colourFromRGB(RGB);
+    for (int c = 1; c <= 6; c++)
+      like[c] = best == COLOUR_UNKNOWN ? 1.0/6 : (c == best ? 1 - 5*COLOUR_LIKELIHOOD_FLOOR : COLOUR_LIKELIHOOD_FLOOR);
+    return best;
+  }
+
+  // Log density of the reading under each colour's model, channels taken as independent
+  double logp[7], top = -1e30, total = 0;
+  for (int c = 1; c <= 6; c++){
+    logp[c] = 0;
+    for (int k = 0; k < 3; k++){
+      double z = (RGB[k] - colour_model[c-1].mean[k]) / colour_model[c-1].sd[k];
+      logp[c] -= 0.5*z*z + log(colour_model[c-1].sd[k]);
+    }
+    if (logp[c] > top){
+      top = logp[c];
+      best = c;
+    }
+  }
+  for (int c = 1; c <= 6; c++) total += like[c] = exp(logp[c] - top);
+  for (int c = 1; c <= 6; c++) like[c] = (1 - 6*COLOUR_LIKELIHOOD_FLOOR) * like[c]/total + COLOUR_LIKELIHOOD_FLOOR;
+  return best;
+}
+
 void normalized_color_read(int* buf) {
   BT_read_colour_sensor_RGB(COLOUR_INPUT, buf);
 
@@ -381,6 +675,251 @@ int getColourFromSensor(){
   return colour;
 }
 
+int colour_prefetch = -1; // Ticket of the RGB read left in flight by getColourFromSensorPipelined()
+
+int getColourFromSensorPipelined(){
+  // Same as getColourFromSensor(), but keeps the next RGB read in flight so a polling loop
+  // gets a sample every time a reply arrives instead of paying a full round trip per call.
+  // The sample returned is one request old. Call dropColourPrefetch() when leaving the loop.
+  int RGB[3];
+  if (colour_prefetch < 0) colour_prefetch = BT_read_colour_sensor_RGB_submit(COLOUR_INPUT);
+  int ticket = colour_prefetch;
+  colour_prefetch = BT_read_colour_sensor_RGB_submit(COLOUR_INPUT);
+  BT_read_colour_sensor_RGB_complete(ticket, RGB);
+
+  for (int i = 0; i < 3; i++){
+    RGB[i] = (int) ((double)RGB[i] * 256.0 / whiteMax);
+  }
+  return colourFromRGB(RGB);
+}
+
+void dropColourPrefetch(){
+  int RGB[3];
+  if (colour_prefetch >= 0) BT_read_colour_sensor_RGB_complete(colour_prefetch, RGB);
+  colour_prefetch = -1;
+}
+
+// Background colour sampler. One thread keeps reading the colour sensor and pushes each reading,
+// timestamped and classified, into sampler_ring[] along with running filters over the latest ones:
+// the median of each channel and the most common colour over the last SAMPLER_WINDOW readings,
+// and an exponential moving average of each channel. Code waiting for the sensor to settle gets
+// readings that were taken while it slept instead of asking for new ones one round trip at a time.
+// The sampler thread is the only writer: it fills a slot, then publishes it by advancing
+// sampler_head. Readers keep their own cursor and never block the sampler; one that falls more
+// than SAMPLER_RING readings behind skips ahead to the oldest still in the ring
+#define SAMPLER_RING 256            // power of 2
+#define SAMPLER_WINDOW 3
+#define SAMPLER_INTERVAL_MS 10      // pause between reads, leaves the link free for other commands
+#define SAMPLER_EMA 0.3             // weight of each new reading in the moving average
+#define SAMPLER_WAIT_MS (3 * SAMPLER_INTERVAL_MS + BT_DEFAULT_TIMEOUT_MS)  // longest wait for the next reading
+
+typedef struct {
+  double t;                 // when the reading came back (CLOCK_MONOTONIC, seconds)
+  int RGB[3];               // normalized reading
+  int colour;               // colourFromRGB() of it
+  int median[3];            // per channel median of the last SAMPLER_WINDOW readings
+  int mode;                 // most common colour among them (the latest one on a tie)
+  int mode_count;           // and how many of them it is
+  double ema[3];            // exponential moving average of each channel
+} colour_sample;
+
+colour_sample sampler_ring[SAMPLER_RING];
+unsigned sampler_head = 0;     // readings published so far
+int sampler_running = 0;
+pthread_t sampler_thread;
+pthread_mutex_t sampler_lock = PTHREAD_MUTEX_INITIALIZER;   // held by the sampler while it reads
+
+double sampler_clock(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double sampler_deadline(void){
+  // Deadline for sampler_next() by which the next reading is overdue - the sensor or the link failed
+  return sampler_clock() + SAMPLER_WAIT_MS / 1000.0;
+}
+
+void sampler_unknown(colour_sample *out){
+  // What a reader takes in place of a reading that never came
+  out->t = sampler_clock();
+  out->colour = out->mode = COLOUR_UNKNOWN;
+  out->mode_count = SAMPLER_WINDOW;
+  for (int i = 0; i < 3; i++){
+    out->RGB[i] = out->median[i] = 0;
+    out->ema[i] = 0;
+  }
+}
+
+void sampler_filter(colour_sample *s, unsigned n, colour_sample *prev){
+  // Fill in the filters of the n-th reading (counting from 0). The window is the reading plus the
+  // ones before it in the ring - the sampler thread is the only one writing them, so they are stable
+  int window = MIN(n + 1, SAMPLER_WINDOW), counts[8] = {0};
+  for (int k = 0; k < 3; k++){
+    int v[SAMPLER_WINDOW];
+    for (int i = 0; i < window; i++){
+      v[i] = i == 0 ? s->RGB[k] : sampler_ring[(n - i) & (SAMPLER_RING - 1)].RGB[k];
+      for (int j = i; j > 0 && v[j-1] > v[j]; j--){
+        int t = v[j]; v[j] = v[j-1]; v[j-1] = t;
+      }
+    }
+    s->median[k] = v[window/2];
+    s->ema[k] = n == 0 ? s->RGB[k] : prev->ema[k] + SAMPLER_EMA * (s->RGB[k] - prev->ema[k]);
+  }
+  s->mode = s->colour;
+  s->mode_count = 0;
+  for (int i = 0; i < window; i++){
+    int c = i == 0 ? s->colour : sampler_ring[(n - i) & (SAMPLER_RING - 1)].colour;
+    if (++counts[c] > s->mode_count){
+      s->mode_count = counts[c];
+      s->mode = c;
+    }
+  }
+}
+
+void *sampler_main(void *arg){
+  unsigned n = 0;
+  while (__atomic_load_n(&sampler_running, __ATOMIC_ACQUIRE)){
+    colour_sample s;
+    pthread_mutex_lock(&sampler_lock);
+    int failed = BT_read_colour_sensor_RGB(COLOUR_INPUT, s.RGB) != 0;
+    pthread_mutex_unlock(&sampler_lock);
+    if (!failed){
+      s.t = sampler_clock();
+      for (int i = 0; i < 3; i++){
+        s.RGB[i] = (int) ((double)s.RGB[i] * 256.0 / whiteMax);
+      }
+      s.colour = colourFromRGB(s.RGB);
+      sampler_filter(&s, n, &sampler_ring[(n - 1) & (SAMPLER_RING - 1)]);
+      sampler_ring[n & (SAMPLER_RING - 1)] = s;
+      __atomic_store_n(&sampler_head, ++n, __ATOMIC_RELEASE);
+    }
+    usleep(1000 * SAMPLER_INTERVAL_MS);
+  }
+  return NULL;
+}
+
+void sampler_start(void){
+  // Start the sampler thread, if it is not running yet
+  if (sampler_running) return;
+  sampler_running = 1;
+  if (pthread_create(&sampler_thread, NULL, sampler_main, NULL) != 0){
+    fprintf(stderr,"Unable to start the colour sampler, reading the sensor directly\n");
+    sampler_running = -1;
+  }
+}
+
+void sampler_stop(void){
+  if (sampler_running != 1) return;
+  __atomic_store_n(&sampler_running, 0, __ATOMIC_RELEASE);
+  pthread_join(sampler_thread, NULL);
+}
+
+void sampler_pause(void){
+  // Hold off the sampler (once its read under way is back) while a long command has the brick busy
+  if (sampler_running == 1) pthread_mutex_lock(&sampler_lock);
+}
+
+void sampler_resume(void){
+  if (sampler_running == 1) pthread_mutex_unlock(&sampler_lock);
+}
+
+unsigned sampler_mark(void){
+  // Cursor for sampler_next() that skips every reading already published, and the one that may
+  // be on its way - only readings the sensor takes from now on are returned
+  return __atomic_load_n(&sampler_head, __ATOMIC_ACQUIRE) + 1;
+}
+
+int sampler_next(unsigned *cursor, colour_sample *out, double deadline){
+  // Copy the reading at *cursor to out and move the cursor past it, waiting for the sampler if it
+  // has not got there yet. Returns 0, or -1 if nothing arrived before deadline (sampler_clock()
+  // time, 0 to wait as long as it takes). Without a sampler thread it reads the sensor directly
+  sampler_start();
+  if (sampler_running != 1){
+    normalized_color_read(out->RGB);
+    out->t = sampler_clock();
+    out->colour = out->mode = colourFromRGB(out->RGB);
+    out->mode_count = 1;
+    for (int i = 0; i < 3; i++) out->median[i] = out->ema[i] = out->RGB[i];
+    return 0;
+  }
+  while (1){
+    unsigned head = __atomic_load_n(&sampler_head, __ATOMIC_ACQUIRE);
+    if (head - *cursor < SAMPLER_RING){     // published (head > cursor), and still in the ring
+      if (head != *cursor){
+        *out = sampler_ring[*cursor & (SAMPLER_RING - 1)];
+        // The copy is good if the sampler did not lap the slot while it was being made
+        if (__atomic_load_n(&sampler_head, __ATOMIC_ACQUIRE) - *cursor < SAMPLER_RING){
+          (*cursor)++;
+          return 0;
+        }
+      }
+    }else if ((int)(head - *cursor) > 0){
+      *cursor = head - SAMPLER_RING + 1;    // fell behind, skip to the oldest kept
+      continue;
+    }
+    if (deadline > 0 && sampler_clock() > deadline) return -1;
+    usleep(1000);
+  }
+}
+
+int sampler_settled(unsigned mark, colour_sample *out){
+  // The latest reading whose whole window was taken after mark (from sampler_mark() once the sensor
+  // came to rest), so its mode and median only cover the sensor as it is now - readings taken while
+  // the caller slept are used instead of asking for new ones. Keeps reading while no colour is most
+  // of the window. Returns the mode, COLOUR_UNKNOWN if a reading is overdue
+  unsigned cursor = mark + SAMPLER_WINDOW - 1;
+  unsigned head = __atomic_load_n(&sampler_head, __ATOMIC_ACQUIRE);
+  if ((int)(head - 1 - cursor) > 0) cursor = head - 1;
+  do {
+    if (sampler_next(&cursor, out, sampler_deadline()) != 0){
+      sampler_unknown(out);
+      break;
+    }
+  } while (out->mode_count * 2 <= SAMPLER_WINDOW && sampler_running == 1);
+  return out->mode;
+}
+
+// Sequential probability ratio test on the colour under the sensor: is it one of a set of colours
+// or not? Each reading moves the log likelihood ratio up (classified as one of the set) or down
+// (anything else), and reading stops as soon as it crosses either bound. The bounds come from the
+// error rates asked for - alpha, confirming a colour that is not there, and beta, missing one that
+// is - given how often a reading over the colour is classified as it (hit) and how often a reading
+// over something else is (false_hit). Clear cases take 2 reads, mixed ones keep reading, up to
+// max_reads after which the ratio's sign decides
+typedef struct {
+  double alpha;
+  double beta;
+  double hit;
+  double false_hit;
+  int max_reads;
+} colour_sprt;
+
+#define COLOUR_MASK(c) (1 << (c))
+const colour_sprt sprt_default = {0.01, 0.05, 0.95, 0.05, 8};
+
+int confirm_colour(int mask, const colour_sprt *test){
+  // Returns 1 when the sensor is over one of the colours in mask (COLOUR_MASK(c) | ...), 0 when
+  // not. Takes the readings the sampler gets from the call on, an overdue one counts as COLOUR_UNKNOWN
+  colour_sample sample;
+  unsigned cursor = sampler_mark();
+  double accept = log((1 - test->beta) / test->alpha);
+  double reject = log(test->beta / (1 - test->alpha));
+  double up = log(test->hit / test->false_hit);
+  double down = log((1 - test->hit) / (1 - test->false_hit));
+  double llr = 0;
+  int reads = 0;
+
+  while (llr < accept && llr > reject && reads < test->max_reads){
+    if (sampler_next(&cursor, &sample, sampler_deadline()) != 0) sampler_unknown(&sample);
+    llr += (mask & COLOUR_MASK(sample.colour)) ? up : down;
+    reads++;
+  }
+  sprt_decisions++;
+  sprt_reads += reads;
+  return llr > 0;
+}
+
 int read_touch_robust(int port) {
   for (int i = 0; i < 3; i++) { // Too many bluetooth calls slows down tha program
     if (BT_read_touch_sensor(port) == 0) return 0;
@@ -388,6 +927,52 @@ int read_touch_robust(int port) {
   return 1;
 }
 
+void wait_for_touch(int port) {
+  // Blocks until the same rule as read_touch_robust() holds (3 pushed reads in a row), but
+  // keeps 3 reads in flight so each new sample only waits for the next reply to arrive
+  int tickets[3], pushed = 0, i;
+  for (i = 0; i < 3; i++) tickets[i] = BT_read_touch_sensor_submit(port);
+  for (i = 0; pushed < 3; i = (i + 1) % 3) {
+    pushed = BT_read_touch_sensor_complete(tickets[i]) == 1 ? pushed + 1 : 0;
+    tickets[i] = pushed < 3 ? BT_read_touch_sensor_submit(port) : -1;
+  }
+  for (i = 0; i < 3; i++) BT_read_touch_sensor_complete(tickets[i]);
+}
+
+int read_sensors_batched(int touch_port, int *touched, int *angle){
+  // Colour plus, optionally, the read_touch_robust() rule on touch_port (3 touch reads,
+  // TOUCH_DEBOUNCE_MS apart on the brick so they are 3 samples, not one read three times) and
+  // the gyro angle, all packed in one direct command - one round trip instead of 2 to 5.
+  // Pass touch_port=-1 / angle=NULL to leave those out. Returns the colour like getColourFromSensor()
+  BT_batch batch;
+  int RGB[3], rgb_at, touch_at[3], gyro_at = -1;
+
+  BT_batch_begin(&batch);
+  rgb_at = BT_batch_add_colour_RGB(&batch, COLOUR_INPUT);
+  if (touch_port >= 0){
+    for (int i = 0; i < 3; i++){
+      if (i > 0) BT_batch_add_wait(&batch, TOUCH_DEBOUNCE_MS);
+      touch_at[i] = BT_batch_add_touch(&batch, touch_port);
+    }
+  }
+  if (angle != NULL) gyro_at = BT_batch_add_gyro(&batch, GYRO_INPUT);
+  if (BT_batch_commit(&batch) != 0) return COLOUR_UNKNOWN;
+
+  if (touch_port >= 0){
+    *touched = 1;
+    for (int i = 0; i < 3; i++){
+      if (BT_batch_get_touch(&batch, touch_at[i]) == 0) *touched = 0;
+    }
+  }
+  if (angle != NULL) *angle = BT_batch_get_gyro(&batch, gyro_at);
+
+  BT_batch_get_colour_RGB(&batch, rgb_at, RGB);
+  for (int i = 0; i < 3; i++){
+    RGB[i] = (int) ((double)RGB[i] * 256.0 / whiteMax);
+  }
+  return colourFromRGB(RGB);
+}
+
 void shift_color_sensor(int shift_mode) {
   // shift_mode 1: Extended, 0: Retracted
   //printf("Shifting robot color sensor\n");
@@ -395,9 +980,17 @@ void shift_color_sensor(int shift_mode) {
   int flag = 0; // Result of last touch sensor read
   int touch_port = shift_mode == 0 ? BACK_TOUCH_INPUT : TOP_TOUCH_INPUT;
   int power_direction = shift_mode == 0 ? 1 : -1;
-  BT_motor_port_start(SENSOR_WHEEL_OUTPUT, SENSOR_WHEEL_POWER * power_direction);
-  while (!read_touch_robust(touch_port)) {}
-  BT_all_stop(0);
+  // The brick runs the slide until 3 pushed reads in a row, BT_TOUCH_POLL_MS apart (the
+  // read_touch_robust() rule), and stops it, all in one command
+  sampler_pause();
+  int reached = BT_motor_until_touch(SENSOR_WHEEL_OUTPUT, SENSOR_WHEEL_POWER * power_direction, touch_port, 3, 5000, NULL);
+  sampler_resume();
+  if (reached < 0){
+    printf("Colour sensor slide failed, no valid reply from the EV3\n");
+  }else if (reached == 0){
+    printf("Colour sensor slide did not reach the touch sensor\n");
+  }
+  BT_all_stop_noreply(0);
   //usleep(1000*100);
   //BT_timed_motor_port_start_v2(SENSOR_WHEEL_OUTPUT, SENSOR_WHEEL_POWER * -power_direction, 50);
 }
@@ -409,21 +1002,56 @@ void shift_sensor_until_color(int color, int shift_mode) {
   int power_direction = shift_mode == 0 ? 1 : -1;
   int color_read;
   while (getColourFromSensor() != color && read_touch_robust(touch_port) == 0) {
-    BT_motor_port_start(SENSOR_WHEEL_OUTPUT, SENSOR_WHEEL_POWER * power_direction);
+    BT_motor_port_start_noreply(SENSOR_WHEEL_OUTPUT, SENSOR_WHEEL_POWER * power_direction);
     usleep(1000*25);
-    BT_all_stop(0);
+    BT_all_stop_noreply(0);
     usleep(1000*100);
   }
 }
 
 void slight_robot_turn(int amount){
-    BT_motor_port_start(LEFT_WHEEL_OUTPUT, amount);
-    BT_motor_port_start(RIGHT_WHEEL_OUTPUT, -amount);
-    usleep(1000 * 125);
-    BT_all_stop(0);
+    // Spin on the spot by a fixed wheel rotation (left wheel at amount, right wheel opposite),
+    // one command that returns once the brick has finished the move
+    sampler_pause();
+    BT_step_sync(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, amount, 200, SLIGHT_TURN_DEGREES, 1);
+    sampler_resume();
     usleep(1000 * 125);
 }
 
+int read_gyro_checked(int *angle){
+  // BT_read_gyro_sensor() returns -1 on failure, which is also a valid angle - a batch of one read
+  // tells the two apart. Returns 0, or -1 if there was no valid reply
+  BT_batch batch;
+  int at;
+
+  BT_batch_begin(&batch);
+  at = BT_batch_add_gyro(&batch, GYRO_INPUT);
+  if (BT_batch_commit(&batch) != 0) return -1;
+  *angle = BT_batch_get_gyro(&batch, at);
+  return 0;
+}
+
+void turn_to_heading(int heading){
+    // Spin back to a gyro heading read earlier: one move for most of the way (SLIGHT_TURN_DEGREES
+    // of wheel rotation give about 1.5 degrees of heading), then slight turns to within 2 degrees.
+    // Gives up on a failed gyro read, or after twice the slight turns the error should take
+    int curAngle = heading, steps, ok = read_gyro_checked(&curAngle) == 0;
+    int turnDir = heading > curAngle ? 1 : -1;
+    if (ok && abs(heading - curAngle) > 10){
+      sampler_pause();
+      BT_step_sync(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, turnDir * TURN_POWER, 200,
+                   (abs(heading - curAngle) - 5) * SLIGHT_TURN_DEGREES * 2 / 3, 1);
+      sampler_resume();
+      ok = read_gyro_checked(&curAngle) == 0;
+    }
+    steps = abs(heading - curAngle) * 4 / 3 + 1;
+    while (ok && abs(heading - curAngle) > 2 && steps-- > 0){
+      slight_robot_turn((heading > curAngle ? 1 : -1) * TURN_POWER);
+      ok = read_gyro_checked(&curAngle) == 0;
+    }
+    if (!ok) printf("Unable to read the gyro, stopped turning back to the scan heading\n");
+}
+
 int check_line_is_black(){
   // Case 1: Black - not black - Black  -> Not valid
   // Case 2: Black (extended) - not black (retracted); 
@@ -431,13 +1059,15 @@ int check_line_is_black(){
   
   // Step 1: Scan line and see if there is a white in between black
   int isOnRoad = 1;
-  while (read_touch_robust(BACK_TOUCH_INPUT) == 0){
-    BT_motor_port_start(SENSOR_WHEEL_OUTPUT, SENSOR_WHEEL_POWER);
+  int retracted = read_touch_robust(BACK_TOUCH_INPUT);
+  while (retracted == 0){
+    BT_motor_port_start_noreply(SENSOR_WHEEL_OUTPUT, SENSOR_WHEEL_POWER);
     usleep(1000*50);
-    BT_all_stop(0);
+    BT_all_stop_noreply(0);
     usleep(1000*100);
     
-    int color_read = getColourFromSensor();
+    // Colour and the next limit switch check are taken at the same spot, so read them together
+    int color_read = read_sensors_batched(BACK_TOUCH_INPUT, &retracted, NULL);
     int nowOnRoad = (color_read == COLOUR_BLACK || color_read == COLOUR_YELLOW);
     //if (!isOnRoad && nowOnRoad) return 0; // We shifted back onto the road, this is probably an intersection looking 45 degrees
     //nowOnRoad = isOnRoad;
@@ -518,14 +1148,14 @@ int get_angle_for_black_in_dir(int dir){
         cur_colour = getColourFromSensor();
     }
 
-    // retract a bit until back on black
+    // retract a bit until back on black, reading the angle along with each colour
+    int ans = 0; // cur_colour is not black here, so the loop runs at least once
     while (cur_colour != COLOUR_BLACK){
         slight_robot_turn(-dir * TURN_POWER);
-        cur_colour = getColourFromSensor();
+        cur_colour = read_sensors_batched(-1, NULL, &ans);
     }
 
     // Return that angle
-    int ans = BT_read_gyro_sensor(GYRO_INPUT);
     printf("Angle is %d\n", ans);
     return ans;
 }
@@ -585,9 +1215,9 @@ void handle_out_of_bounds() {
   shift_color_sensor(0);
   while (read_touch_robust(TOP_TOUCH_INPUT) == 0) {
     shift_sensor_until_color(COLOUR_RED, 1);
-    BT_drive(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, -FORWARD_POWER);
+    BT_drive_noreply(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, -FORWARD_POWER);
     usleep(1000*150);
-    BT_all_stop(0);
+    BT_all_stop_noreply(0);
     usleep(1000*150);
   }
   
@@ -597,9 +1227,9 @@ void handle_out_of_bounds() {
   // Move up until the extended is lined up with red
   shift_color_sensor(1);
   while (getColourFromSensor() != COLOUR_RED){
-    BT_drive(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, FORWARD_POWER/2);
+    BT_drive_noreply(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, FORWARD_POWER/2);
     usleep(1000*150);
-    BT_all_stop(0);
+    BT_all_stop_noreply(0);
     usleep(1000*150);
   }
   
@@ -633,9 +1263,10 @@ int find_street(void)
   shift_color_sensor(0);
   if (getColourFromSensor() != COLOUR_BLACK && getColourFromSensor() != COLOUR_YELLOW){
     BT_drive(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, -FORWARD_POWER);
-    while (getColourFromSensor() != COLOUR_BLACK && getColourFromSensor() != COLOUR_YELLOW){}
+    while (getColourFromSensorPipelined() != COLOUR_BLACK && getColourFromSensorPipelined() != COLOUR_YELLOW){}
   }
   BT_all_stop(0);
+  dropColourPrefetch();
 
   printf("Finished finding road\n");
   fflush(stdout);
@@ -665,21 +1296,33 @@ int drive_along_street(int lineUP)
   shift_color_sensor(0);
   printf("Driving on road\n");
   fflush(stdout);
-  BT_drive(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, FORWARD_POWER);
-  
+
+  // The brick watches the colour sensor and stops the wheels itself as soon as the reading leaves
+  // black (all normalized channels < 50, see colourFromRGB()), so the stopping point does not
+  // depend on Bluetooth latency. Each call returns after one stop (or 10s of driving).
+  int black_lo[3] = {0, 0, 0};
+  int black_hi[3];
+  for (int i = 0; i < 3; i++) black_hi[i] = (int) (50.0 * whiteMax / 256.0);
+
   while (1){
-    int col = getColourFromSensor();
+    int RGB[3];
+    sampler_pause();   // the brick runs the drive as one command, reads sent meanwhile would queue behind it
+    int changed = BT_drive_until_colour_change(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, FORWARD_POWER, COLOUR_INPUT,
+                                               black_lo, black_hi, 10000, RGB);
+    sampler_resume();
+    if (changed < 0) return 0;
+    if (changed == 0) continue;
+
+    for (int i = 0; i < 3; i++){
+      RGB[i] = (int) ((double)RGB[i] * 256.0 / whiteMax);
+    }
+    int col = colourFromRGB(RGB);
     if (col == COLOUR_BLACK || col == COLOUR_UNKNOWN) continue;
-    
-    // we're on something else, stop and figure it out
-    BT_all_stop(0);
-    
+
     // Check more rigorously 
-    if (!(col == getColourFromSensor() && col == getColourFromSensor())){
+    if (!confirm_colour(COLOUR_MASK(col), &sprt_default)){
       printf("Stopping because of colour but might be too early to tell\n");
       usleep(1000 * 100);
-      BT_drive(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, FORWARD_POWER);
-      usleep(1000 * 10);
       continue;
     }
     
@@ -694,13 +1337,39 @@ int drive_along_street(int lineUP)
     find_street(); 
     align_robot(1, 0, 0);
     shift_color_sensor(0);
-    BT_drive(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, FORWARD_POWER);
   }
 
   return 0; // something is wrong
 }
 
+void add_building_likelihood(int RGB[3], double building[7]){
+  // Add one reading's likelihood of each building colour to the sums in building[]
+  double like[7];
+  colour_likelihoods(RGB, like);
+  building[COLOUR_BLUE] += like[COLOUR_BLUE];
+  building[COLOUR_GREEN] += like[COLOUR_GREEN];
+  building[COLOUR_WHITE] += like[COLOUR_WHITE];
+}
+
+void building_likelihood(double building[7], double like[7]){
+  // Turn the sums from add_building_likelihood() into the likelihood of each building colour,
+  // with COLOUR_LIKELIHOOD_FLOOR kept on each so a quadrant read wrong can still be outvoted by
+  // the others. No readings leaves all three equally likely
+  const int colours[3] = {COLOUR_BLUE, COLOUR_GREEN, COLOUR_WHITE};
+  double total = building[COLOUR_BLUE] + building[COLOUR_GREEN] + building[COLOUR_WHITE];
+  for (int c = 0; c < 7; c++) like[c] = 0;
+  for (int i = 0; i < 3; i++){
+    int c = colours[i];
+    like[c] = total > 0 ? (1 - 3*COLOUR_LIKELIHOOD_FLOOR) * building[c]/total + COLOUR_LIKELIHOOD_FLOOR : 1.0/3;
+  }
+}
+
 int turn_at_intersection(int turn_direction)
+{
+  return turn_and_scan(turn_direction, NULL);
+}
+
+int turn_and_scan(int turn_direction, double like[7])
 {
  /*
   * This function is used to have the robot turn either left or right at an intersection (obviously your bot can not just
@@ -724,16 +1393,17 @@ int turn_at_intersection(int turn_direction)
   int seenWhite = 0;
   int seenBlue = 0;
   int seenGreen = 0;
+  // Besides the votes, add up how likely each building colour is over the readings counted as
+  // votes. like[] ends up with that, scaled to add up to 1 over blue, green and white
+  double building[7] = {0};
   while (1){
     BT_all_stop(1);
+    unsigned stopped = sampler_mark();
     usleep(1000*150);
-    int newReading;
-    while (1){
-      newReading = getColourFromSensor();
-      if (newReading == getColourFromSensor()){
-        break;
-      }
-    }
+    // Colour most of the readings since the stop agree on, and the median of each channel
+    colour_sample settled;
+    int newReading = sampler_settled(stopped, &settled);
+    int *RGB = settled.median;
     
 
     //printf("Scanned colour %d, expected %d\n", newReading, expectedColour);
@@ -742,6 +1412,7 @@ int turn_at_intersection(int turn_direction)
       if (newReading == COLOUR_GREEN) seenGreen+=1;
       if (newReading == COLOUR_BLUE) seenBlue+=1;
       if (newReading == COLOUR_WHITE) seenWhite+=1;
+      add_building_likelihood(RGB, building);
       expectedColour = newReading;
     }else if (newReading == COLOUR_BLACK && expectedColour != COLOUR_BLACK){
       int i = -1;
@@ -751,14 +1422,25 @@ int turn_at_intersection(int turn_direction)
 
       printf("Finsihed turn with mid colour %d\n", i);
       fflush(stdout);
+      if (like != NULL) building_likelihood(building, like);
       //BT_all_stop(0);
       return i;
     }
 
     //lastReading = newReading;
-    BT_motor_port_start(LEFT_WHEEL_OUTPUT, TURN_POWER * turn_direction);
-    BT_motor_port_start(RIGHT_WHEEL_OUTPUT, TURN_POWER * turn_direction * -1);
-    usleep(1000*350);
+    unsigned turning = sampler_mark();
+    BT_step_sync(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, TURN_POWER * turn_direction, 200, TURN_STEP_DEGREES, 0);
+
+    // Instead of sleeping through the turn, count the building colours the sampler reads on the
+    // way as extra votes
+    colour_sample swept;
+    double until = sampler_clock() + 0.35;
+    while (sampler_next(&turning, &swept, until) == 0 && swept.t < until){
+      if (swept.colour == COLOUR_GREEN) seenGreen+=1;
+      if (swept.colour == COLOUR_BLUE) seenBlue+=1;
+      if (swept.colour == COLOUR_WHITE) seenWhite+=1;
+      if (swept.colour == COLOUR_GREEN || swept.colour == COLOUR_BLUE || swept.colour == COLOUR_WHITE) add_building_likelihood(swept.RGB, building);
+    }
   }
 
   return(0);
@@ -798,12 +1480,15 @@ int scan_intersection(int *tl, int *tr, int *br, int *bl)
   int colourScans[4];
   shift_color_sensor(1);
   for (int i =0; i<4; i++){
-    colourScans[i] = turn_at_intersection(1);
+    colourScans[i] = turn_and_scan(1, scan_likelihoods[i]);
     playBeep(colourScans[i]);
   }
 
-  BT_motor_port_start(LEFT_WHEEL_OUTPUT, TURN_POWER);
-  BT_motor_port_start(RIGHT_WHEEL_OUTPUT, TURN_POWER * -1);
+  // Both wheels start in the same packet, so the spin does not begin as a pivot on one wheel
+  BT_actuator_begin();
+  BT_motor_port_start_noreply(LEFT_WHEEL_OUTPUT, TURN_POWER);
+  BT_motor_port_start_noreply(RIGHT_WHEEL_OUTPUT, TURN_POWER * -1);
+  BT_actuator_flush();
   usleep(1000*500);
   BT_all_stop(1);
 
@@ -934,17 +1619,12 @@ void pushOffIntersection(void){
   //find_street();
   shift_color_sensor(0);
   while (1){
-    BT_drive(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, FORWARD_POWER);
-    usleep(1000 * 100);
-    BT_all_stop(0);
+    sampler_pause();
+    BT_step_sync(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, FORWARD_POWER, 0, PUSH_STEP_DEGREES, 1);
+    sampler_resume();
     usleep(1000 * 50);
 
-    int pass = 0;
-    for (int i=0; i<3; i++){
-      if (!(getColourFromSensor() == COLOUR_YELLOW || getColourFromSensor() == COLOUR_UNKNOWN)) pass += 1;
-    }
-    if (pass==3)break;
-    
+    if (confirm_colour(~(COLOUR_MASK(COLOUR_YELLOW) | COLOUR_MASK(COLOUR_UNKNOWN)), &sprt_default)) break;
 
   }
   BT_all_stop(0);
@@ -954,17 +1634,12 @@ void pushBackOntoIntersection(void){
   //find_street();
   shift_color_sensor(0);
   while (1){
-    BT_drive(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, FORWARD_POWER);
-    usleep(1000 * 100);
-    BT_all_stop(0);
+    sampler_pause();
+    BT_step_sync(LEFT_WHEEL_OUTPUT, RIGHT_WHEEL_OUTPUT, FORWARD_POWER, 0, PUSH_STEP_DEGREES, 1);
+    sampler_resume();
     usleep(1000 * 50);
 
-    int pass = 0;
-    for (int i=0; i<3; i++){
-      if (getColourFromSensor() == COLOUR_YELLOW ) pass += 1;
-    }
-    if (pass==3)break;
-    
+    if (confirm_colour(COLOUR_MASK(COLOUR_YELLOW), &sprt_default)) break;
 
   }
   BT_all_stop(0);
@@ -1046,6 +1721,35 @@ int updateLocation(int *colours, int lastCommand, int *robot_x, int *robot_y, in
         }
     }
 
+    return normalizeBeliefs(robot_x, robot_y, direction);
+}
+
+int updateLocationSoft(double likelihoods[4][7], int lastCommand, int *robot_x, int *robot_y, int *direction, int isFirst){
+    // Same as updateLocation(), but weighs each intersection and heading by how likely the scan is
+    // there - the product of the likelihoods of the map's 4 building colours, in the order
+    // updateLocation() takes the colours (see building_likelihood()). A quadrant read wrong costs
+    // the right hypothesis one small factor instead of ruling it out
+    if (!isFirst){
+      shiftBeliefs(lastCommand);
+    }
+
+    printf("Determining location based on likelihoods\n");
+    for (int index = 0; index < sx * sy; index++){
+        double scan[4], all = 0;
+        for (int off = 0; off < 4; off++){
+            scan[off] = 1;
+            for (int check = 0; check < 4; check++) scan[off] *= likelihoods[check][map[index][(check + off) % 4]];
+            all += scan[off];
+        }
+
+        // As in updateLocation(), the scan lends a little weight to the other headings here
+        for (int d = 0; d < 4; d++) beliefs[index][d] *= 0.95*scan[d] + 0.05*(all - scan[d])/3;
+    }
+
+    return normalizeBeliefs(robot_x, robot_y, direction);
+}
+
+int normalizeBeliefs(int *robot_x, int *robot_y, int *direction){
     // Normalize the new beliefs
     double total = 0;
     for (int i = 0; i < sx * sy * 4; i++) total += beliefs[i / 4][i % 4];
@@ -1133,8 +1837,10 @@ int robot_localization(int *robot_x, int *robot_y, int *direction)
   int alreadyAligned = 0;
 
   while (1){
-    // Drives until next intersection
+    // Drives until next intersection. Each stage tags its commands, so the stats printed at exit
+    // (see BT_stats_tag()) show where the time went
     int status;
+    BT_stats_tag("drive_along_street");
     if (alreadyAligned){
       alreadyAligned = 0;
       status = drive_along_street(0);
@@ -1146,15 +1852,33 @@ int robot_localization(int *robot_x, int *robot_y, int *direction)
     fflush(stdout);
     
     if (status == 1){
-      align_robot(1, 0, 1); // Make sure we're properly lined up
-
       int tl, tr, br, bl;
-      scan_intersection(&tl, &tr, &br, &bl);
+      BT_stats_tag("scan_intersection");
+      align_robot(1, 0, 1); // Make sure we're properly lined up
+      int scanHeading = BT_read_gyro_sensor(GYRO_INPUT);
+      link_restored = 0;
+      while (1){
+        scan_intersection(&tl, &tr, &br, &bl);
+        if (!link_restored) break;
+        // The link to the EV3 dropped during the scan, so the robot was stopped part way through a
+        // turn and some readings are missing. Face the street the scan started from again, line up
+        // and scan again, keeping the beliefs and lastAction
+        printf("Link to the EV3 was restored, scanning the intersection again\n");
+        link_restored = 0;
+        turn_to_heading(scanHeading);
+        align_robot(1, 0, 1);
+      }
       printf("Finished scanning with codes %d %d %d %d\n", tl, tr, br, bl);
       
-      int colours[] = {bl, tl, tr, br};
+      // Weigh the beliefs by how likely the readings are at each intersection (see
+      // updateLocationSoft()), rather than only by whether the 4 colours voted for match exactly
+      double likelihoods[4][7];
+      memcpy(likelihoods[0], scan_likelihoods[3], sizeof(likelihoods[0]));
+      memcpy(likelihoods[1], scan_likelihoods[0], sizeof(likelihoods[0]));
+      memcpy(likelihoods[2], scan_likelihoods[1], sizeof(likelihoods[0]));
+      memcpy(likelihoods[3], scan_likelihoods[2], sizeof(likelihoods[0]));
       if (lastAction > -1){
-        if (updateLocation(colours, lastAction, robot_x, robot_y, direction, firstCall)){
+        if (updateLocationSoft(likelihoods, lastAction, robot_x, robot_y, direction, firstCall)){
             // We're done!
             return 1;
         }
@@ -1162,6 +1886,7 @@ int robot_localization(int *robot_x, int *robot_y, int *direction)
         printBeliefs(beliefs);
       }
 
+      BT_stats_tag("leave_intersection");
       c = (c + 1)%2;
       if (c==0){
         // Rotate to keep scanning
@@ -1176,6 +1901,7 @@ int robot_localization(int *robot_x, int *robot_y, int *direction)
       if (result==1) alreadyAligned=1;
       
     }else if (status == 2){
+      BT_stats_tag("handle_out_of_bounds");
       handle_out_of_bounds();
       lastAction = -1;
 
@@ -79,6 +79,9 @@ int find_street(void);
 int drive_along_street(void);
 int scan_intersection(int *tl, int *tr, int *br, int *bl);
 int turn_at_intersection(int turn_direction);
+int turn_and_scan(int turn_direction, double like[7]);
+void link_restored_handler(void *arg);
+void turn_to_heading(int heading);
 void calibrate_sensor(void);
 unsigned char *readPPMimage(const char *filename, int *rx, int*ry);
 
@@ -36,69 +36,1046 @@
  *
  * ********************************************************************************************************************/
 #include "btcomm.h"
+#include "btpacket.h"  // compile-time templates for the most frequent commands
 
 //#define __BT_debug			// Uncomment to trigger printing of BT
 // messages for debug purposes
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sessions
+//
+// Everything about the connection to one EV3 lives in a BT_session: the transport, the message id
+// counter, the commands in flight and the receive buffer. Each session runs an I/O thread that owns
+// the receiving side of the connection, framing every reply and handing it to the command waiting
+// for its message id. Senders take the session's write lock for the time it takes to write one
+// command, so commands from different threads never interleave on the wire. Any number of threads
+// can therefore issue commands on one session at once, and one process can hold sessions to
+// several bricks.
+//
+// BT_open() opens the default session. Every BT_* call acts on the calling thread's session - the
+// default one, unless the thread picked another with BT_session_use().
+//
+// Every command that expects a reply is given a slot keyed by the 2-byte message id stamped into
+// its header, so several commands can be in flight at once instead of paying a full round trip per
+// command. Each slot also carries a deadline. The transport is non-blocking and every wait is
+// bounded by poll() or a timed condition wait, so a reply that never comes costs BT_complete() the
+// command's timeout (BT_set_timeout()) instead of hanging the program. The slot is then released,
+// and if the reply turns up later its id no longer matches anything and it is dropped.
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+typedef struct {
+  int busy;         // 1 while the slot is waiting for (or holding) a reply
+  int id;           // 16-bit message id of the command that owns the slot
+  int done;         // 1 once the reply has been received
+  int len;          // length of the reply, including the 2-byte length field
+  double deadline;  // monotonic time (s) by which the reply must be in, 0 = no limit
+  double sent;      // when the command was submitted, and when its reply came in
+  double received;
+  int op;                // what the command is counted under, see BT_stat_record()
+  const char *function;
+  const char *tag;
+  unsigned char reply[1024];
+} BT_slot;
+
+#define BT_RX_BUFFER_SIZE 4096
+#define BT_TICKET_NO_REPLY 0x10000  // set in the tickets of commands that get no reply
+
+#define BT_MOTOR_UNKNOWN 0  // not commanded yet, or moved by something not tracked
+#define BT_MOTOR_RUNNING 1
+#define BT_MOTOR_STOPPED 2
+
+struct BT_session {
+  BT_transport transport;  // connection selected by the device string
+
+  pthread_mutex_t lock;  // guards the fields below, up to the write lock
+  pthread_cond_t reply_ready;
+  BT_slot slots[BT_MAX_IN_FLIGHT];
+  int next_id;                // message id stamped into the next command
+  int timeout_ms;             // see BT_set_timeout()
+  int noreply_sync_interval;  // see BT_set_noreply_sync_interval()
+  int noreply_count;
+  int link_down;  // set by the I/O thread on EOF/error
+  struct {
+    int type;  // type and mode each input port was last read in (type -1: never read),
+    int mode;  // so they can be set up again after a reconnect
+  } sensor_modes[4];
+  int mode_switches;  // reads that put a sensor in a different type or mode
+  struct {
+    int state;  // BT_MOTOR_UNKNOWN / _RUNNING / _STOPPED, as last commanded
+    int value;  // power while running, brake mode once stopped
+  } motors[4];
+
+  pthread_mutex_t write_lock;  // held while a command is being written
+
+  pthread_t io_thread;
+  int io_running;
+  // Receive buffer, only touched by the I/O thread. Replies are framed out of
+  // it in place, so reading one costs no copies beyond its own bytes.
+  struct {
+    unsigned char data[BT_RX_BUFFER_SIZE];
+    int head;  // first unread byte
+    int tail;  // one past the last byte received
+    int skip;  // bytes of an over-long reply still to be discarded
+  } rx;
+
+  // Reconnecting, see BT_set_reconnect_attempts(). Every reconnect starts a new link generation;
+  // a failure seen on an older generation has already been dealt with. link_generation changes
+  // with both lock and write_lock held.
+  pthread_mutex_t reconnect_lock;
+  int reconnect_attempts;
+  BT_reconnect_handler reconnect_handler;
+  void *reconnect_arg;
+  int link_generation;
+  int timeouts_in_row;
+  int restoring;              // 1 while the reconnecting thread restores the brick's state
+  pthread_t restoring_owner;  // ... and this is that thread
+
+  // Tones queued by BT_play_tone_sequence_async(), played by the audio thread
+  pthread_mutex_t audio_lock;  // guards the fields below
+  pthread_cond_t audio_changed;
+  struct {
+    int freq;
+    int dur;
+    int vol;
+  } audio[BT_AUDIO_QUEUE];
+  int audio_head;     // next tone to play
+  int audio_count;    // tones waiting in the queue
+  int audio_playing;  // 1 while the thread is waiting out a tone
+  int audio_stop;     // set to make the thread exit
+  int audio_running;  // 1 once the thread has been started
+  pthread_t audio_thread;
+};
+
+static BT_session *bt_default_session = NULL;          // opened by BT_open()
+static __thread BT_session *bt_thread_session = NULL;  // picked by BT_session_use()
+
+// Settings given to new sessions - the setters change them along with the
+// calling thread's session
+static int bt_timeout_ms = BT_DEFAULT_TIMEOUT_MS;
+static int bt_noreply_sync_interval = 0;
+static int bt_reconnect_attempts = BT_RECONNECT_ATTEMPTS;
+static BT_reconnect_handler bt_reconnect_handler = NULL;
+static void *bt_reconnect_arg = NULL;
+
+static BT_session *BT_cur(void) {
+  // The session the calling thread's commands go to, NULL if none is open
+  return (bt_thread_session != NULL ? bt_thread_session : bt_default_session);
+}
+
+static void BT_link_failed(BT_session *s, int generation);
+static void BT_audio_stop(BT_session *s);
+
+static void BT_note_sensor_mode(char sensor_port, int type, int mode) {
+  // Called for every read that names a type and mode. The sensor has to
+  // switch (and settle) whenever they differ from the port's last read
+  BT_session *s = BT_cur();
+  if (s == NULL || sensor_port < 0 || sensor_port > 3) return;
+  pthread_mutex_lock(&s->lock);
+  if (s->sensor_modes[(int)sensor_port].type >= 0 &&
+      (s->sensor_modes[(int)sensor_port].type != type ||
+       s->sensor_modes[(int)sensor_port].mode != mode))
+    s->mode_switches++;
+  s->sensor_modes[(int)sensor_port].type = type;
+  s->sensor_modes[(int)sensor_port].mode = mode;
+  pthread_mutex_unlock(&s->lock);
+}
+
+static double BT_clock(void) {
+  // Monotonic time in seconds, for deadlines
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static double BT_deadline(int timeout_ms) {
+  // Deadline timeout_ms from now, or 0 (no limit) if timeout_ms <= 0
+  return (timeout_ms > 0 ? BT_clock() + timeout_ms * 1e-3 : 0);
+}
+
+static int BT_time_left(double deadline) {
+  // Milliseconds left until the deadline (rounded up, 0 once it has passed),
+  // or -1 if there is no deadline - ready to be passed to poll()
+  double left;
+  if (deadline == 0) return (-1);
+  left = deadline - BT_clock();
+  return (left > 0 ? (int)(left * 1e3) + 1 : 0);
+}
+
+static void BT_realtime_after(int ms, struct timespec *until) {
+  // Realtime clock reading ms milliseconds from now, for condition waits
+  clock_gettime(CLOCK_REALTIME, until);
+  until->tv_sec += ms / 1000;
+  until->tv_nsec += (ms % 1000) * 1000000L;
+  if (until->tv_nsec >= 1000000000L) {
+    until->tv_sec++;
+    until->tv_nsec -= 1000000000L;
+  }
+}
+
+static int BT_write_full(BT_session *s, const unsigned char *buf, int n, double deadline) {
+  // Write exactly n bytes to the transport, waiting for it to accept them no
+  // later than the deadline. Returns 0 on success, -1 on error/timeout
+  int sent = 0, r, left;
+  while (sent < n) {
+    r = BT_transport_write(&s->transport, buf + sent, n - sent);
+    if (r > 0) {
+      sent += r;
+      continue;
+    }
+    if (r < 0 && errno == EINTR) continue;
+    if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return (-1);
+    if ((left = BT_time_left(deadline)) == 0) {
+      errno = ETIMEDOUT;
+      return (-1);
+    }
+    if (BT_transport_wait(&s->transport, POLLOUT, left) < 0) return (-1);
+  }
+  return (0);
+}
+
+// Trace of all traffic, see BT_trace_open()
+static FILE *bt_trace = NULL;
+static pthread_mutex_t bt_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec bt_trace_last;
+
+static void BT_trace_record(int type, const unsigned char *frame, int len) {
+  // Append one command/reply to the trace, stamped with the time since the
+  // previous record
+  struct timespec now;
+  unsigned char hdr[7];
+  long long us;
+
+  if (bt_trace == NULL) return;
+  pthread_mutex_lock(&bt_trace_lock);
+  if (bt_trace != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - bt_trace_last.tv_sec) * 1000000LL +
+         (now.tv_nsec - bt_trace_last.tv_nsec) / 1000;
+    bt_trace_last.tv_sec += us / 1000000;
+    bt_trace_last.tv_nsec += (us % 1000000) * 1000;
+    if (bt_trace_last.tv_nsec >= 1000000000) {
+      bt_trace_last.tv_sec++;
+      bt_trace_last.tv_nsec -= 1000000000;
+    }
+    if (us > 0xFFFFFFFFLL) us = 0xFFFFFFFFLL;
+    hdr[0] = type;
+    hdr[1] = us & 0xFF;
+    hdr[2] = (us >> 8) & 0xFF;
+    hdr[3] = (us >> 16) & 0xFF;
+    hdr[4] = (us >> 24) & 0xFF;
+    hdr[5] = len & 0xFF;
+    hdr[6] = (len >> 8) & 0xFF;
+    fwrite(hdr, 1, 7, bt_trace);
+    fwrite(frame, 1, len, bt_trace);
+  }
+  pthread_mutex_unlock(&bt_trace_lock);
+}
+
+int BT_trace_open(const char *path) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Start recording every command sent and every reply received, with the
+  // time between them, to a trace file (format described in bttransport.h).
+  // Opening the trace file with the replay: transport serves the recorded
+  // replies back, so a run can be reproduced and profiled without the robot.
+  // BT_open() calls this itself when the EV3_TRACE environment variable names
+  // a file.
+  //
+  // Returns: 0 on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  FILE *f;
+
+  BT_trace_close();
+  f = fopen(path, "wb");
+  if (f == NULL) {
+    perror("BT_trace_open(): Unable to open trace file ");
+    return (-1);
+  }
+  fwrite(BT_TRACE_MAGIC, 1, BT_TRACE_MAGIC_LEN, f);
+  pthread_mutex_lock(&bt_trace_lock);
+  clock_gettime(CLOCK_MONOTONIC, &bt_trace_last);
+  bt_trace = f;
+  pthread_mutex_unlock(&bt_trace_lock);
+  return (0);
+}
+
+void BT_trace_close(void) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Stop recording and close the trace file
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  pthread_mutex_lock(&bt_trace_lock);
+  if (bt_trace != NULL) fclose(bt_trace);
+  bt_trace = NULL;
+  pthread_mutex_unlock(&bt_trace_lock);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Call statistics
+//
+// Every command is counted three ways: by its first opcode, by the BT_* call that sent it, and by
+// the caller tag the sending thread set with BT_stats_tag(). Each count keeps a histogram of reply
+// latencies (submit to reply arrival) in quarter-octave buckets, so percentiles come out within
+// about 20% at a cost of a few additions per command. The time callers spent blocked waiting for
+// replies is summed separately. Commands sent without reply count the time taken to write them.
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+#define BT_STAT_BUCKETS 128  // covers up to 2^31 us
+#define BT_STAT_MAX_NAMES 64
+
+typedef struct {
+  const char *name;  // function name or caller tag, NULL while unused
+  long long count;
+  long long timeouts;  // commands that got no reply (in time)
+  double wait;         // seconds callers spent waiting on them
+  double max;          // longest latency seen (s)
+  unsigned int hist[BT_STAT_BUCKETS];
+} BT_stat;
+
+static pthread_mutex_t bt_stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static BT_stat bt_stat_ops[512];  // direct command opcodes, then 256 + system commands
+static BT_stat bt_stat_functions[BT_STAT_MAX_NAMES];
+static BT_stat bt_stat_tags[BT_STAT_MAX_NAMES];
+static double bt_stat_start = 0;
+static __thread const char *bt_stat_function = NULL;  // outermost BT_* call on this thread
+static __thread const char *bt_stat_tag = NULL;       // see BT_stats_tag()
+
+// Names the BT_* call a command is counted under. BT_STAT_FUNCTION() goes at
+// the top of every public call that sends commands; only the outermost one on
+// the thread counts, so BT_read_touch_sensor() is not counted as the
+// BT_read_touch_sensor_submit() it calls.
+struct BT_stat_scope {
+  int outer;
+  BT_stat_scope(const char *name) : outer(bt_stat_function == NULL) {
+    if (outer) bt_stat_function = name;
+  }
+  ~BT_stat_scope() {
+    if (outer) bt_stat_function = NULL;
+  }
+};
+#define BT_STAT_FUNCTION() BT_stat_scope bt_stat_scope_(__func__)
+
+static int BT_stat_bucket(double t) {
+  // Histogram bucket for a latency of t seconds: four buckets per power of two
+  // of the latency in microseconds
+  unsigned int us = t <= 0 ? 0 : t >= 2147.0 ? 0x7FFFFFFF : (unsigned int)(t * 1e6);
+  int p;
+  if (us < 4) return (us);
+  p = 31 - __builtin_clz(us);
+  return (p * 4 + ((us >> (p - 2)) & 3));
+}
+
+static double BT_stat_bucket_top(int b) {
+  // Upper end of bucket b, in seconds
+  if (b < 8) return ((b + 1) * 1e-6);
+  return ((double)((5 + (b & 3)) << (b / 4 - 2)) * 1e-6);
+}
+
+static BT_stat *BT_stat_named(BT_stat *table, const char *name) {
+  // The entry for name, added if new (the last entry collects the overflow)
+  int i;
+  for (i = 0; i < BT_STAT_MAX_NAMES - 1 && table[i].name != NULL; i++)
+    if (table[i].name == name || strcmp(table[i].name, name) == 0) return (&table[i]);
+  if (table[i].name == NULL) table[i].name = i < BT_STAT_MAX_NAMES - 1 ? name : "(other)";
+  return (&table[i]);
+}
+
+static void BT_stat_add(BT_stat *st, double latency, double wait, int timed_out) {
+  st->count++;
+  st->timeouts += timed_out;
+  st->wait += wait;
+  if (latency > st->max) st->max = latency;
+  st->hist[BT_stat_bucket(latency)]++;
+}
+
+static void BT_stat_record(int op, const char *function, const char *tag, double latency,
+                           double wait, int timed_out) {
+  // Count one command under its opcode, BT_* call and caller tag
+  pthread_mutex_lock(&bt_stat_lock);
+  if (bt_stat_start == 0) bt_stat_start = BT_clock();
+  BT_stat_add(&bt_stat_ops[op & 511], latency, wait, timed_out);
+  BT_stat_add(BT_stat_named(bt_stat_functions, function != NULL ? function : "(direct)"), latency,
+              wait, timed_out);
+  BT_stat_add(BT_stat_named(bt_stat_tags, tag != NULL ? tag : "(untagged)"), latency, wait,
+              timed_out);
+  pthread_mutex_unlock(&bt_stat_lock);
+}
+
+static int BT_stat_op(const unsigned char *cmd, int len) {
+  // The opcode a command is counted under: the first one of a direct command,
+  // 256 + the command byte of a system command
+  if ((cmd[4] & 0x7F) == SYSTEM_COMMAND_REPLY) return (len > 5 ? 256 + cmd[5] : 256);
+  return (len > 7 ? cmd[7] : 0);
+}
+
+static const char *BT_stat_op_name(int op) {
+  switch (op) {
+    case opINPUT_DEVICE: return ("opINPUT_DEVICE");
+    case opINPUT_READ: return ("opINPUT_READ");
+    case opINPUT_READEXT: return ("opINPUT_READEXT");
+    case opOUTPUT_POWER: return ("opOUTPUT_POWER");
+    case opOUTPUT_SPEED: return ("opOUTPUT_SPEED");
+    case opOUTPUT_START: return ("opOUTPUT_START");
+    case opOUTPUT_STOP: return ("opOUTPUT_STOP");
+    case opOUTPUT_STEP_SYNC: return ("opOUTPUT_STEP_SYNC");
+    case opOUTPUT_TIME_SYNC: return ("opOUTPUT_TIME_SYNC");
+    case opOUTPUT_TIME_POWER: return ("opOUTPUT_TIME_POWER");
+    case opOUTPUT_GET_COUNT: return ("opOUTPUT_GET_COUNT");
+    case opOUTPUT_CLR_COUNT: return ("opOUTPUT_CLR_COUNT");
+    case opSOUND: return ("opSOUND");
+    case opTIMER_WAIT: return ("opTIMER_WAIT");
+    case opUI_WRITE: return ("opUI_WRITE");
+    case opUI_DRAW: return ("opUI_DRAW");
+    case opCOM_SET: return ("opCOM_SET");
+    case 256 + BEGIN_DOWNLOAD: return ("BEGIN_DOWNLOAD");
+    case 256 + CONTINUE_DOWNLOAD: return ("CONTINUE_DOWNLOAD");
+    case 256 + LIST_FILES: return ("LIST_FILES");
+    case 256 + CONTINUE_LIST_FILES: return ("CONTINUE_LIST_FILES");
+  }
+  return (NULL);
+}
+
+static void BT_stat_print(FILE *f, const char *name, const BT_stat *st) {
+  // One line of the dump: calls, timeouts, p50/p95/p99/max latency, time waited
+  const double pct[3] = {0.50, 0.95, 0.99};
+  double at[3];
+  long long seen = 0;
+  int b = 0;
+
+  for (int k = 0; k < 3; k++) {
+    while (b < BT_STAT_BUCKETS - 1 && seen + st->hist[b] < pct[k] * st->count) seen += st->hist[b++];
+    at[k] = MIN(BT_stat_bucket_top(b), st->max);
+  }
+  fprintf(f, "  %-36s %8lld %8lld %9.2f %9.2f %9.2f %9.2f %9.2f\n", name, st->count, st->timeouts,
+          at[0] * 1e3, at[1] * 1e3, at[2] * 1e3, st->max * 1e3, st->wait);
+}
+
+void BT_stats_dump(FILE *f) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Print the call counts and latency percentiles gathered so far, by opcode,
+  // by BT_* call and by caller tag. Latencies are in ms, the time callers
+  // spent waiting for replies in s. This is done at exit and on SIGUSR1.
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  char name[32];
+  long long total = 0;
+
+  pthread_mutex_lock(&bt_stat_lock);
+  for (int i = 0; i < 512; i++) total += bt_stat_ops[i].count;
+  fprintf(f, "btcomm: %lld commands in %.1f s\n", total,
+          bt_stat_start > 0 ? BT_clock() - bt_stat_start : 0.0);
+  fprintf(f, "%-38s %8s %8s %9s %9s %9s %9s %9s\nby opcode\n", "", "calls", "timeouts", "p50 ms",
+          "p95 ms", "p99 ms", "max ms", "wait s");
+  for (int i = 0; i < 512; i++) {
+    if (bt_stat_ops[i].count == 0) continue;
+    if (BT_stat_op_name(i) != NULL)
+      snprintf(name, sizeof(name), "%s", BT_stat_op_name(i));
+    else
+      snprintf(name, sizeof(name), i < 256 ? "op 0x%02X" : "system 0x%02X", i & 0xFF);
+    BT_stat_print(f, name, &bt_stat_ops[i]);
+  }
+  fprintf(f, "by call\n");
+  for (int i = 0; i < BT_STAT_MAX_NAMES && bt_stat_functions[i].name != NULL; i++)
+    BT_stat_print(f, bt_stat_functions[i].name, &bt_stat_functions[i]);
+  fprintf(f, "by caller tag\n");
+  for (int i = 0; i < BT_STAT_MAX_NAMES && bt_stat_tags[i].name != NULL; i++)
+    BT_stat_print(f, bt_stat_tags[i].name, &bt_stat_tags[i]);
+  fflush(f);
+  pthread_mutex_unlock(&bt_stat_lock);
+}
+
+void BT_stats_reset(void) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Forget the statistics gathered so far
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  pthread_mutex_lock(&bt_stat_lock);
+  memset(bt_stat_ops, 0, sizeof(bt_stat_ops));
+  memset(bt_stat_functions, 0, sizeof(bt_stat_functions));
+  memset(bt_stat_tags, 0, sizeof(bt_stat_tags));
+  bt_stat_start = 0;
+  pthread_mutex_unlock(&bt_stat_lock);
+}
+
+const char *BT_stats_tag(const char *tag) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Count the calling thread's commands under this caller tag until the next
+  // call (NULL: untagged). The string is kept, not copied, so it should be a
+  // literal or otherwise outlive the program's use of btcomm.
+  //
+  // Returns: the tag that was set before, so it can be put back
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  const char *previous = bt_stat_tag;
+  bt_stat_tag = tag;
+  return (previous);
+}
+
+static sem_t bt_stat_signal;
+static pthread_once_t bt_stat_once = PTHREAD_ONCE_INIT;
+
+static void BT_stat_on_signal(int sig) {
+  // SIGUSR1 handler - only sem_post() is safe here, the stats thread prints
+  (void)sig;
+  sem_post(&bt_stat_signal);
+}
+
+static void *BT_stat_main(void *arg) {
+  (void)arg;
+  while (1) {
+    if (sem_wait(&bt_stat_signal) == 0) BT_stats_dump(stderr);
+  }
+  return (NULL);
+}
+
+static void BT_stat_at_exit(void) {
+  // Dump the statistics at exit, to the file named by EV3_STATS if set
+  FILE *f = stderr;
+  if (bt_stat_start == 0) return;
+  if (getenv("EV3_STATS") != NULL && (f = fopen(getenv("EV3_STATS"), "w")) == NULL) f = stderr;
+  BT_stats_dump(f);
+  if (f != stderr) fclose(f);
+}
+
+static void BT_stat_init(void) {
+  // Arrange for the dumps, once per process. SIGUSR1 is only taken over if
+  // the program has not installed a handler of its own
+  struct sigaction sa, old;
+  pthread_t thread;
+
+  atexit(BT_stat_at_exit);
+  if (sigaction(SIGUSR1, NULL, &old) < 0 || old.sa_handler != SIG_DFL) return;
+  if (sem_init(&bt_stat_signal, 0, 0) < 0 ||
+      pthread_create(&thread, NULL, BT_stat_main, NULL) != 0)
+    return;
+  pthread_detach(thread);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = BT_stat_on_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+}
+
+static int BT_rx_fill(BT_session *s, int n) {
+  // Make sure at least n unread bytes are in the receive buffer, reading from
+  // the transport as needed. Each read asks for all the free space, so replies
+  // that arrive back to back are picked up by a single read.
+  // Returns 0 on success, -1 on EOF/error
+  int r;
+
+  if (s->rx.tail - s->rx.head >= n) return (0);
+  if (s->rx.head + n > BT_RX_BUFFER_SIZE) {
+    memmove(s->rx.data, s->rx.data + s->rx.head, s->rx.tail - s->rx.head);
+    s->rx.tail -= s->rx.head;
+    s->rx.head = 0;
+  }
+  while (s->rx.tail - s->rx.head < n) {
+    r = BT_transport_read(&s->transport, s->rx.data + s->rx.tail,
+                          BT_RX_BUFFER_SIZE - s->rx.tail);
+    if (r > 0) {
+      s->rx.tail += r;
+      continue;
+    }
+    if (r < 0 && errno == EINTR) continue;
+    if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return (-1);
+    if (BT_transport_wait(&s->transport, POLLIN, -1) < 0) return (-1);
+  }
+  return (0);
+}
+
+static int BT_id_in_flight(BT_session *s, int id) {
+  // 1 if a command with this message id is waiting for its reply
+  int found = 0;
+  pthread_mutex_lock(&s->lock);
+  for (int i = 0; i < BT_MAX_IN_FLIGHT; i++) {
+    if (s->slots[i].busy && !s->slots[i].done && s->slots[i].id == id) found = 1;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return (found);
+}
+
+static int BT_read_frame(BT_session *s, const unsigned char **frame) {
+  // Read one complete reply using its 2-byte little endian length prefix. On
+  // return *frame points at the reply (length field included) inside the
+  // receive buffer, and stays valid until the next call. Replies longer than
+  // 1024 bytes are cut to 1024; the rest is discarded on the next call.
+  //
+  // If the bytes at the head of the buffer are not a reply header (too short,
+  // or an unknown reply type), the stream has lost its framing. The buffer is
+  // then scanned forward a byte at a time until it reaches a header of a
+  // plausible length carrying the message id of a command still waiting for
+  // its reply.
+  //
+  // Returns the frame length, or -1 on EOF/error
+  unsigned char *h;
+  int len, keep, k, type, id, lost = 0;
+
+  while (s->rx.skip > 0) {
+    if (BT_rx_fill(s, 1) < 0) return (-1);
+    k = MIN(s->rx.skip, s->rx.tail - s->rx.head);
+    s->rx.head += k;
+    s->rx.skip -= k;
+  }
+
+  while (1) {
+    if (BT_rx_fill(s, 5) < 0) return (-1);
+    h = s->rx.data + s->rx.head;
+    len = h[0] | (h[1] << 8);
+    id = h[2] | (h[3] << 8);
+    type = h[4];
+    if (len >= 3 &&
+        (type == DIRECT_REPLY || type == DIRECT_REPLY_ERROR || type == SYSTEM_REPLY ||
+         type == SYSTEM_REPLY_ERROR) &&
+        (!lost || (len <= 1022 && BT_id_in_flight(s, id))))
+      break;
+    if (!lost) fprintf(stderr, "BT_read_frame(): Reply stream out of sync, resynchronizing\n");
+    lost = 1;
+    s->rx.head++;
+  }
+  keep = len > 1022 ? 1022 : len;
+  if (BT_rx_fill(s, keep + 2) < 0) return (-1);
+
+  *frame = s->rx.data + s->rx.head;
+  s->rx.head += keep + 2;
+  s->rx.skip = len - keep;
+  BT_trace_record(BT_TRACE_REPLY, *frame, keep + 2);
+  return (keep + 2);
+}
+
+static void BT_deliver(BT_session *s, const unsigned char *frame, int len) {
+  // Hand a reply to the slot waiting for its message id (s->lock must be held).
+  // Replies nobody is waiting for are dropped.
+  int id = frame[2] | (frame[3] << 8);
+  for (int i = 0; i < BT_MAX_IN_FLIGHT; i++) {
+    if (s->slots[i].busy && !s->slots[i].done && s->slots[i].id == id) {
+      memcpy(s->slots[i].reply, frame, len);
+      s->slots[i].len = len;
+      s->slots[i].received = BT_clock();
+      s->slots[i].done = 1;
+      pthread_cond_broadcast(&s->reply_ready);
+      return;
+    }
+  }
+#ifdef __BT_debug
+  fprintf(stderr, "BT_deliver(): Dropping reply with unexpected id %d\n", id);
+#endif
+}
+
+static void *BT_io_main(void *arg) {
+  // The session's I/O thread - the only reader of its connection
+  BT_session *s = (BT_session *)arg;
+  const unsigned char *frame;
+  int len;
+  while (1) {
+    len = BT_read_frame(s, &frame);
+    pthread_mutex_lock(&s->lock);
+    if (len < 0) {
+      s->link_down = 1;
+      pthread_cond_broadcast(&s->reply_ready);
+      pthread_mutex_unlock(&s->lock);
+      return (NULL);
+    }
+    BT_deliver(s, frame, len);
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+static int BT_io_start(BT_session *s) {
+  s->rx.head = s->rx.tail = s->rx.skip = 0;
+  pthread_mutex_lock(&s->lock);  // waiters in BT_complete() read it
+  s->link_down = 0;
+  pthread_mutex_unlock(&s->lock);
+  if (pthread_create(&s->io_thread, NULL, BT_io_main, s) != 0) {
+    fprintf(stderr, "BT_io_start(): Unable to start the I/O thread\n");
+    return (-1);
+  }
+  s->io_running = 1;
+  return (0);
+}
+
+static void BT_io_stop(BT_session *s) {
+  // The I/O thread is not cancelled - it could die holding a lock, e.g. in the
+  // middle of a trace write. Instead its reads see EOF and it returns
+  if (!s->io_running) return;
+  BT_transport_shutdown_read(&s->transport);
+  pthread_join(s->io_thread, NULL);
+  s->io_running = 0;
+}
+
+BT_session *BT_session_open(const char *device_id) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Open a session to the EV3 with the given hex ID (or one of the other
+  // device strings in bttransport.h), and start its I/O thread. The session
+  // starts with the settings last given to BT_set_timeout(),
+  // BT_set_noreply_sync_interval() and the reconnect setters. Its commands
+  // are issued by threads that have selected it with BT_session_use().
+  //
+  // Returns: the new session
+  //          NULL otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_session *s = (BT_session *)calloc(1, sizeof(BT_session));
+
+  if (s == NULL) return (NULL);
+  pthread_once(&bt_stat_once, BT_stat_init);
+  if (BT_transport_open(&s->transport, device_id) < 0) {
+    free(s);
+    return (NULL);
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->reply_ready, NULL);
+  pthread_mutex_init(&s->write_lock, NULL);
+  pthread_mutex_init(&s->reconnect_lock, NULL);
+  pthread_mutex_init(&s->audio_lock, NULL);
+  pthread_cond_init(&s->audio_changed, NULL);
+  s->next_id = 1;
+  s->timeout_ms = bt_timeout_ms;
+  s->noreply_sync_interval = bt_noreply_sync_interval;
+  s->reconnect_attempts = bt_reconnect_attempts;
+  s->reconnect_handler = bt_reconnect_handler;
+  s->reconnect_arg = bt_reconnect_arg;
+  for (int i = 0; i < 4; i++) s->sensor_modes[i].type = -1;
+  if (BT_io_start(s) < 0) {
+    BT_transport_close(&s->transport);
+    free(s);
+    return (NULL);
+  }
+  return (s);
+}
+
+void BT_session_close(BT_session *s) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Stop the session's I/O and audio threads, close its connection and free
+  // it. Tones still queued are dropped. No other thread may be using the
+  // session.
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  if (s == NULL) return;
+  BT_audio_stop(s);
+  BT_io_stop(s);
+  BT_transport_close(&s->transport);
+  if (bt_thread_session == s) bt_thread_session = NULL;
+  if (bt_default_session == s) bt_default_session = NULL;
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->reply_ready);
+  pthread_mutex_destroy(&s->write_lock);
+  pthread_mutex_destroy(&s->reconnect_lock);
+  pthread_mutex_destroy(&s->audio_lock);
+  pthread_cond_destroy(&s->audio_changed);
+  free(s);
+}
+
+BT_session *BT_session_use(BT_session *s) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Send the calling thread's BT_* calls to session s (NULL: back to the
+  // default session opened by BT_open()). Other threads are not affected.
+  //
+  // Returns: the session the thread used before (NULL for the default one)
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_session *previous = bt_thread_session;
+  bt_thread_session = s;
+  return (previous);
+}
+
+BT_session *BT_session_current(void) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Returns: the session the calling thread's BT_* calls go to, NULL if none
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  return (BT_cur());
+}
+
+int BT_pipeline_start(void) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Replies are always matched by the session's I/O thread now, which starts
+  // with the session. Kept so existing programs still build.
+  //
+  // Returns: 0 if the calling thread has an open session
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  return (BT_cur() != NULL ? 0 : -1);
+}
+
+void BT_pipeline_stop(void) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // The I/O thread stops when its session is closed. Kept so existing
+  // programs still build.
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+}
+
+static int BT_send(BT_session *s, void *cmd, int len, int timeout_ms) {
+  // Stamp the session's next message id into bytes 2-3 of a command and send
+  // it, reserving a reply slot first if the command type asks for a reply.
+  // Both the write and the reply must be done within timeout_ms (<= 0: no
+  // limit). Returns the ticket for BT_complete() - the message id, with
+  // BT_TICKET_NO_REPLY set if no reply was asked for - or -1 on error
+  unsigned char *cp = (unsigned char *)cmd;
+  int id, slot = -1, generation, r;
+  double start = BT_clock(), deadline = BT_deadline(timeout_ms);
+
+  if (s == NULL) {
+    fprintf(stderr, "BT_send(): No connection to an EV3 is open\n");
+    return (-1);
+  }
+
+  pthread_mutex_lock(&s->lock);
+  if ((cp[4] & 0x80) == 0) {  // DIRECT_COMMAND_REPLY / SYSTEM_COMMAND_REPLY
+    for (int i = 0; i < BT_MAX_IN_FLIGHT; i++) {
+      if (!s->slots[i].busy) {
+        slot = i;
+        break;
+      }
+    }
+    if (slot < 0) {
+      pthread_mutex_unlock(&s->lock);
+      fprintf(stderr, "BT_send(): Too many commands in flight\n");
+      return (-1);
+    }
+  }
+  id = s->next_id;
+  s->next_id = (s->next_id + 1) & 0xFFFF;
+  cp[2] = id & 0xFF;
+  cp[3] = (id >> 8) & 0xFF;
+  if (slot >= 0) {
+    s->slots[slot].busy = 1;
+    s->slots[slot].done = 0;
+    s->slots[slot].id = id;
+    s->slots[slot].len = 0;
+    s->slots[slot].deadline = deadline;
+    s->slots[slot].sent = start;
+    s->slots[slot].op = BT_stat_op(cp, len);
+    s->slots[slot].function = bt_stat_function;
+    s->slots[slot].tag = bt_stat_tag;
+  }
+  generation = s->link_generation;
+  pthread_mutex_unlock(&s->lock);
+
+  // Traced before the write, so the reply can not end up ahead of it. The link generation only
+  // changes with the write lock held (see BT_reconnect()), so a command whose link was replaced
+  // while it waited for the lock is dropped here rather than written to the new link with a slot
+  // that has already been failed
+  pthread_mutex_lock(&s->write_lock);
+  if (generation != s->link_generation) {
+    pthread_mutex_unlock(&s->write_lock);
+    fprintf(stderr, "BT_send(): Link to the EV3 was reopened, command dropped\n");
+    if (slot >= 0) {
+      pthread_mutex_lock(&s->lock);
+      s->slots[slot].busy = 0;
+      pthread_mutex_unlock(&s->lock);
+    }
+    return (-1);
+  }
+  BT_trace_record(BT_TRACE_COMMAND, cp, len);
+  r = BT_write_full(s, cp, len, deadline);
+  pthread_mutex_unlock(&s->write_lock);
+  if (r < 0) {
+    perror("BT_send(): write failed ");
+    if (slot >= 0) {
+      pthread_mutex_lock(&s->lock);
+      s->slots[slot].busy = 0;
+      pthread_mutex_unlock(&s->lock);
+    }
+    BT_link_failed(s, generation);
+    return (-1);
+  }
+  if (slot < 0)
+    BT_stat_record(BT_stat_op(cp, len), bt_stat_function, bt_stat_tag, BT_clock() - start,
+                   BT_clock() - start, 0);
+  return (slot < 0 ? id | BT_TICKET_NO_REPLY : id);
+}
+
+void BT_set_timeout(int timeout_ms) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Set how long a command may take, from the moment it is sent until its
+  // reply is in, before BT_complete() (and every blocking BT_* call) gives up
+  // on it and returns -1. 0 waits indefinitely, as the library used to.
+  // Commands already in flight keep their deadline. Commands that run for a
+  // known time on the brick (brick-side loops, bursts, waited sync moves) get
+  // that time added on top. Applies to the calling thread's session and to
+  // sessions opened afterwards.
+  //
+  // Default: BT_DEFAULT_TIMEOUT_MS
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_session *s = BT_cur();
+  bt_timeout_ms = timeout_ms > 0 ? timeout_ms : 0;
+  if (s != NULL) s->timeout_ms = bt_timeout_ms;
+}
+
+static int BT_timeout(void) {
+  // Timeout of the calling thread's session
+  BT_session *s = BT_cur();
+  return (s != NULL ? s->timeout_ms : bt_timeout_ms);
+}
+
+static int BT_timeout_after(int run_ms) {
+  // Timeout for a command that keeps the brick busy for run_ms before replying
+  int timeout_ms = BT_timeout();
+  return (timeout_ms > 0 ? timeout_ms + run_ms : 0);
+}
+
+int BT_submit_timeout(void *cmd_string, int len, int timeout_ms) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Send a fully formatted command (length, type, header and payload filled in)
+  // without waiting for its reply. The session's next message id is stamped
+  // into bytes 2-3 of the command. The reply is due within timeout_ms of now
+  // (<= 0: no limit).
+  //
+  // Every ticket for a command that requests a reply must eventually be passed
+  // to BT_complete() by a thread using the same session, which releases its
+  // slot. At most BT_MAX_IN_FLIGHT such commands can be outstanding per
+  // session.
+  //
+  // Inputs: the command string, its total length in bytes, and the timeout
+  // Returns: a ticket on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  return (BT_send(BT_cur(), cmd_string, len, timeout_ms));
+}
+
+int BT_submit(void *cmd_string, int len) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Same as BT_submit_timeout(), with the timeout set by BT_set_timeout()
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  return (BT_submit_timeout(cmd_string, len, BT_timeout()));
+}
+
+int BT_complete(int ticket, void *reply, int max_len) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Wait for the reply to a command sent with BT_submit(), copy up to max_len
+  // bytes of it (length field included) into reply, and release its slot.
+  // The wait ends at the command's deadline - the slot is released then too,
+  // and the reply is discarded if it arrives afterwards. Whenever there is no
+  // reply to copy, the first max_len bytes of reply are zeroed.
+  //
+  // Inputs: the ticket returned by BT_submit(), a buffer for the reply
+  // Returns: the reply length on success
+  //          0 if the command did not request a reply
+  //          -1 if the ticket is invalid (or was already completed), the link
+  //             went down, or the reply did not arrive in time
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_session *s = BT_cur();
+  struct timespec until;
+  int slot = -1, len, left, timed_out = 0, generation, op, in_row;
+  double deadline, start = BT_clock(), latency;
+  const char *function, *tag;
+  BT_slot *sl;
+
+  // When there is no reply to copy the caller gets an all-zero one, as the
+  // blocking calls that print or return reply bytes whatever the result expect
+  if (ticket < 0 || s == NULL) {
+    memset(reply, 0, max_len);
+    return (-1);
+  }
+  if (ticket & BT_TICKET_NO_REPLY) {
+    memset(reply, 0, max_len);
+    return (0);
+  }
+
+  pthread_mutex_lock(&s->lock);
+  for (int i = 0; i < BT_MAX_IN_FLIGHT; i++) {
+    if (s->slots[i].busy && s->slots[i].id == ticket) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot < 0) {
+    pthread_mutex_unlock(&s->lock);
+    fprintf(stderr, "BT_complete(): Unknown ticket %d, completed twice?\n", ticket);
+    memset(reply, 0, max_len);
+    return (-1);
+  }
+
+  deadline = s->slots[slot].deadline;
+  generation = s->link_generation;
+  while (!s->slots[slot].done && !s->link_down) {
+    if (deadline == 0) {
+      pthread_cond_wait(&s->reply_ready, &s->lock);
+      continue;
+    }
+    // The condition variable runs on the realtime clock, the deadline on the
+    // monotonic one - convert what is left of it on every pass
+    if ((left = BT_time_left(deadline)) == 0) {
+      timed_out = 1;
+      break;
+    }
+    BT_realtime_after(left, &until);
+    pthread_cond_timedwait(&s->reply_ready, &s->lock, &until);
+  }
 
-int message_id_counter =
-    1;  // <-- This is a global message_id counter, used to keep track of
-        //     messages sent to the EV3
-int *socket_id;  // <-- Socked identifier for your EV3
+  sl = &s->slots[slot];
+  len = sl->done ? sl->len : -1;
+  if (len > 0)
+    memcpy(reply, sl->reply, MIN(len, max_len));
+  else
+    memset(reply, 0, max_len);
+  latency = (sl->done ? sl->received : BT_clock()) - sl->sent;
+  op = sl->op;  // counted once the lock is released
+  function = sl->function;
+  tag = sl->tag;
+  sl->busy = 0;
+  if (timed_out)
+    s->timeouts_in_row++;
+  else if (len >= 0)
+    s->timeouts_in_row = 0;
+  in_row = s->timeouts_in_row;
+  pthread_mutex_unlock(&s->lock);
+  BT_stat_record(op, function, tag, latency, BT_clock() - start, len < 0);
+
+  if (timed_out) {
+    fprintf(stderr, "BT_complete(): No reply to message %d in time, giving up on it\n", ticket);
+    // An RFCOMM link that has gone out of range tends to stall rather than fail
+    if (in_row >= BT_RECONNECT_AFTER_TIMEOUTS) BT_link_failed(s, generation);
+  } else if (len < 0) {
+    fprintf(stderr, "BT_complete(): Link to the EV3 is down\n");
+    BT_link_failed(s, generation);
+  }
+  return (len);
+}
+
+static int BT_exchange(void *cmd, int len, void *reply) {
+  // Send a command and wait for the reply. This is what the blocking BT_*
+  // calls below use, so they can be freely mixed with pipelined
+  // BT_submit()/BT_complete() traffic from any thread.
+  return (BT_complete(BT_submit(cmd, len), reply, 1024));
+}
 
 int BT_open(const char *device_id) {
   //////////////////////////////////////////////////////////////////////////////////////////////////////
   // Open a socket to the specified Lego EV3 device specified by the provided
-  // hex ID string
+  // hex ID string. Other device strings (tcp:, unix:, loop: - see
+  // bttransport.h) connect to a stand-in brick instead, and the EV3_DEVICE
+  // environment variable overrides device_id when set. This becomes the
+  // default session, used by every thread that has not picked another one.
   //
   // Input: The hex string identifier for the Lego EV3 block
   // Returns: 0 on success
   //          -1 otherwise
-  //
-  // Derived from bluetooth.c by Don Neumann
   //////////////////////////////////////////////////////////////////////////////////////////////////////
 
-  int rv;
-  struct sockaddr_rc addr = {0};
-  int s, status;
-  char dest[18];
-  socket_id = (int *)malloc(sizeof(int));
   fprintf(stderr, "Request to connect to device %s\n", device_id);
+  if (getenv("EV3_TRACE") != NULL) BT_trace_open(getenv("EV3_TRACE"));
 
-  *socket_id = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
-  // set the connection parameters (who to connect to)
-  addr.rc_family = AF_BLUETOOTH;
-  addr.rc_channel = (uint8_t)1;
-  str2ba(device_id, &addr.rc_bdaddr);
-
-  status = connect(*socket_id, (struct sockaddr *)&addr, sizeof(addr));
-  if (status == 0) {
-    printf("Connection to %s established at socket: %d.\n", device_id,
-           *socket_id);
-  }
-  if (status < 0) {
+  BT_session_close(bt_default_session);
+  bt_default_session = BT_session_open(device_id);
+  if (bt_default_session == NULL) {
     perror("Connection attempt failed ");
     return (-1);
   }
+  printf("Connection to %s established at socket: %d.\n", device_id,
+         bt_default_session->transport.fd);
   return 0;
 }
 
 int BT_close() {
   /////////////////////////////////////////////////////////////////////////////////////////////////////
-  // Close the communication socket to the EV3
+  // Close the communication socket to the EV3 (the default session)
   /////////////////////////////////////////////////////////////////////////////////////////////////////
-  fprintf(stderr, "Request to close connection to device at socket id %d\n",
-          *socket_id);
-  close(*socket_id);
-  free(socket_id);
+  if (bt_default_session != NULL)
+    fprintf(stderr, "Request to close connection to device at socket id %d\n",
+            bt_default_session->transport.fd);
+  BT_session_close(bt_default_session);
+  BT_trace_close();
   return 0;
 }
 
+
 int BT_setEV3name(const char *name) {
   /////////////////////////////////////////////////////////////////////////////////////////////////////
   // This function can be used to name your EV3.
   // Inputs: A zero-terminated string containing the desired name, length <=  12
   // characters
   /////////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
 
   char cmd_string[1024];
   unsigned char cmd_prefix[11] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -106,7 +1083,6 @@ int BT_setEV3name(const char *name) {
   //                   |length-2|    | cnt_id |    |type|   | header | |ComSet|
   //                   |Op|    |String prefix|
   char reply[1024];
-  memset(&reply[0], 0, 1024);
   int len;
   void *lp;
   unsigned char *cp;
@@ -125,18 +1101,13 @@ int BT_setEV3name(const char *name) {
   strncpy(&cmd_string[10], name, 1013);
   cmd_string[1024] = 0x00;
 
-  // Update message length, and update sequence counter (length and cnt_id
-  // fields)
+  // Update message length (the message id is stamped when it is sent)
   len += 9;
   lp = (void *)&len;
   cp = (unsigned char *)lp;  // <- magic!
   cmd_string[0] = *cp;
   cmd_string[1] = *(cp + 1);
 
-  lp = (void *)&message_id_counter;
-  cp = (unsigned char *)lp;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
 
 #ifdef __BT_debug
   fprintf(stderr, "Set name command:\n");
@@ -146,8 +1117,7 @@ int BT_setEV3name(const char *name) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], len + 2);
-  read(*socket_id, &reply[0], 1023);
+  BT_exchange(&cmd_string[0], len + 2, &reply[0]);
 
 #ifdef __BT_debug
   fprintf(stderr, "Set name reply:\n");
@@ -162,10 +1132,43 @@ int BT_setEV3name(const char *name) {
             "BT_setEV3name(): Command failed, name must not contain spaces or "
             "special characters\n");
 
-  message_id_counter++;
   return 0;
 }
 
+static void BT_debug_command(const char *name, const unsigned char *cmd_string, int len) {
+#ifdef __BT_debug
+  fprintf(stderr, "%s command string:\n", name);
+  for (int i = 0; i < len; i++) {
+    fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
+  }
+  fprintf(stderr, "\n");
+#endif
+}
+
+static int BT_tone_count(const int tone_data[50][3]) {
+  // Check the tones in a sequence (up to the first -1 entry) are in range.
+  // Returns how many there are, -1 if one is out of range
+  int i;
+  for (i = 0; i < 50; i++) {
+    if (tone_data[i][0] == -1 || tone_data[i][1] == -1) break;
+    if (tone_data[i][0] < 20 || tone_data[i][0] > 20000) {
+      fprintf(stderr,
+              "BT_play_tone_sequence():Tone range must be in 20Hz-20KHz\n");
+      return (-1);
+    }
+    if (tone_data[i][1] < 1 || tone_data[i][1] > 5000) {
+      fprintf(stderr,
+              "BT_play_tone_sequence():Tone duration must be in 1-5000ms\n");
+      return (-1);
+    }
+    if (tone_data[i][2] < 0 || tone_data[i][2] > 63) {
+      fprintf(stderr, "BT_play_tone_sequence():Volume must be in 0-63\n");
+      return (-1);
+    }
+  }
+  return (i);
+}
+
 int BT_play_tone_sequence(const int tone_data[50][3]) {
   //////////////////////////////////////////////////////////////////////////////////////////////////
   //
@@ -189,13 +1192,13 @@ int BT_play_tone_sequence(const int tone_data[50][3]) {
   // Returns:  0 on success
   //           -1 otherwise
   //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
 
   int len;
   int freq;
   int dur;
   int vol;
   void *p;
-  char reply[1024];
   unsigned char *cmd_str_p;
   unsigned char *cp;
   unsigned char cmd_string[1024];
@@ -204,33 +1207,10 @@ int BT_play_tone_sequence(const int tone_data[50][3]) {
   //                           |length-2|    | cnt_id |    |type|   | header |
 
   memset(&cmd_string[0], 0, 1024);
-  strcpy((char *)&cmd_string[0], (char *)&cmd_prefix[0]);
+  memcpy(&cmd_string[0], &cmd_prefix[0], 7);  // the prefix starts with 0x00, strcpy() copied nothing
   len = 5;
 
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
-
-  // Pre-check tone information
-  for (int i = 0; i < 50; i++) {
-    if (tone_data[i][0] == -1 || tone_data[i][1] == -1) break;
-    if (tone_data[i][0] < 20 || tone_data[i][0] > 20000) {
-      fprintf(stderr,
-              "BT_play_tone_sequence():Tone range must be in 20Hz-20KHz\n");
-      return (0);
-    }
-    if (tone_data[i][1] < 1 || tone_data[i][1] > 5000) {
-      fprintf(stderr,
-              "BT_play_tone_sequence():Tone duration must be in 1-5000ms\n");
-      return (0);
-    }
-    if (tone_data[i][2] < 0 || tone_data[i][2] > 63) {
-      fprintf(stderr, "BT_play_tone_sequence():Volume must be in 0-63\n");
-      return (0);
-    }
-  }
+  if (BT_tone_count(tone_data) < 0) return (0);
 
   cmd_str_p = &cmd_string[7];
   for (int i = 0; i < 50; i++) {
@@ -272,114 +1252,381 @@ int BT_play_tone_sequence(const int tone_data[50][3]) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], len + 2);
-
-  read(*socket_id, &reply[0], 1023);
+  // Sent without reply (type 0x80), so the call returns once it is written
+  if (BT_submit(&cmd_string[0], len + 2) < 0) return (-1);
+  return (0);
+}
 
-  message_id_counter++;
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Audio feedback queue
+//
+// BT_play_tone_sequence() hands the whole sequence to the brick, with an opSOUND_READY after every
+// note. The brick runs direct commands one at a time, so any command sent after it waits until the
+// last note has ended. Tones queued with BT_play_tone_sequence_async() are instead played by the
+// session's audio thread: each one goes out as a single no-reply opSOUND TONE, and the thread waits
+// out its duration on the PC before sending the next. The brick never waits on the sound, and the
+// calling thread only copies the tones into the queue.
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void *BT_audio_main(void *arg) {
+  // The session's audio thread - plays queued tones until BT_audio_stop()
+  BT_session *s = (BT_session *)arg;
+  unsigned char cmd_string[BT_tone_packet::len];
+  struct timespec until;
+  int freq, dur, vol, len;
+
+  BT_session_use(s);
+  bt_stat_function = "BT_play_tone_sequence_async";
+  pthread_mutex_lock(&s->audio_lock);
+  while (1) {
+    while (s->audio_count == 0 && !s->audio_stop) {
+      s->audio_playing = 0;
+      pthread_cond_broadcast(&s->audio_changed);
+      pthread_cond_wait(&s->audio_changed, &s->audio_lock);
+    }
+    if (s->audio_stop) break;
+    freq = s->audio[s->audio_head].freq;
+    dur = s->audio[s->audio_head].dur;
+    vol = s->audio[s->audio_head].vol;
+    s->audio_head = (s->audio_head + 1) % BT_AUDIO_QUEUE;
+    s->audio_count--;
+    s->audio_playing = 1;
+    pthread_mutex_unlock(&s->audio_lock);
+
+    len = BT_tone_packet::encode(cmd_string, vol, freq, dur);
+    cmd_string[4] = DIRECT_COMMAND_NO_REPLY;
+    BT_debug_command("BT_play_tone_sequence_async", cmd_string, len);
+    BT_send(s, cmd_string, len, s->timeout_ms);
+
+    // A new tone cuts the one playing short, so wait this one out first
+    pthread_mutex_lock(&s->audio_lock);
+    BT_realtime_after(dur, &until);
+    while (!s->audio_stop &&
+           pthread_cond_timedwait(&s->audio_changed, &s->audio_lock, &until) != ETIMEDOUT)
+      ;
+  }
+  s->audio_playing = 0;
+  pthread_cond_broadcast(&s->audio_changed);
+  pthread_mutex_unlock(&s->audio_lock);
+  return (NULL);
+}
 
-  return (0);
+static void BT_audio_stop(BT_session *s) {
+  // Stop the audio thread, dropping whatever is still queued
+  pthread_mutex_lock(&s->audio_lock);
+  if (!s->audio_running) {
+    pthread_mutex_unlock(&s->audio_lock);
+    return;
+  }
+  s->audio_stop = 1;
+  pthread_cond_broadcast(&s->audio_changed);
+  pthread_mutex_unlock(&s->audio_lock);
+  pthread_join(s->audio_thread, NULL);
+  s->audio_running = 0;
 }
 
-int BT_motor_port_start(char port_ids, char power) {
-  ////////////////////////////////////////////////////////////////////////////////////////////////
-  //
-  // This function sends a command to the specified motor ports to set the motor
-  // power to the desired value.
-  //
-  // Motor ports are identified by hex values (defined at the top), but here we
-  // will use
-  //  their associated names MOTOR_A through MOTOR_D. Multiple motors can be
-  //  started with a single command by ORing their respective hex values, e.g.
+int BT_play_tone_sequence_async(const int tone_data[50][3]) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
   //
-  // BT_motor_port_power(MOTOR_A, 100);   	<-- set motor at port A to 100%
-  // power BT_motor_port_power(MOTOR_A|MOTOR_C, 50);   <-- set motors at port A
-  // and port C to 50% power
+  // Queue a list of tones, in the format taken by BT_play_tone_sequence(), to
+  // be played by the session's audio thread, and return at once. Sequences
+  // queued one after another play back to back. Nothing waits for a reply,
+  // so a lost tone goes unnoticed - this is meant for diagnostic feedback.
   //
-  // Power must be in [-100, 100] - Forward and reverse
+  // At most BT_AUDIO_QUEUE tones can be waiting. When the queue is full, the
+  // tones that do not fit are dropped.
   //
-  // Note that starting a motor at 0% power is *not the same* as stopping the
-  // motor.
-  //  to fully stop the motors you need to use the appropriate BT command.
-  //
-  // Inputs: The port identifiers
-  //         Desired power value in [-100,100]
-  //
-  // Returins: 0 on success
-  //          -1 otherwise
+  // Returns:  0 on success
+  //           -1 if the tones are invalid, no session is open, or some were
+  //              dropped
   //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_session *s = BT_cur();
+  int n, queued = 0;
 
-  void *p;
-  unsigned char *cp;
-  char reply[1024];
-  unsigned char cmd_string[15] = {0x0D, 0x00, 0x00, 0x00, 0x00,
-                                  0x00, 0x00, 0xA4, 0x00, 0x00,
-                                  0x81, 0x00, 0xA6, 0x00, 0x00};
-  //                          |length-2| | cnt_id | |type| | header |  |set
-  //                          power| |layer|  |port ids|  |power|      |start|
-  //                          |layer| |port id|
+  if ((n = BT_tone_count(tone_data)) < 0) return (-1);
+  if (s == NULL) {
+    fprintf(stderr, "BT_play_tone_sequence_async(): No connection to an EV3 is open\n");
+    return (-1);
+  }
 
-  if (power > 100 || power < -100) {
-    fprintf(stderr, "BT_motor_port_start: Power must be in [-100, 100]\n");
-    return (0);
+  pthread_mutex_lock(&s->audio_lock);
+  if (!s->audio_running) {
+    s->audio_stop = 0;
+    if (pthread_create(&s->audio_thread, NULL, BT_audio_main, s) != 0) {
+      pthread_mutex_unlock(&s->audio_lock);
+      fprintf(stderr, "BT_play_tone_sequence_async(): Unable to start the audio thread\n");
+      return (-1);
+    }
+    s->audio_running = 1;
   }
+  for (; queued < n && s->audio_count < BT_AUDIO_QUEUE; queued++) {
+    int at = (s->audio_head + s->audio_count++) % BT_AUDIO_QUEUE;
+    s->audio[at].freq = tone_data[queued][0];
+    s->audio[at].dur = tone_data[queued][1];
+    s->audio[at].vol = tone_data[queued][2];
+  }
+  if (queued > 0) s->audio_playing = 1;
+  pthread_cond_broadcast(&s->audio_changed);
+  pthread_mutex_unlock(&s->audio_lock);
 
-  if (port_ids > 15) {
-    fprintf(stderr, "BT_motor_port_start: Invalid port id value\n");
-    return (0);
+  if (queued < n) {
+    fprintf(stderr, "BT_play_tone_sequence_async(): Queue full, dropped %d tones\n", n - queued);
+    return (-1);
   }
+  return (0);
+}
 
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
+void BT_audio_wait(void) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Wait until every tone queued on the calling thread's session has been
+  // played, e.g. so a final tune is heard before the connection is closed.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_session *s = BT_cur();
+  if (s == NULL) return;
+  pthread_mutex_lock(&s->audio_lock);
+  while (s->audio_running && (s->audio_count > 0 || s->audio_playing))
+    pthread_cond_wait(&s->audio_changed, &s->audio_lock);
+  pthread_mutex_unlock(&s->audio_lock);
+}
 
-  cmd_string[9] = port_ids;
-  cmd_string[11] = power;
-  cmd_string[14] = port_ids;
+void BT_set_noreply_sync_interval(int n) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Commands sent without reply give no indication that they failed. With a
+  // sync interval of n > 0, every n-th *_noreply() call is sent requesting a
+  // reply instead, and its result is checked and returned like the blocking
+  // call would. This confirms the link is alive and the brick is still
+  // accepting commands at most n commands after something went wrong.
+  // Applies to the calling thread's session and to sessions opened afterwards.
+  //
+  // Inputs: n - number of no-reply commands between checks, 0 disables them
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_session *s = BT_cur();
+  bt_noreply_sync_interval = n > 0 ? n : 0;
+  if (s == NULL) return;
+  pthread_mutex_lock(&s->lock);
+  s->noreply_sync_interval = bt_noreply_sync_interval;
+  s->noreply_count = 0;
+  pthread_mutex_unlock(&s->lock);
+}
 
-#ifdef __BT_debug
-  fprintf(stderr, "BT_motor_port_start command string:\n");
-  for (int i = 0; i < 15; i++) {
-    fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Actuator commands
+//
+// Each session remembers what the start/stop/drive/turn calls last told every motor port: running
+// at some power, or stopped with some brake mode. A call that would not change that is not sent at
+// all, and one that changes only some of its ports is sent for those ports only. Commands that move
+// the motors in ways not tracked here (timed and synchronized moves, brick-side loops) mark their
+// ports unknown, or record the state they leave them in, so the next call goes out again. So does
+// a failed command, and a reconnect forgets everything.
+//
+// Between BT_actuator_begin() and BT_actuator_flush(), the same calls are not sent one by one but
+// gathered into a single direct command, so everything decided in one control tick reaches the
+// brick in one packet and is carried out together.
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Control tick of the calling thread, see BT_actuator_begin()
+static __thread struct {
+  BT_session *session;  // session the tick is open on, NULL when none is
+  unsigned char cmd[1024];
+  int len;
+  int reply;  // 1 if one of the gathered calls was a blocking one
+  int ports;  // every port the gathered commands touch
+} bt_tick;
+
+static int BT_motor_update(int ports, int state, int value) {
+  // Record that the motors on 'ports' are being put in 'state' (running with
+  // power 'value', stopped with brake mode 'value', or unknown). Returns the
+  // ports whose recorded state this changes - a command for the others would
+  // have no effect
+  BT_session *s = BT_cur();
+  int changed = 0;
+
+  if (s == NULL) return (ports);
+  pthread_mutex_lock(&s->lock);
+  for (int i = 0; i < 4; i++) {
+    if (!(ports & (1 << i))) continue;
+    if (state == BT_MOTOR_UNKNOWN || s->motors[i].state != state || s->motors[i].value != value)
+      changed |= 1 << i;
+    s->motors[i].state = state;
+    s->motors[i].value = value;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return (changed);
+}
+
+static void BT_motor_untracked(int ports) {
+  // Called before a command moves the motors on 'ports' in a way not tracked
+  // above. Anything gathered in the open tick goes out first, to keep the
+  // order the calls were made in
+  if (bt_tick.session != NULL && bt_tick.session == BT_cur()) BT_actuator_flush();
+  BT_motor_update(ports, BT_MOTOR_UNKNOWN, 0);
+}
+
+static int BT_motor_command(unsigned char *cmd_string, int len, int no_reply, int ports,
+                            const char *name) {
+  // Stamp the message id and send a motor command for 'ports'. With no_reply
+  // the command goes out as DIRECT_COMMAND_NO_REPLY and we return without
+  // waiting, unless this is the call picked by the sync interval to confirm
+  // the link. Inside a control tick the command is only added to the tick's
+  // packet.
+  BT_session *s = BT_cur();
+  char reply[1024];
+
+  if (s != NULL && bt_tick.session == s && !__atomic_load_n(&s->restoring, __ATOMIC_ACQUIRE)) {
+    if (bt_tick.len + len - 7 > 1024) BT_actuator_flush();
+    if (bt_tick.session == NULL) BT_actuator_begin();
+    memcpy(bt_tick.cmd + bt_tick.len, cmd_string + 7, len - 7);
+    bt_tick.len += len - 7;
+    bt_tick.reply |= !no_reply;
+    bt_tick.ports |= ports;
+    return (0);
   }
-  fprintf(stderr, "\n");
-#endif
 
-  write(*socket_id, &cmd_string[0], 15);
-  read(*socket_id, &reply[0], 1023);
+  if (no_reply && s != NULL) {
+    pthread_mutex_lock(&s->lock);
+    if (s->noreply_sync_interval > 0 && ++s->noreply_count >= s->noreply_sync_interval) {
+      s->noreply_count = 0;
+      no_reply = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+
+  cmd_string[4] = no_reply ? DIRECT_COMMAND_NO_REPLY : DIRECT_COMMAND_REPLY;
+  if (no_reply) {
+    if (BT_submit(cmd_string, len) >= 0) return (0);
+    BT_motor_update(ports, BT_MOTOR_UNKNOWN, 0);
+    return (-1);
+  }
 
-  message_id_counter++;
+  BT_complete(BT_submit(cmd_string, len), &reply[0], 1024);
 
   if (reply[4] == 0x02) {
 #ifdef __BT_debug
-    fprintf(stderr, "BT_drive command(): Command successful\n");
+    fprintf(stderr, "%s(): Command successful\n", name);
 #endif
   } else {
-    fprintf(stderr, "BT_drive command(): Command failed\n");
+    fprintf(stderr, "%s(): Command failed\n", name);
+    BT_motor_update(ports, BT_MOTOR_UNKNOWN, 0);
     return (-1);
   }
   return (0);
 }
 
-int BT_motor_port_stop(char port_ids, int brake_mode) {
-  //////////////////////////////////////////////////////////////////////////////////
-  // Stop the motor(s) at the specified ports. This does not change the output
-  // power settings!
+void BT_actuator_begin(void) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Open a control tick on the calling thread's session. Until
+  // BT_actuator_flush(), the motor start/stop/drive/turn calls made by this
+  // thread (blocking and _noreply alike) return 0 at once, and their commands
+  // are gathered to be sent together. Other calls are sent as usual, except
+  // that calls moving the motors in other ways flush the tick first. A tick
+  // still open when begin is called again is flushed.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  if (bt_tick.session != NULL) BT_actuator_flush();
+  bt_tick.session = BT_cur();
+  bt_tick.len = 7;
+  bt_tick.reply = 0;
+  bt_tick.ports = 0;
+}
+
+int BT_actuator_flush(void) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Close the calling thread's control tick and send the commands gathered in
+  // it as one direct command. It asks for a reply (and waits for it) if any
+  // of the gathered calls was a blocking one, otherwise it goes out like a
+  // _noreply call.
   //
-  // Inputs: Port ids of the motors that should be stopped
-  // 	    brake_mode: 0 -> roll to stop, 1 -> active brake (uses battery
-  // power) Returns: 0 on success
+  // Returns: 0 on success, or if there was nothing to send
   //          -1 otherwise
-  //////////////////////////////////////////////////////////////////////////////////
-  void *p;
-  unsigned char *cp;
-  char reply[1024];
-  unsigned char cmd_string[11] = {0x09, 0x00, 0x00, 0x00, 0x00, 0x00,
-                                  0x00, 0xA3, 0x00, 0x00, 0x00};
-  //                           |length-2| | cnt_id | |type| | header |  |stop|
-  //                           |layer|  |port ids|  |brake|
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  BT_session *s = bt_tick.session, *previous;
+  int r;
+
+  bt_tick.session = NULL;
+  if (s == NULL || bt_tick.len == 7) return (0);
+  bt_tick.cmd[0] = (bt_tick.len - 2) & 0xFF;
+  bt_tick.cmd[1] = ((bt_tick.len - 2) >> 8) & 0xFF;
+  bt_tick.cmd[5] = 0;  // no global or local variables
+  bt_tick.cmd[6] = 0;
+  previous = BT_session_use(s);
+  r = BT_motor_command(bt_tick.cmd, bt_tick.len, !bt_tick.reply, bt_tick.ports,
+                       "BT_actuator_flush");
+  BT_session_use(previous);
+  return (r);
+}
+
+void BT_actuator_forget(void) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Forget what the motors were last told, so the next start/stop/drive/turn
+  // call for each of them is sent even if it repeats the previous one.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_motor_update(MOTOR_A | MOTOR_B | MOTOR_C | MOTOR_D, BT_MOTOR_UNKNOWN, 0);
+}
+
+static int BT_motor_port_start_send(char port_ids, char power, int no_reply) {
+  // Builds and sends the command for BT_motor_port_start() and BT_motor_port_start_noreply()
+  unsigned char cmd_string[BT_power_start_packet::len];
+
+  if (power > 100 || power < -100) {
+    fprintf(stderr, "BT_motor_port_start: Power must be in [-100, 100]\n");
+    return (0);
+  }
+
+  if (port_ids > 15) {
+    fprintf(stderr, "BT_motor_port_start: Invalid port id value\n");
+    return (0);
+  }
+
+  if ((port_ids = BT_motor_update(port_ids, BT_MOTOR_RUNNING, power)) == 0) return (0);
+  int len = BT_power_start_packet::encode(cmd_string, port_ids, power);
+  BT_debug_command("BT_motor_port_start", cmd_string, len);
+  return (BT_motor_command(&cmd_string[0], len, no_reply, port_ids, "BT_motor_port_start"));
+}
+
+int BT_motor_port_start(char port_ids, char power) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // This function sends a command to the specified motor ports to set the motor
+  // power to the desired value.
+  //
+  // Motor ports are identified by hex values (defined at the top), but here we
+  // will use
+  //  their associated names MOTOR_A through MOTOR_D. Multiple motors can be
+  //  started with a single command by ORing their respective hex values, e.g.
+  //
+  // BT_motor_port_power(MOTOR_A, 100);   	<-- set motor at port A to 100%
+  // power BT_motor_port_power(MOTOR_A|MOTOR_C, 50);   <-- set motors at port A
+  // and port C to 50% power
+  //
+  // Power must be in [-100, 100] - Forward and reverse
+  //
+  // Note that starting a motor at 0% power is *not the same* as stopping the
+  // motor.
+  //  to fully stop the motors you need to use the appropriate BT command.
+  //
+  // Inputs: The port identifiers
+  //         Desired power value in [-100,100]
+  //
+  // Returins: 0 on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  return (BT_motor_port_start_send(port_ids, power, 0));
+}
+
+int BT_motor_port_start_noreply(char port_ids, char power) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Same as BT_motor_port_start(), but sent as a direct command without reply
+  // (type 0x80), so the call returns as soon as the command is written. See
+  // BT_set_noreply_sync_interval() for how errors are still caught.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  return (BT_motor_port_start_send(port_ids, power, 1));
+}
+
+static int BT_motor_port_stop_send(char port_ids, int brake_mode, int no_reply) {
+  // Builds and sends the command for BT_motor_port_stop() and BT_motor_port_stop_noreply()
+  unsigned char cmd_string[BT_stop_packet::len];
 
   if (port_ids > 15) {
     fprintf(stderr, "BT_motor_port_stop: Invalid port id value\n");
@@ -390,38 +1637,45 @@ int BT_motor_port_stop(char port_ids, int brake_mode) {
     return (0);
   }
 
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
-
-  cmd_string[9] = port_ids;
-  cmd_string[10] = brake_mode;
-
-#ifdef __BT_debug
-  fprintf(stderr, "BT_motor_port_stop command string:\n");
-  for (int i = 0; i < 11; i++) {
-    fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
-  }
-  fprintf(stderr, "\n");
-#endif
+  if ((port_ids = BT_motor_update(port_ids, BT_MOTOR_STOPPED, brake_mode)) == 0) return (0);
+  int len = BT_stop_packet::encode(cmd_string, port_ids, brake_mode);
+  BT_debug_command("BT_motor_port_stop", cmd_string, len);
+  return (BT_motor_command(&cmd_string[0], len, no_reply, port_ids, "BT_motor_port_stop"));
+}
 
-  write(*socket_id, &cmd_string[0], 11);
-  read(*socket_id, &reply[0], 1023);
+int BT_motor_port_stop(char port_ids, int brake_mode) {
+  //////////////////////////////////////////////////////////////////////////////////
+  // Stop the motor(s) at the specified ports. This does not change the output
+  // power settings!
+  //
+  // Inputs: Port ids of the motors that should be stopped
+  // 	    brake_mode: 0 -> roll to stop, 1 -> active brake (uses battery
+  // power) Returns: 0 on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  return (BT_motor_port_stop_send(port_ids, brake_mode, 0));
+}
 
-  message_id_counter++;
+int BT_motor_port_stop_noreply(char port_ids, int brake_mode) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Same as BT_motor_port_stop(), but sent as a direct command without reply
+  // (type 0x80), so the call returns as soon as the command is written. See
+  // BT_set_noreply_sync_interval() for how errors are still caught.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  return (BT_motor_port_stop_send(port_ids, brake_mode, 1));
+}
 
-  if (reply[4] == 0x02) {
-#ifdef __BT_debug
-    fprintf(stderr, "BT_drive command(): Command successful\n");
-#endif
-  } else {
-    fprintf(stderr, "BT_drive command(): Command failed\n");
-    return (-1);
-  }
+static int BT_all_stop_send(int brake_mode, int no_reply) {
+  // Builds and sends the command for BT_all_stop() and BT_all_stop_noreply()
+  char port_ids = MOTOR_A | MOTOR_B | MOTOR_C | MOTOR_D;
+  unsigned char cmd_string[BT_stop_packet::len];
 
-  return (0);
+  if ((port_ids = BT_motor_update(port_ids, BT_MOTOR_STOPPED, brake_mode)) == 0) return (0);
+  int len = BT_stop_packet::encode(cmd_string, port_ids, brake_mode);
+  BT_debug_command("BT_all_stop", cmd_string, len);
+  return (BT_motor_command(&cmd_string[0], len, no_reply, port_ids, "BT_all_stop"));
 }
 
 int BT_all_stop(int brake_mode) {
@@ -433,47 +1687,39 @@ int BT_all_stop(int brake_mode) {
   // power) Returns: 0 on success
   //          -1 otherwise
   //////////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  return (BT_all_stop_send(brake_mode, 0));
+}
 
-  void *p;
-  unsigned char *cp;
-  char reply[1024];
-  char port_ids = MOTOR_A | MOTOR_B | MOTOR_C | MOTOR_D;
-  unsigned char cmd_string[11] = {0x09, 0x00, 0x00, 0x00, 0x00, 0x00,
-                                  0x00, 0xA3, 0x00, 0x00, 0x00};
-  //                           |length-2| | cnt_id | |type| | header |  |stop|
-  //                           |layer|  |port ids|  |brake|
-
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
+int BT_all_stop_noreply(int brake_mode) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Same as BT_all_stop(), but sent as a direct command without reply
+  // (type 0x80), so the call returns as soon as the command is written. See
+  // BT_set_noreply_sync_interval() for how errors are still caught.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  return (BT_all_stop_send(brake_mode, 1));
+}
 
-  cmd_string[9] = port_ids;
-  cmd_string[10] = brake_mode;
+static int BT_drive_send(char lport, char rport, char power, int no_reply) {
+  // Builds and sends the command for BT_drive() and BT_drive_noreply()
+  char ports;
+  unsigned char cmd_string[BT_power_start_packet::len];
 
-#ifdef __BT_debug
-  fprintf(stderr, "BT_all_stop command string:\n");
-  for (int i = 0; i < 11; i++) {
-    fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
+  if (power > 100 || power < -100) {
+    fprintf(stderr, "BT_drive: Power must be in [-100, 100]\n");
+    return (-1);
   }
-  fprintf(stderr, "\n");
-#endif
-
-  write(*socket_id, &cmd_string[0], 11);
-  read(*socket_id, &reply[0], 1023);
-  message_id_counter++;
 
-  if (reply[4] == 0x02) {
-#ifdef __BT_debug
-    fprintf(stderr, "BT_drive command(): Command successful\n");
-#endif
-  } else {
-    fprintf(stderr, "BT_drive command(): Command failed\n");
+  if (lport > 8 || rport > 8) {
+    fprintf(stderr, "BT_drive: Invalid port id value\n");
     return (-1);
   }
+  if ((ports = BT_motor_update(lport | rport, BT_MOTOR_RUNNING, power)) == 0) return (0);
 
-  return (0);
+  int len = BT_power_start_packet::encode(cmd_string, ports, power);
+  BT_debug_command("BT_drive", cmd_string, len);
+  return (BT_motor_command(&cmd_string[0], len, no_reply, ports, "BT_drive"));
 }
 
 int BT_drive(char lport, char rport, char power) {
@@ -502,19 +1748,25 @@ int BT_drive(char lport, char rport, char power) {
   // Returns: 0 on success
   //          -1 otherwise
   //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  return (BT_drive_send(lport, rport, power, 0));
+}
 
-  void *p;
-  unsigned char *cp;
-  char ports;
-  char reply[1024];
-  unsigned char cmd_string[15] = {0x0D, 0x00, 0x00, 0x00, 0x00,
-                                  0x00, 0x00, 0xA4, 0x00, 0x00,
-                                  0x81, 0x00, 0xA6, 0x00, 0x00};
-  //                           |length-2| | cnt_id | |type| | header |  |set
-  //                           power| |layer|  |port ids|  |power|      |start|
-  //                           |layer| |port id|
+int BT_drive_noreply(char lport, char rport, char power) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Same as BT_drive(), but sent as a direct command without reply
+  // (type 0x80), so the call returns as soon as the command is written. See
+  // BT_set_noreply_sync_interval() for how errors are still caught.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  return (BT_drive_send(lport, rport, power, 1));
+}
 
-  if (power > 100 || power < -100) {
+static int BT_turn_send(char lport, char lpower, char rport, char rpower, int no_reply) {
+  // Builds and sends the command for BT_turn() and BT_turn_noreply()
+  unsigned char cmd_string[BT_turn_packet::len];
+
+  if (lpower > 100 || lpower < -100 || rpower > 100 || lpower < -100) {
     fprintf(stderr, "BT_drive: Power must be in [-100, 100]\n");
     return (-1);
   }
@@ -523,41 +1775,17 @@ int BT_drive(char lport, char rport, char power) {
     fprintf(stderr, "BT_drive: Invalid port id value\n");
     return (-1);
   }
-  ports = lport | rport;
-
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
-
-  cmd_string[9] = ports;
-  cmd_string[11] = power;
-  cmd_string[14] = ports;
-
-#ifdef __BT_debug
-  fprintf(stderr, "BT_drive command string:\n");
-  for (int i = 0; i < 16; i++) {
-    fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
-  }
-  fprintf(stderr, "\n");
-#endif
-
-  write(*socket_id, &cmd_string[0], 15);
-  read(*socket_id, &reply[0], 1023);
-
-  message_id_counter++;
-
-  if (reply[4] == 0x02) {
-#ifdef __BT_debug
-    fprintf(stderr, "BT_drive command(): Command successful\n");
-#endif
-  } else {
-    fprintf(stderr, "BT_drive command(): Command failed\n");
-    return (-1);
-  }
 
-  return (0);
+  // Only a wheel whose power changes needs a command
+  lport = BT_motor_update(lport, BT_MOTOR_RUNNING, lpower);
+  rport = BT_motor_update(rport, BT_MOTOR_RUNNING, rpower);
+  if (lport == 0 && rport == 0) return (0);
+  int len = lport == 0   ? BT_power_start_packet::encode(cmd_string, rport, rpower)
+            : rport == 0 ? BT_power_start_packet::encode(cmd_string, lport, lpower)
+                         : BT_turn_packet::encode(cmd_string, lport, lpower, rport, rpower,
+                                                  lport | rport);
+  BT_debug_command("BT_turn", cmd_string, len);
+  return (BT_motor_command(&cmd_string[0], len, no_reply, lport | rport, "BT_turn"));
 }
 
 int BT_turn(char lport, char lpower, char rport, char rpower) {
@@ -589,66 +1817,18 @@ int BT_turn(char lport, char lpower, char rport, char rpower) {
   // Returns: 0 on success
   //          -1 otherwise
   //////////////////////////////////////////////////////////////////////////////////////////////////
-  void *p;
-  unsigned char *cp;
-  char reply[1024];
-  unsigned char cmd_string[20] = {0x12, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-                                  0xA4, 0x00, 0x00, 0x81, 0x00, 0xA4, 0x00,
-                                  0x00, 0x81, 0x00, 0xA6, 0x00, 0x00};
-  //                          |length-2| | cnt_id | |type| | header |  |set
-  //                          power| |layer|  |lport id|  |power|  |set power|
-  //                          |layer| |rport id| |power|     |start|  |layer|
-  //                          |port ids|
-
-  if (lpower > 100 || lpower < -100 || rpower > 100 || lpower < -100) {
-    fprintf(stderr, "BT_drive: Power must be in [-100, 100]\n");
-    return (-1);
-  }
-
-  if (lport > 8 || rport > 8) {
-    fprintf(stderr, "BT_drive: Invalid port id value\n");
-    return (-1);
-  }
-
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
-
-  // set up power and port for left motor
-  cmd_string[9] = lport;
-  cmd_string[11] = lpower;
-
-  // set up power and port for right motor
-  cmd_string[14] = rport;
-  cmd_string[16] = rpower;
-
-  cmd_string[19] = lport | rport;
-
-#ifdef __BT_debug
-  fprintf(stderr, "BT_turn command string:\n");
-  for (int i = 0; i < 20; i++) {
-    fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
-  }
-  fprintf(stderr, "\n");
-#endif
-
-  write(*socket_id, &cmd_string[0], 20);
-  read(*socket_id, &reply[0], 1023);
-
-  message_id_counter++;
-
-  if (reply[4] == 0x02) {
-#ifdef __BT_debug
-    fprintf(stderr, "BT_turn command(): Command successful\n");
-#endif
-  } else {
-    fprintf(stderr, "BT_turn command(): Command failed\n");
-    return (-1);
-  }
+  BT_STAT_FUNCTION();
+  return (BT_turn_send(lport, lpower, rport, rpower, 0));
+}
 
-  return (0);
+int BT_turn_noreply(char lport, char lpower, char rport, char rpower) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Same as BT_turn(), but sent as a direct command without reply
+  // (type 0x80), so the call returns as soon as the command is written. See
+  // BT_set_noreply_sync_interval() for how errors are still caught.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  return (BT_turn_send(lport, lpower, rport, rpower, 1));
 }
 
 int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time,
@@ -675,8 +1855,7 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time,
   // Returns: 0 on success
   //          -1 otherwise
   //////////////////////////////////////////////////////////////////////////////////////////////////
-  void *p;
-  unsigned char *cp;
+  BT_STAT_FUNCTION();
   char reply[1024];
   unsigned char cmd_string[22] = {
       0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x81,
@@ -696,12 +1875,7 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time,
     return (-1);
   }
 
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
-
+  BT_motor_untracked(port_id);
   cmd_string[0] = LC0(20);
   cmd_string[7] = opOUTPUT_TIME_POWER;
   cmd_string[9] = port_id;
@@ -725,8 +1899,8 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time,
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 22);
-  read(*socket_id, &reply[0], 1023);
+  BT_exchange(&cmd_string[0], 22, &reply[0]);
+
 
   if (reply[4] == 0x02) {
 #ifdef __BT_debug
@@ -745,8 +1919,6 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time,
     return (-1);
   }
 
-  message_id_counter++;
-
   return (0);
 }
 
@@ -770,8 +1942,7 @@ int BT_timed_motor_port_start_v2(char port_id, char power, int time) {
   // Returns: 0 on success
   //          -1 otherwise
   //////////////////////////////////////////////////////////////////////////////////////////////////
-  void *p;
-  unsigned char *cp;
+  BT_STAT_FUNCTION();
   char reply[1024];
 
   unsigned char cmd[26] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xA4, 0x00,
@@ -793,13 +1964,9 @@ int BT_timed_motor_port_start_v2(char port_id, char power, int time) {
     return (-1);
   }
 
+  BT_motor_untracked(port_id);  // the timer stops the motor again
   BT_motor_port_start(port_id, power);
-
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd[2] = *cp;
-  cmd[3] = *(cp + 1);
+  BT_motor_update(port_id, BT_MOTOR_UNKNOWN, 0);
 
   cmd[0] = LC0(24);
   cmd[6] = LC0(10 << 2);  // size of local memory
@@ -825,8 +1992,8 @@ int BT_timed_motor_port_start_v2(char port_id, char power, int time) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd[0], 26);
-  read(*socket_id, &reply[0], 1023);
+  BT_exchange(&cmd[0], 26, &reply[0]);
+
 
   if (reply[4] == 0x02) {
 #ifdef __BT_debug
@@ -837,8 +2004,6 @@ int BT_timed_motor_port_start_v2(char port_id, char power, int time) {
     return (-1);
   }
 
-  message_id_counter++;
-
   return (0);
 }
 
@@ -854,10 +2019,8 @@ void BT_get_type_mode(char sensor_port) {
   //
   //
   //////////////////////////////////////////////////////////////////////////////////////////////////
-  void *p;
+  BT_STAT_FUNCTION();
   char reply[1024];
-  memset(reply, 0, 1024);
-  unsigned char *cp;
   unsigned char cmd_string[13] = {0x0B, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00,
                                   0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
   //                          |length-2| | cnt_id | |type| | header |   |cmd|
@@ -867,11 +2030,6 @@ void BT_get_type_mode(char sensor_port) {
     fprintf(stderr, "BT_read_colour_sensor: Invalid port id value\n");
   }
 
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
   cmd_string[7] = opINPUT_DEVICE;
   cmd_string[8] = GET_TYPEMODE;
   cmd_string[10] = sensor_port;
@@ -884,8 +2042,7 @@ void BT_get_type_mode(char sensor_port) {
   }
   fprintf(stderr, "\n");
 
-  write(*socket_id, &cmd_string[0], 13);
-  read(*socket_id, &reply[0], 1023);
+  BT_exchange(&cmd_string[0], 13, &reply[0]);
 
   fprintf(stderr, "BT_get_type_mode response string:\n");
   for (int i = 0; i < 7; i++) {
@@ -895,7 +2052,45 @@ void BT_get_type_mode(char sensor_port) {
 
   printf("type: %d, mode: %d\n", reply[5], reply[6]);
 
-  message_id_counter++;
+}
+
+int BT_sensor_get_mode(char sensor_port, int *type, int *mode) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Look up the type and mode the sensor on a port was last read in through
+  // the calling thread's session. Reading it in any other mode makes the
+  // sensor switch modes first, which takes it a while to settle.
+  //
+  // Inputs: port identifier (PORT_1, ... PORT_4), pointers for type and mode
+  // Returns: 0 on success
+  //          -1 if the port has not been read yet
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_session *s = BT_cur();
+  int r = -1;
+
+  if (s == NULL || sensor_port < 0 || sensor_port > 3) return (-1);
+  pthread_mutex_lock(&s->lock);
+  if (s->sensor_modes[(int)sensor_port].type >= 0) {
+    *type = s->sensor_modes[(int)sensor_port].type;
+    *mode = s->sensor_modes[(int)sensor_port].mode;
+    r = 0;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return (r);
+}
+
+int BT_sensor_mode_switches(void) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Returns: how many reads on the calling thread's session so far asked a
+  //          sensor for a different type or mode than its previous read
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_session *s = BT_cur();
+  int n;
+
+  if (s == NULL) return (0);
+  pthread_mutex_lock(&s->lock);
+  n = s->mode_switches;
+  pthread_mutex_unlock(&s->lock);
+  return (n);
 }
 
 int BT_read_touch_sensor(char sensor_port) {
@@ -910,48 +2105,47 @@ int BT_read_touch_sensor(char sensor_port) {
   //          0 if touch sensor is not pushed
   //          -1 if EV3 returned an error response
   //////////////////////////////////////////////////////////////////////////////////////////////////
-  void *p;
-  char reply[1024];
-  unsigned char *cp;
-  unsigned char cmd_string[15] = {0x0D, 0x00, 0x00, 0x00, 0x00,
-                                  0x01, 0x00, 0x00, 0x00, 0x00,
-                                  0x00, 0x00, 0x00, 0x00, 0x00};
-  //                          |length-2| | cnt_id | |type| | header |   |cmd|
-  //                          |sensor cmd | |layer|  |port| |type| |mode| |data
-  //                          set| |global var addr|
+  BT_STAT_FUNCTION();
+  return (BT_read_touch_sensor_complete(BT_read_touch_sensor_submit(sensor_port)));
+}
+
+int BT_read_touch_sensor_submit(char sensor_port) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  // Pipelined half of BT_read_touch_sensor() - sends the read request and
+  // returns immediately. Pass the ticket to BT_read_touch_sensor_complete() to
+  // collect the result.
+  //
+  // Inputs: port identifier of touch sensor port
+  //
+  // Returns: a ticket on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  unsigned char cmd_string[BT_touch_packet::len];
 
   if (sensor_port > 8) {
     fprintf(stderr, "BT_read_touch_sensor: Invalid port id value\n");
     return (-1);
   }
 
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
-
-  cmd_string[7] = opINPUT_DEVICE;
-  cmd_string[8] = LC0(READY_PCT);
-  cmd_string[10] = sensor_port;
-  cmd_string[11] = LC0(0x10);  // type
-  cmd_string[13] = LC0(0x01);  // data set
-  cmd_string[14] = GV0(0x00);  // global var
-
-#ifdef __BT_debug
-  fprintf(stderr, "BT_read_touch_sensor command string:\n");
-  for (int i = 0; i < 15; i++) {
-    fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
-  }
-  fprintf(stderr, "\n");
-#endif
-
-  write(*socket_id, &cmd_string[0], 15);
-  read(*socket_id, &reply[0], 1023);
+  int len = BT_touch_packet::encode(cmd_string, sensor_port);
+  BT_note_sensor_mode(sensor_port, 0x10, 0);
+  BT_debug_command("BT_read_touch_sensor", cmd_string, len);
+  return (BT_submit(&cmd_string[0], len));
+}
 
-  message_id_counter++;
+int BT_read_touch_sensor_complete(int ticket) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  // Waits for the reply to a BT_read_touch_sensor_submit() request.
+  //
+  // Returns: 1 if touch sensor is pushed
+  //          0 if touch sensor is not pushed
+  //          -1 if EV3 returned an error response
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  char reply[1024];
 
-  if (reply[4] == 0x02) {
+  if (ticket < 0) return (-1);
+  if (BT_complete(ticket, &reply[0], 1024) > 4 && reply[4] == 0x02) {
 #ifdef __BT_debug
     fprintf(stderr, "BT_touch_sensor(): Command successful\n");
 #endif
@@ -989,48 +2183,19 @@ int BT_read_colour_sensor(char sensor_port) {
   //  6    White
   //  7    Brown
   //////////////////////////////////////////////////////////////////////////////////////////////////
-  void *p;
+  BT_STAT_FUNCTION();
   char reply[1024];
-  memset(&reply[0], 0, 1024);
-  unsigned char *cp;
-  unsigned char cmd_string[15] = {0x0D, 0x00, 0x00, 0x00, 0x00,
-                                  0x01, 0x00, 0x00, 0x00, 0x00,
-                                  0x00, 0x00, 0x00, 0x00, 0x00};
-  //                          |length-2| | cnt_id | |type| | header |   |cmd|
-  //                          |sensor cmd | |layer|  |port| |type| |mode| |data
-  //                          set| |global var addr|
+  unsigned char cmd_string[BT_colour_packet::len];
 
   if (sensor_port > 8) {
     fprintf(stderr, "BT_read_colour_sensor: Invalid port id value\n");
     return (-1);
   }
 
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
-
-  cmd_string[7] = opINPUT_DEVICE;
-  cmd_string[8] = LC0(READY_RAW);
-  cmd_string[10] = sensor_port;
-  cmd_string[11] = LC0(29);    // type
-  cmd_string[12] = LC0(0x02);  // mode
-  cmd_string[13] = LC0(0x01);  // data set
-  cmd_string[14] = GV0(0x00);  // global var
-
-#ifdef __BT_debug
-  fprintf(stderr, "BT_read_colour_sensor command string:\n");
-  for (int i = 0; i < 15; i++) {
-    fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
-  }
-  fprintf(stderr, "\n");
-#endif
-
-  write(*socket_id, &cmd_string[0], 15);
-  read(*socket_id, &reply[0], 1023);
-
-  message_id_counter++;
+  int len = BT_colour_packet::encode(cmd_string, sensor_port);
+  BT_note_sensor_mode(sensor_port, 29, 2);
+  BT_debug_command("BT_read_colour_sensor", cmd_string, len);
+  BT_complete(BT_submit(&cmd_string[0], len), &reply[0], 1024);
 
   if (reply[4] == 0x02) {
 #ifdef __BT_debug
@@ -1066,273 +2231,1179 @@ int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3]) {
   //          -1 if EV3 returned an error response
   //           0 on success
   //////////////////////////////////////////////////////////////////////////////////////////////////
-  void *p;
-  unsigned char reply[1024];
-  memset(&reply[0], 0, 1024);
-  unsigned char *cp;
-  uint32_t R = 0, G = 0, B = 0;
-  double normalized;
+  BT_STAT_FUNCTION();
+  return (BT_read_colour_sensor_RGB_complete(
+      BT_read_colour_sensor_RGB_submit(sensor_port), RGB));
+}
 
-  unsigned char cmd_string[17] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C,
-                                  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-                                  0x00, 0x00, 0x00, 0x00, 0x00};
-  //                          |length-2| | cnt_id | |type| | header |   |cmd|
-  //                          |sensor cmd | |layer|  |port| |type| |mode| |data
-  //                          set| |global var addr|
+int BT_read_colour_sensor_RGB_submit(char sensor_port) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  // Pipelined half of BT_read_colour_sensor_RGB() - sends the read request and
+  // returns immediately. Pass the ticket to BT_read_colour_sensor_RGB_complete()
+  // to collect the RGB triplet.
+  //
+  // Inputs: port identifier of colour sensor port
+  //
+  // Returns: a ticket on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  unsigned char cmd_string[BT_colour_RGB_packet::len];
 
   if (sensor_port > 8) {
     fprintf(stderr, "BT_read_colour_sensor_RGB: Invalid port id value\n");
     return (-1);
   }
 
-  cmd_string[0] = LC0(15);
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
+  int len = BT_colour_RGB_packet::encode(cmd_string, sensor_port);
+  BT_note_sensor_mode(sensor_port, 29, 4);
+  BT_debug_command("BT_read_colour_sensor_RGB", cmd_string, len);
+  return (BT_submit(&cmd_string[0], len));
+}
 
-  cmd_string[7] = opINPUT_DEVICE;
-  cmd_string[8] = LC0(READY_RAW);
-  cmd_string[10] = sensor_port;
-  cmd_string[11] = LC0(29);    // type
-  cmd_string[12] = LC0(0x04);  // mode
-  cmd_string[13] = LC0(3);     // data set
-  cmd_string[14] = GV0(0x00);  // global var
-  cmd_string[15] = GV0(0x04);
-  cmd_string[16] = GV0(0x08);
+int BT_read_colour_sensor_RGB_complete(int ticket, int RGB[3]) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  // Waits for the reply to a BT_read_colour_sensor_RGB_submit() request and
+  // decodes the RGB triplet into RGB[].
+  //
+  // Returns:
+  //          -1 if EV3 returned an error response
+  //           0 on success
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  unsigned char reply[1024];
+  uint32_t R = 0, G = 0, B = 0;
+
+  if (ticket < 0) return (-1);
+  BT_complete(ticket, &reply[0], 1024);
 
+  if (reply[4] == 0x02) {
 #ifdef __BT_debug
-  fprintf(stderr, "BT_read_colour_sensor_RGB command string:\n");
-  for (int i = 0; i < 17; i++) {
-    fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
+    fprintf(stderr, "BT_colour_sensor_RGB(): Command successful\n");
+    fprintf(stderr, "BT_read_colour_sensor_RGB response string:\n");
+    for (int i = 0; i < 17; i++) {
+      fprintf(stderr, "%X, ", reply[i] & 0xff);
+    }
+    fprintf(stderr, "\n");
+#endif
+
+    R |= (uint32_t)reply[8];
+    R <<= 8;
+    R |= (uint32_t)reply[7];
+    R <<= 8;
+    R |= (uint32_t)reply[6];
+    R <<= 8;
+    R |= (uint32_t)reply[5];
+
+    G |= (uint32_t)reply[12];
+    G <<= 8;
+    G |= (uint32_t)reply[11];
+    G <<= 8;
+    G |= (uint32_t)reply[10];
+    G <<= 8;
+    G |= (uint32_t)reply[9];
+
+    B |= (uint32_t)reply[16];
+    B <<= 8;
+    B |= (uint32_t)reply[15];
+    B <<= 8;
+    B |= (uint32_t)reply[14];
+    B <<= 8;
+    B |= (uint32_t)reply[13];
+
+    RGB[0] = R;
+    RGB[1] = G;
+    RGB[2] = B;
+  } else {
+    fprintf(stderr, "BT_colour_sensor_RGB(): Command failed\n");
+    return (-1);
   }
-  fprintf(stderr, "\n");
+  return (0);
+}
+
+int BT_read_ultrasonic_sensor(char sensor_port) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Reads the value from ultrasonic sensor and returns distance in mm to any
+  // object in front of the sensor.
+  //
+  // Ports are identified as PORT_1, PORT_2, etc
+  //
+  // Inputs: port identifier for the ultrasonic sensor port
+  //
+  // Returns: distance in mm
+  //          -1 if EV3 returned an error response
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  unsigned char reply[1024];
+  unsigned char cmd_string[BT_ultrasonic_packet::len];
+
+  if (sensor_port > 8) {
+    fprintf(stderr, "BT_read_ultrasonic_sensor: Invalid port id value\n");
+    return (-1);
+  }
+
+  int len = BT_ultrasonic_packet::encode(cmd_string, sensor_port);
+  BT_note_sensor_mode(sensor_port, 30, 0);
+  BT_debug_command("BT_read_ultrasonic_sensor", cmd_string, len);
+  BT_complete(BT_submit(&cmd_string[0], len), &reply[0], 1024);
+
+  if (reply[4] == 0x02) {
+#ifdef __BT_debug
+    fprintf(stderr, "BT_ultrasonic_sensor(): Command successful\n");
 #endif
+  } else {
+    fprintf(stderr, "BT_ultrasonic_sensor: Command failed\n");
+    return (-1);
+  }
+  return (reply[5]);
+}
 
-  write(*socket_id, &cmd_string[0], 17);
-  read(*socket_id, &reply[0], 1023);
+int BT_read_gyro_sensor(char sensor_port) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // Returns the relative angle. Note that the sensor is initialized when you
+  // first power up the kit, so whatever orientation the bot has at that point,
+  // becomes 0 degrees. Sensor accuracy is +/- 3 degrees within 90 degrees. If
+  // the gyro is undergoing changes over 440 degrees/sec, the readings are known
+  // to be inaccurate.
+  //
+  // Ports are identified as PORT_1, PORT_2, etc
+  //
+  // Inputs: port identifier of gyro sensor port
+  //
+  // Returns: angle on success
+  //          -1 if EV3 returned an error response
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  return (BT_read_gyro_sensor_complete(BT_read_gyro_sensor_submit(sensor_port)));
+}
 
-  message_id_counter++;
+int BT_read_gyro_sensor_submit(char sensor_port) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  // Pipelined half of BT_read_gyro_sensor() - sends the read request and
+  // returns immediately. Pass the ticket to BT_read_gyro_sensor_complete() to
+  // collect the angle.
+  //
+  // Inputs: port identifier of gyro sensor port
+  //
+  // Returns: a ticket on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  unsigned char cmd_string[BT_gyro_packet::len];
+
+  if (sensor_port > 8) {
+    fprintf(stderr, "BT_read_gyro_sensor: Invalid port id value\n");
+    return (-1);
+  }
+
+  int len = BT_gyro_packet::encode(cmd_string, sensor_port);
+  BT_debug_command("BT_read_gyro_sensor", cmd_string, len);
+  return (BT_submit(&cmd_string[0], len));
+}
+
+int BT_read_gyro_sensor_complete(int ticket) {
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+  // Waits for the reply to a BT_read_gyro_sensor_submit() request.
+  //
+  // Returns: angle on success
+  //          -1 if EV3 returned an error response
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  unsigned char reply[1024];
+  int angle = 0;
+
+  if (ticket < 0) return (-1);
+  BT_complete(ticket, &reply[0], 1024);
 
   if (reply[4] == 0x02) {
 #ifdef __BT_debug
-    fprintf(stderr, "BT_colour_sensor_RGB(): Command successful\n");
-    fprintf(stderr, "BT_read_colour_sensor_RGB response string:\n");
-    for (int i = 0; i < 17; i++) {
+    fprintf(stderr, "BT_read_gyro_sensor(): Command successful\n");
+    fprintf(stderr, "BT_read_gyro_sensor response string:\n");
+    for (int i = 0; i < 9; i++) {
       fprintf(stderr, "%X, ", reply[i] & 0xff);
     }
     fprintf(stderr, "\n");
+    angle |= reply[8];
+    angle <<= 8;
+    angle |= reply[7];
+    angle <<= 8;
+    angle |= reply[6];
+    angle <<= 8;
+    angle |= reply[5];
+    fprintf(stderr, "angle: %d\n", angle);
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // EDITED LINES SINCE ORIGINAL API BY THE LEGORIANS - BEGIN BLOCK
+    //  We noticed that the gyro only worked in debug mode. 
+    //  This was because the API originally only updated the angle value in debug mode.
+    //  Therefore, we simply added the code in the debug block that updated the angle to an else block
+    //  Now it works as intended with only one caveat:
+    //  If the robot's program ends, the gyro sensor will keep accumulating rotation regardless of how much it moves
+    //  This effect also happens when a new program is run with it.
+    //  In order to stop this effect, the gyro sensor must be unplugged and plugged back in so that the angle
+    //    reset back to 0 and stopped accumulating. Restarting the robot also fixes this issue.
+#else
+    angle |= reply[8];
+    angle <<= 8;
+    angle |= reply[7];
+    angle <<= 8;
+    angle |= reply[6];
+    angle <<= 8;
+    angle |= reply[5];
+    //END BLOCK
+    /////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #endif
+  } else {
+    fprintf(stderr, "BT_read_gyro_sensor: Command failed\n");
+    return (-1);
+  }
+
+  return (angle);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Batched direct commands
+//
+// A direct command can hold any number of opcodes, each one writing its result to its own offset in
+// the global variable area (which the EV3 sends back as the reply payload). The BT_batch_* calls
+// below pack several sensor reads into one command so they cost a single round trip:
+//
+//    BT_batch batch;
+//    BT_batch_begin(&batch);
+//    int rgb = BT_batch_add_colour_RGB(&batch, PORT_1);
+//    int angle = BT_batch_add_gyro(&batch, PORT_2);
+//    if (BT_batch_commit(&batch) == 0) {
+//      BT_batch_get_colour_RGB(&batch, rgb, RGB);
+//      a = BT_batch_get_gyro(&batch, angle);
+//    }
+//
+// Every result is given a 4-byte aligned slot (the EV3 requires 32-bit values to be aligned).
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int BT_batch_alloc(BT_batch *batch, int cmd_bytes, int global_bytes) {
+  // Reserve room for one more opcode and its results. Returns the global
+  // variable offset for the results, or -1 if the batch is full
+  int offset = (batch->globals + 3) & ~3;
+  if (batch->len + cmd_bytes > 1024 || offset + global_bytes > BT_BATCH_MAX_GLOBALS) {
+    fprintf(stderr, "BT_batch: Batch is full\n");
+    return (-1);
+  }
+  batch->globals = offset + global_bytes;
+  return (offset);
+}
+
+static void BT_batch_put_gv(BT_batch *batch, int offset) {
+  // Append a global variable reference using the shortest encoding
+  if (offset < 32) {
+    batch->cmd[batch->len++] = GV0(offset);
+  } else if (offset < 256) {
+    batch->cmd[batch->len++] = GV1_byte0(offset);
+    batch->cmd[batch->len++] = LX_byte1(offset);
+  } else {
+    batch->cmd[batch->len++] = GV2_byte0(offset);
+    batch->cmd[batch->len++] = LX_byte1(offset);
+    batch->cmd[batch->len++] = LX_byte2(offset);
+  }
+}
+
+static void BT_batch_put_lv(BT_batch *batch, int offset) {
+  // Append a local variable reference (brick-side loops use a few locals)
+  if (offset < 32) {
+    batch->cmd[batch->len++] = LV0(offset);
+  } else {
+    batch->cmd[batch->len++] = PRIMPAR_LONG | PRIMPAR_VARIABEL | PRIMPAR_LOCAL | PRIMPAR_1_BYTE;
+    batch->cmd[batch->len++] = LX_byte1(offset);
+  }
+}
+
+static void BT_batch_put_const(BT_batch *batch, int value) {
+  // Append a constant parameter using the shortest encoding
+  if (value >= -31 && value <= 31) {
+    batch->cmd[batch->len++] = LC0(value);
+  } else if (value >= -127 && value <= 127) {
+    batch->cmd[batch->len++] = LC1_byte0();
+    batch->cmd[batch->len++] = LX_byte1(value);
+  } else if (value >= -32767 && value <= 32767) {
+    batch->cmd[batch->len++] = LC2_byte0();
+    batch->cmd[batch->len++] = LX_byte1(value);
+    batch->cmd[batch->len++] = LX_byte2(value);
+  } else {
+    batch->cmd[batch->len++] = PRIMPAR_LONG | PRIMPAR_CONST | PRIMPAR_4_BYTES;
+    batch->cmd[batch->len++] = LX_byte1(value);
+    batch->cmd[batch->len++] = LX_byte2(value);
+    batch->cmd[batch->len++] = LX_byte3(value);
+    batch->cmd[batch->len++] = LX_byte4(value);
+  }
+}
+
+static int BT_batch_put_jump(BT_batch *batch, int target) {
+  // Append the offset parameter of an opJR* opcode (always its last parameter, so the offset is
+  // counted from the end of this 3-byte field). Pass target=-1 for a forward jump, and fix it
+  // with BT_batch_set_jump() once the target is known. Returns the field position for that.
+  int at = batch->len;
+  int offset = target < 0 ? 0 : target - (at + 3);
+  batch->cmd[batch->len++] = LC2_byte0();
+  batch->cmd[batch->len++] = LX_byte1(offset);
+  batch->cmd[batch->len++] = LX_byte2(offset);
+  return (at);
+}
+
+static void BT_batch_set_jump(BT_batch *batch, int at, int target) {
+  // Point the jump field written at position 'at' to target
+  int offset = target - (at + 3);
+  batch->cmd[at + 1] = LX_byte1(offset);
+  batch->cmd[at + 2] = LX_byte2(offset);
+}
+
+void BT_batch_begin(BT_batch *batch) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Start an empty batch. The 7-byte prefix (length, counter id, type and
+  // header) is filled in by BT_batch_commit()/BT_batch_submit().
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  memset(&batch->cmd[0], 0, 7);
+  batch->len = 7;
+  batch->globals = 0;
+  batch->locals = 0;
+  batch->timeout_ms = BT_timeout();
+  batch->reply_len = 0;
+}
+
+int BT_batch_add_colour_RGB(BT_batch *batch, char sensor_port) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Add a colour sensor RGB read (same as BT_read_colour_sensor_RGB()).
+  //
+  // Returns: the result offset, to be passed to BT_batch_get_colour_RGB()
+  //          -1 on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  int offset;
+
+  if (sensor_port > 8) {
+    fprintf(stderr, "BT_batch_add_colour_RGB: Invalid port id value\n");
+    return (-1);
+  }
+  if ((offset = BT_batch_alloc(batch, 16, 12)) < 0) return (-1);
+
+  batch->cmd[batch->len++] = opINPUT_DEVICE;
+  batch->cmd[batch->len++] = LC0(READY_RAW);
+  batch->cmd[batch->len++] = LC0(0);  // layer
+  batch->cmd[batch->len++] = sensor_port;
+  BT_note_sensor_mode(sensor_port, 29, 4);
+  batch->cmd[batch->len++] = LC0(29);    // type
+  batch->cmd[batch->len++] = LC0(0x04);  // mode
+  batch->cmd[batch->len++] = LC0(3);     // data set
+  BT_batch_put_gv(batch, offset);
+  BT_batch_put_gv(batch, offset + 4);
+  BT_batch_put_gv(batch, offset + 8);
+  return (offset);
+}
+
+int BT_batch_add_gyro(BT_batch *batch, char sensor_port) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Add a gyro angle read (same as BT_read_gyro_sensor()).
+  //
+  // Returns: the result offset, to be passed to BT_batch_get_gyro()
+  //          -1 on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  int offset;
+
+  if (sensor_port > 8) {
+    fprintf(stderr, "BT_batch_add_gyro: Invalid port id value\n");
+    return (-1);
+  }
+  if ((offset = BT_batch_alloc(batch, 10, 4)) < 0) return (-1);
+
+  batch->cmd[batch->len++] = opINPUT_READEXT;
+  batch->cmd[batch->len++] = LC0(0);  // layer
+  batch->cmd[batch->len++] = sensor_port;
+  batch->cmd[batch->len++] = LC0(0);         // don't change type
+  batch->cmd[batch->len++] = LC0(-1);        // don't change mode
+  batch->cmd[batch->len++] = LC0(DATA_RAW);  // format
+  batch->cmd[batch->len++] = LC0(0x01);      // data set
+  BT_batch_put_gv(batch, offset);
+  return (offset);
+}
+
+int BT_batch_add_touch(BT_batch *batch, char sensor_port) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Add a touch sensor read (same as BT_read_touch_sensor()).
+  //
+  // Returns: the result offset, to be passed to BT_batch_get_touch()
+  //          -1 on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  int offset;
+
+  if (sensor_port > 8) {
+    fprintf(stderr, "BT_batch_add_touch: Invalid port id value\n");
+    return (-1);
+  }
+  if ((offset = BT_batch_alloc(batch, 10, 1)) < 0) return (-1);
+
+  batch->cmd[batch->len++] = opINPUT_DEVICE;
+  batch->cmd[batch->len++] = LC0(READY_PCT);
+  batch->cmd[batch->len++] = LC0(0);  // layer
+  batch->cmd[batch->len++] = sensor_port;
+  BT_note_sensor_mode(sensor_port, 0x10, 0);
+  batch->cmd[batch->len++] = LC0(0x10);  // type
+  batch->cmd[batch->len++] = LC0(0);     // mode
+  batch->cmd[batch->len++] = LC0(0x01);  // data set
+  BT_batch_put_gv(batch, offset);
+  return (offset);
+}
+
+int BT_batch_add_wait(BT_batch *batch, int ms) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Add a pause of ms milliseconds on the brick, so the reads added after it
+  // are taken that much later than the ones before it (e.g. to debounce a
+  // touch sensor within one round trip). The reply timeout grows to match.
+  //
+  // Returns: 0 on success
+  //          -1 on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  int timer = batch->locals;
+
+  if (ms < 0 || ms > 10000) {
+    fprintf(stderr, "BT_batch_add_wait: Invalid wait time\n");
+    return (-1);
+  }
+  if (timer + 4 > 63 || batch->len + 12 > 1024) {
+    fprintf(stderr, "BT_batch_add_wait: Batch is full\n");
+    return (-1);
+  }
+  batch->locals += 4;  // timer for this wait
+  if (batch->timeout_ms > 0) batch->timeout_ms += ms;
+
+  batch->cmd[batch->len++] = opTIMER_WAIT;
+  BT_batch_put_const(batch, ms);
+  BT_batch_put_lv(batch, timer);
+  batch->cmd[batch->len++] = opTIMER_READY;
+  BT_batch_put_lv(batch, timer);
+  return (0);
+}
+
+int BT_batch_submit(BT_batch *batch) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Send the batch as one direct command without waiting for the reply.
+  //
+  // Returns: a ticket for BT_batch_complete()
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  batch->cmd[0] = LX_byte1(batch->len - 2);  // length-2
+  batch->cmd[1] = LX_byte2(batch->len - 2);
+  batch->cmd[4] = DIRECT_COMMAND_REPLY;
+  batch->cmd[5] = LX_byte1(batch->globals);  // global variable bytes
+  batch->cmd[6] = (LX_byte2(batch->globals) & 0x03) | (batch->locals << 2);
+
+#ifdef __BT_debug
+  fprintf(stderr, "BT_batch command string:\n");
+  for (int i = 0; i < batch->len; i++) {
+    fprintf(stderr, "%X, ", batch->cmd[i] & 0xff);
+  }
+  fprintf(stderr, "\n");
+#endif
+
+  return (BT_submit_timeout(&batch->cmd[0], batch->len, batch->timeout_ms));
+}
+
+int BT_batch_complete(BT_batch *batch, int ticket) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Wait for the reply to a submitted batch and keep it for the
+  // BT_batch_get_*() calls.
+  //
+  // Returns: 0 on success
+  //          -1 if the EV3 returned an error or the reply was too short
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  batch->reply_len = BT_complete(ticket, &batch->reply[0], 1024);
+  if (batch->reply_len < 5 + batch->globals || batch->reply[4] != DIRECT_REPLY) {
+    fprintf(stderr, "BT_batch_commit(): Command failed\n");
+    batch->reply_len = 0;
+    return (-1);
+  }
+  return (0);
+}
+
+int BT_batch_commit(BT_batch *batch) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Send the batch and wait for its reply - one round trip for everything
+  // added since BT_batch_begin().
+  //
+  // Returns: 0 on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  int ticket = BT_batch_submit(batch);
+  if (ticket < 0) return (-1);
+  return (BT_batch_complete(batch, ticket));
+}
+
+static int BT_batch_get32(BT_batch *batch, int offset) {
+  unsigned char *rp = &batch->reply[5 + offset];
+  return ((int)((uint32_t)rp[0] | ((uint32_t)rp[1] << 8) | ((uint32_t)rp[2] << 16) |
+                ((uint32_t)rp[3] << 24)));
+}
+
+int BT_batch_get_colour_RGB(BT_batch *batch, int offset, int RGB[3]) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Decode the RGB triplet of a committed BT_batch_add_colour_RGB() read.
+  // Returns: 0 on success, -1 if the batch has no valid reply
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  if (offset < 0 || batch->reply_len == 0) return (-1);
+  RGB[0] = BT_batch_get32(batch, offset);
+  RGB[1] = BT_batch_get32(batch, offset + 4);
+  RGB[2] = BT_batch_get32(batch, offset + 8);
+  return (0);
+}
+
+int BT_batch_get_gyro(BT_batch *batch, int offset) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Decode the angle of a committed BT_batch_add_gyro() read.
+  // Returns: the angle, -1 if the batch has no valid reply
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  if (offset < 0 || batch->reply_len == 0) return (-1);
+  return (BT_batch_get32(batch, offset));
+}
+
+int BT_batch_get_touch(BT_batch *batch, int offset) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Decode a committed BT_batch_add_touch() read.
+  // Returns: 1 if pushed, 0 if not, -1 if the batch has no valid reply
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  if (offset < 0 || batch->reply_len == 0) return (-1);
+  return (batch->reply[5 + offset] != 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Tacho counts and synchronized moves
+//
+// These are built with the BT_batch helpers above. The sync moves brake by themselves when done,
+// and can wait on the brick (opOUTPUT_READY) so the reply marks the end of the move.
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int BT_motor_index(char port_id) {
+  // MOTOR_A..MOTOR_D bit -> output number 0..3 (opOUTPUT_GET_COUNT takes a number, not a mask)
+  for (int i = 0; i < 4; i++)
+    if (port_id == (1 << i)) return (i);
+  return (-1);
+}
+
+int BT_motor_get_count(char port_id, int *count) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Read the tacho (rotation) count of one motor, in degrees since the count
+  // was last cleared. Counts grow with positive power and shrink with negative.
+  //
+  // Inputs: port identifier of a single motor (MOTOR_A, ... MOTOR_D)
+  //         pointer for the count
+  //
+  // Returns: 0 on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  BT_batch batch;
+  int at, output = BT_motor_index(port_id);
+
+  if (output < 0) {
+    fprintf(stderr, "BT_motor_get_count: Invalid port id value\n");
+    return (-1);
+  }
+
+  BT_batch_begin(&batch);
+  if ((at = BT_batch_alloc(&batch, 5, 4)) < 0) return (-1);
+  batch.cmd[batch.len++] = opOUTPUT_GET_COUNT;
+  batch.cmd[batch.len++] = LC0(0);  // layer
+  batch.cmd[batch.len++] = LC0(output);
+  BT_batch_put_gv(&batch, at);
+  if (BT_batch_commit(&batch) < 0) return (-1);
+  *count = BT_batch_get32(&batch, at);
+  return (0);
+}
+
+int BT_motor_clear_count(char port_ids) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Reset the tacho count of the given motor(s) to zero.
+  //
+  // Inputs: port identifier(s) (MOTOR_A|MOTOR_D, etc.)
+  //
+  // Returns: 0 on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  BT_batch batch;
 
-    R |= (uint32_t)reply[8];
-    R <<= 8;
-    R |= (uint32_t)reply[7];
-    R <<= 8;
-    R |= (uint32_t)reply[6];
-    R <<= 8;
-    R |= (uint32_t)reply[5];
+  if (port_ids > 15) {
+    fprintf(stderr, "BT_motor_clear_count: Invalid port id value\n");
+    return (-1);
+  }
 
-    G |= (uint32_t)reply[12];
-    G <<= 8;
-    G |= (uint32_t)reply[11];
-    G <<= 8;
-    G |= (uint32_t)reply[10];
-    G <<= 8;
-    G |= (uint32_t)reply[9];
+  BT_batch_begin(&batch);
+  batch.cmd[batch.len++] = opOUTPUT_CLR_COUNT;
+  batch.cmd[batch.len++] = LC0(0);  // layer
+  batch.cmd[batch.len++] = port_ids;
+  return (BT_batch_commit(&batch));
+}
 
-    B |= (uint32_t)reply[16];
-    B <<= 8;
-    B |= (uint32_t)reply[15];
-    B <<= 8;
-    B |= (uint32_t)reply[14];
-    B <<= 8;
-    B |= (uint32_t)reply[13];
+static int BT_sync_send(int opcode, char lport, char rport, char power, int turn, int amount,
+                        int wait, const char *name) {
+  // Builds and sends the command for BT_step_sync() and BT_time_sync()
+  BT_batch batch;
+  int ports = lport | rport;
 
-    RGB[0] = R;
-    RGB[1] = G;
-    RGB[2] = B;
-  } else {
-    fprintf(stderr, "BT_colour_sensor_RGB(): Command failed\n");
+  if (BT_motor_index(lport) < 0 || BT_motor_index(rport) < 0 || lport == rport) {
+    fprintf(stderr, "%s: Invalid port id value\n", name);
+    return (-1);
+  }
+  if (power > 100 || power < -100) {
+    fprintf(stderr, "%s: Power must be in [-100, 100]\n", name);
+    return (-1);
+  }
+  if (turn > 200 || turn < -200 || amount <= 0) {
+    fprintf(stderr, "%s: Turn must be in [-200, 200] and the move positive\n", name);
     return (-1);
   }
+
+  // The brick's turn ratio slows the higher numbered of the two motors when positive
+  if (rport < lport) turn = -turn;
+
+  BT_motor_untracked(ports);
+  BT_batch_begin(&batch);
+  batch.cmd[batch.len++] = opcode;
+  batch.cmd[batch.len++] = LC0(0);  // layer
+  batch.cmd[batch.len++] = ports;
+  BT_batch_put_const(&batch, power);
+  BT_batch_put_const(&batch, turn);
+  BT_batch_put_const(&batch, amount);
+  batch.cmd[batch.len++] = LC0(1);  // brake at the end
+  if (wait) {
+    batch.cmd[batch.len++] = opOUTPUT_READY;
+    batch.cmd[batch.len++] = LC0(0);
+    batch.cmd[batch.len++] = ports;
+    // The reply waits for the move. Steps are allowed twice the time they take
+    // at the nominal ~10 deg/s per unit of power of the large motor
+    if (opcode == opOUTPUT_TIME_SYNC)
+      batch.timeout_ms = BT_timeout_after(amount);
+    else if (power != 0)
+      batch.timeout_ms = BT_timeout_after(2 * amount * 100 / abs(power));
+  }
+  if (BT_batch_commit(&batch) < 0) return (-1);
+  if (wait) BT_motor_update(ports, BT_MOTOR_STOPPED, 1);
   return (0);
 }
 
-int BT_read_ultrasonic_sensor(char sensor_port) {
-  ////////////////////////////////////////////////////////////////////////////////////////////////
+int BT_step_sync(char lport, char rport, char power, int turn, int degrees, int wait) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Move the left and right wheels together, synchronized by the brick, until
+  // the faster wheel has turned the given number of degrees, then brake. This
+  // commands an exact wheel rotation in one message instead of a sequence of
+  // start/sleep/stop calls.
+  //
+  // The turn ratio sets how the right wheel follows the left one:
+  //    0    - both at the same speed (drive straight)
+  //    100  - right wheel stopped (pivot on it, turning clockwise)
+  //    200  - right wheel at the opposite speed (spin on the spot clockwise
+  //           for positive power)
+  //    negative values do the same to the left wheel
+  //
+  // Inputs: port identifiers of the left and right motors
+  //         power in [-100, 100]
+  //         turn ratio in [-200, 200]
+  //         degrees of wheel rotation (> 0)
+  //         wait: 1 -> the call returns once the move is finished
+  //               0 -> returns once the brick has started it
   //
-  // Reads the value from ultrasonic sensor and returns distance in mm to any
-  // object in front of the sensor.
+  // Returns: 0 on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  return (BT_sync_send(opOUTPUT_STEP_SYNC, lport, rport, power, turn, degrees, wait,
+                       "BT_step_sync"));
+}
+
+int BT_time_sync(char lport, char rport, char power, int turn, int time, int wait) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Same as BT_step_sync(), but the move lasts the given time in ms instead
+  // of a number of degrees.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  return (BT_sync_send(opOUTPUT_TIME_SYNC, lport, rport, power, turn, time, wait,
+                       "BT_time_sync"));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Brick-side loops
+//
+// A direct command is a small program, and the opJR* jump opcodes let it loop on the brick until a
+// sensor condition holds. The reply is only sent once the loop ends, so a loop that stops the
+// motors itself reacts within one pass of the brick's VM rather than one Bluetooth round trip.
+//
+// The brick runs one direct command at a time, so the calls below block until the loop is over.
+// Loops driving the wheels always carry a timeout, so a missed condition cannot leave the robot
+// driving off.
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int BT_drive_until_colour_change(char lport, char rport, char power, char sensor_port,
+                                 const int RGB_min[3], const int RGB_max[3], int timeout_ms,
+                                 int RGB[3]) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Drive the left and right motors at the given power (as BT_drive()) until the raw RGB reading
+  // of the colour sensor leaves the range [RGB_min, RGB_max] in any channel, or timeout_ms
+  // milliseconds pass. The brick stops the motors (brake on) as soon as either happens, then
+  // replies with the last reading, which is stored in RGB.
   //
-  // Ports are identified as PORT_1, PORT_2, etc
+  // For example, to follow a black street until the sensor sees something else:
   //
-  // Inputs: port identifier for the ultrasonic sensor port
+  //    int lo[3] = {0, 0, 0}, hi[3] = {60, 60, 60}, RGB[3];
+  //    BT_drive_until_colour_change(MOTOR_D, MOTOR_A, 20, PORT_1, lo, hi, 5000, RGB);
   //
-  // Returns: distance in mm
-  //          -1 if EV3 returned an error response
+  // Inputs: port identifiers of the left and right motors
+  //         power for both motors in [-100, 100]
+  //         port identifier of the colour sensor
+  //         lower and upper bound of the raw R, G, B values to keep driving on
+  //         timeout in milliseconds (> 0)
+  //         array for the final RGB reading
+  //
+  // Returns: 1 if the colour left the range
+  //          0 on timeout
+  //          -1 otherwise
   //////////////////////////////////////////////////////////////////////////////////////////////////
-  void *p;
-  unsigned char reply[1024];
-  memset(&reply[0], 0, 1024);
-  unsigned char *cp;
-
-  unsigned char cmd_string[15] = {0x00, 0x00, 0x00, 0x00, 0x00,
-                                  0x01, 0x00, 0x00, 0x00, 0x00,
-                                  0x00, 0x00, 0x00, 0x00, 0x00};
-  //                          |length-2| | cnt_id | |type| | header |   |cmd|
-  //                          |sensor cmd | |layer|  |port| |type| |mode| |data
-  //                          set| |global var addr|
+  BT_STAT_FUNCTION();
+  BT_batch batch;
+  int rgb, timed_out, loop, exits[6], ports = lport | rport;
 
   if (sensor_port > 8) {
-    fprintf(stderr, "BT_read_ultrasonic_sensor: Invalid port id value\n");
+    fprintf(stderr, "BT_drive_until_colour_change: Invalid port id value\n");
     return (-1);
   }
-
-  cmd_string[0] = LC0(13);
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
-
-  cmd_string[7] = opINPUT_DEVICE;
-  cmd_string[8] = LC0(READY_RAW);
-  cmd_string[10] = sensor_port;
-  cmd_string[11] = LC0(30);    // type
-  cmd_string[13] = LC0(0x01);  // data set
-  cmd_string[14] = GV0(0x00);  // global var
-
-#ifdef __BT_debug
-  fprintf(stderr, "BT_read_ultrasonic_sensor command string\n");
-  for (int i = 0; i < 15; i++) {
-    fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
+  if (power > 100 || power < -100) {
+    fprintf(stderr, "BT_drive_until_colour_change: Power must be in [-100, 100]\n");
+    return (-1);
+  }
+  if (timeout_ms <= 0) {
+    fprintf(stderr, "BT_drive_until_colour_change: Timeout must be positive\n");
+    return (-1);
   }
-  fprintf(stderr, "\n");
-#endif
 
-  write(*socket_id, &cmd_string[0], 15);
-  read(*socket_id, &reply[0], 1023);
+  BT_motor_untracked(ports);
+  BT_batch_begin(&batch);
+  if ((rgb = BT_batch_alloc(&batch, 128, 12)) < 0) return (-1);
+  if ((timed_out = BT_batch_alloc(&batch, 0, 1)) < 0) return (-1);
+  batch.locals = 8;  // LV 0: start time, LV 4: elapsed time
+  batch.timeout_ms = BT_timeout_after(timeout_ms);
+
+  batch.cmd[batch.len++] = opOUTPUT_POWER;
+  batch.cmd[batch.len++] = LC0(0);  // layer
+  batch.cmd[batch.len++] = ports;
+  BT_batch_put_const(&batch, power);
+  batch.cmd[batch.len++] = opOUTPUT_START;
+  batch.cmd[batch.len++] = LC0(0);
+  batch.cmd[batch.len++] = ports;
+  batch.cmd[batch.len++] = opTIMER_READ;
+  BT_batch_put_lv(&batch, 0);
+
+  // loop: read RGB, leave if any channel is out of range
+  loop = batch.len;
+  batch.cmd[batch.len++] = opINPUT_DEVICE;
+  batch.cmd[batch.len++] = LC0(READY_RAW);
+  batch.cmd[batch.len++] = LC0(0);  // layer
+  batch.cmd[batch.len++] = sensor_port;
+  BT_note_sensor_mode(sensor_port, 29, 4);
+  batch.cmd[batch.len++] = LC0(29);    // type
+  batch.cmd[batch.len++] = LC0(0x04);  // mode
+  batch.cmd[batch.len++] = LC0(3);     // data set
+  BT_batch_put_gv(&batch, rgb);
+  BT_batch_put_gv(&batch, rgb + 4);
+  BT_batch_put_gv(&batch, rgb + 8);
+  for (int i = 0; i < 3; i++) {
+    batch.cmd[batch.len++] = opJR_LT32;
+    BT_batch_put_gv(&batch, rgb + 4 * i);
+    BT_batch_put_const(&batch, RGB_min[i]);
+    exits[2 * i] = BT_batch_put_jump(&batch, -1);
+    batch.cmd[batch.len++] = opJR_GT32;
+    BT_batch_put_gv(&batch, rgb + 4 * i);
+    BT_batch_put_const(&batch, RGB_max[i]);
+    exits[2 * i + 1] = BT_batch_put_jump(&batch, -1);
+  }
+
+  // ... and go around again until the timeout
+  batch.cmd[batch.len++] = opTIMER_READ;
+  BT_batch_put_lv(&batch, 4);
+  batch.cmd[batch.len++] = opSUB32;
+  BT_batch_put_lv(&batch, 4);
+  BT_batch_put_lv(&batch, 0);
+  BT_batch_put_lv(&batch, 4);
+  batch.cmd[batch.len++] = opJR_LT32;
+  BT_batch_put_lv(&batch, 4);
+  BT_batch_put_const(&batch, timeout_ms);
+  BT_batch_put_jump(&batch, loop);
+  batch.cmd[batch.len++] = opMOVE8_8;
+  batch.cmd[batch.len++] = LC0(1);
+  BT_batch_put_gv(&batch, timed_out);
+
+  // exit: stop the motors
+  for (int i = 0; i < 6; i++) BT_batch_set_jump(&batch, exits[i], batch.len);
+  batch.cmd[batch.len++] = opOUTPUT_STOP;
+  batch.cmd[batch.len++] = LC0(0);
+  batch.cmd[batch.len++] = ports;
+  batch.cmd[batch.len++] = LC0(1);  // brake
+
+  if (BT_batch_commit(&batch) < 0) return (-1);
+  BT_motor_update(ports, BT_MOTOR_STOPPED, 1);
+  BT_batch_get_colour_RGB(&batch, rgb, RGB);
+  return (batch.reply[5 + timed_out] ? 0 : 1);
+}
 
-  message_id_counter++;
+int BT_motor_until_touch(char port, char power, char touch_port, int debounce, int timeout_ms,
+                         int *elapsed_ms) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Run the motor(s) on port at the given power until the touch sensor on touch_port reads
+  // pushed on 'debounce' consecutive reads, BT_TOUCH_POLL_MS apart (so it has to stay pushed for
+  // (debounce-1)*BT_TOUCH_POLL_MS), or timeout_ms milliseconds pass. The brick stops the motor
+  // (brake on) itself, and replies with the time it ran.
+  //
+  // This replaces starting the motor and then polling the touch sensor over Bluetooth (several
+  // round trips per poll when the reads are repeated to filter out bounces).
+  //
+  // Inputs: port identifier(s) of the motor(s) to run
+  //         power in [-100, 100]
+  //         port identifier of the touch sensor
+  //         number of consecutive pushed reads required, in [1, 100]
+  //         timeout in milliseconds, or 0 to wait for the touch sensor indefinitely
+  //         pointer for the time the motor ran, in ms (may be NULL)
+  //
+  // Returns: 1 if the touch sensor was pushed
+  //          0 on timeout
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
+  BT_batch batch;
+  int elapsed, timed_out, loop, reset, timeout_jump = -1, out;
 
-  if (reply[4] == 0x02) {
-#ifdef __BT_debug
-    fprintf(stderr, "BT_ultrasonic_sensor(): Command successful\n");
-#endif
-  } else {
-    fprintf(stderr, "BT_ultrasonic_sensor: Command failed\n");
+  if (touch_port > 8) {
+    fprintf(stderr, "BT_motor_until_touch: Invalid port id value\n");
     return (-1);
   }
-  return (reply[5]);
+  if (power > 100 || power < -100) {
+    fprintf(stderr, "BT_motor_until_touch: Power must be in [-100, 100]\n");
+    return (-1);
+  }
+  if (debounce < 1 || debounce > 100 || timeout_ms < 0) {
+    fprintf(stderr, "BT_motor_until_touch: Invalid debounce count or timeout\n");
+    return (-1);
+  }
+
+  BT_motor_untracked(port);
+  BT_batch_begin(&batch);
+  if ((elapsed = BT_batch_alloc(&batch, 104, 4)) < 0) return (-1);
+  if ((timed_out = BT_batch_alloc(&batch, 0, 1)) < 0) return (-1);
+  batch.locals = 16;  // LV 0: start time, LV 4: time now, LV 8: pushed count, LV 9: touch reading,
+                      // LV 12: poll timer
+  batch.timeout_ms = timeout_ms > 0 ? BT_timeout_after(timeout_ms) : 0;
+
+  batch.cmd[batch.len++] = opOUTPUT_POWER;
+  batch.cmd[batch.len++] = LC0(0);  // layer
+  batch.cmd[batch.len++] = port;
+  BT_batch_put_const(&batch, power);
+  batch.cmd[batch.len++] = opOUTPUT_START;
+  batch.cmd[batch.len++] = LC0(0);
+  batch.cmd[batch.len++] = port;
+  batch.cmd[batch.len++] = opTIMER_READ;
+  BT_batch_put_lv(&batch, 0);
+  batch.cmd[batch.len++] = opMOVE8_8;
+  batch.cmd[batch.len++] = LC0(0);
+  BT_batch_put_lv(&batch, 8);
+
+  // loop: wait for the next poll, update the elapsed time and check the timeout. Without the
+  // wait the reads would come microseconds apart, and a bounce would pass for a push
+  loop = batch.len;
+  batch.cmd[batch.len++] = opTIMER_WAIT;
+  BT_batch_put_const(&batch, BT_TOUCH_POLL_MS);
+  BT_batch_put_lv(&batch, 12);
+  batch.cmd[batch.len++] = opTIMER_READY;
+  BT_batch_put_lv(&batch, 12);
+  batch.cmd[batch.len++] = opTIMER_READ;
+  BT_batch_put_lv(&batch, 4);
+  batch.cmd[batch.len++] = opSUB32;
+  BT_batch_put_lv(&batch, 4);
+  BT_batch_put_lv(&batch, 0);
+  BT_batch_put_gv(&batch, elapsed);
+  if (timeout_ms > 0) {
+    batch.cmd[batch.len++] = opJR_GTEQ32;
+    BT_batch_put_gv(&batch, elapsed);
+    BT_batch_put_const(&batch, timeout_ms);
+    timeout_jump = BT_batch_put_jump(&batch, -1);
+  }
+
+  // read the touch sensor, count consecutive pushed reads
+  batch.cmd[batch.len++] = opINPUT_DEVICE;
+  batch.cmd[batch.len++] = LC0(READY_PCT);
+  batch.cmd[batch.len++] = LC0(0);  // layer
+  batch.cmd[batch.len++] = touch_port;
+  BT_note_sensor_mode(touch_port, 0x10, 0);
+  batch.cmd[batch.len++] = LC0(0x10);  // type
+  batch.cmd[batch.len++] = LC0(0);     // mode
+  batch.cmd[batch.len++] = LC0(0x01);  // data set
+  BT_batch_put_lv(&batch, 9);
+  batch.cmd[batch.len++] = opJR_EQ8;
+  BT_batch_put_lv(&batch, 9);
+  batch.cmd[batch.len++] = LC0(0);
+  reset = BT_batch_put_jump(&batch, -1);
+  batch.cmd[batch.len++] = opADD8;
+  BT_batch_put_lv(&batch, 8);
+  batch.cmd[batch.len++] = LC0(1);
+  BT_batch_put_lv(&batch, 8);
+  batch.cmd[batch.len++] = opJR_LT8;
+  BT_batch_put_lv(&batch, 8);
+  BT_batch_put_const(&batch, debounce);
+  BT_batch_put_jump(&batch, loop);
+  batch.cmd[batch.len++] = opJR;
+  out = BT_batch_put_jump(&batch, -1);
+
+  // reset: not pushed, start counting again
+  BT_batch_set_jump(&batch, reset, batch.len);
+  batch.cmd[batch.len++] = opMOVE8_8;
+  batch.cmd[batch.len++] = LC0(0);
+  BT_batch_put_lv(&batch, 8);
+  batch.cmd[batch.len++] = opJR;
+  BT_batch_put_jump(&batch, loop);
+
+  // timeout: flag it for the reply
+  if (timeout_jump >= 0) BT_batch_set_jump(&batch, timeout_jump, batch.len);
+  batch.cmd[batch.len++] = opMOVE8_8;
+  batch.cmd[batch.len++] = LC0(1);
+  BT_batch_put_gv(&batch, timed_out);
+
+  // out: stop the motor
+  BT_batch_set_jump(&batch, out, batch.len);
+  batch.cmd[batch.len++] = opOUTPUT_STOP;
+  batch.cmd[batch.len++] = LC0(0);
+  batch.cmd[batch.len++] = port;
+  batch.cmd[batch.len++] = LC0(1);  // brake
+
+  if (BT_batch_commit(&batch) < 0) return (-1);
+  BT_motor_update(port, BT_MOTOR_STOPPED, 1);
+  if (elapsed_ms != NULL) *elapsed_ms = BT_batch_get32(&batch, elapsed);
+  return (batch.reply[5 + timed_out] ? 0 : 1);
 }
 
-int BT_read_gyro_sensor(char sensor_port) {
-  ////////////////////////////////////////////////////////////////////////////////////////////////
-  //
-  // Returns the relative angle. Note that the sensor is initialized when you
-  // first power up the kit, so whatever orientation the bot has at that point,
-  // becomes 0 degrees. Sensor accuracy is +/- 3 degrees within 90 degrees. If
-  // the gyro is undergoing changes over 440 degrees/sec, the readings are known
-  // to be inaccurate.
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Burst sampling
+//
+// The brick has no indexed access to the global variable area, so a burst is written out in full:
+// each sample is a timestamp and an RGB read into its own 16 bytes of globals, followed by a timer
+// wait for the next one. 32 samples are about 870 bytes of command, which is as many as fit.
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int BT_read_colour_burst(char sensor_port, int n, int interval_ms, BT_colour_sample *samples) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Take n raw RGB colour readings (as BT_read_colour_sensor_RGB()) on the brick, one every
+  // interval_ms milliseconds, and return them all in one reply. Each sample is timestamped with
+  // the brick's microsecond timer, relative to the first one.
   //
-  // Ports are identified as PORT_1, PORT_2, etc
+  // Motors keep running while the burst is taken, so starting a motion before this call and
+  // stopping it afterwards gives a dense trace of the colours swept over - without stopping for
+  // each read. The call blocks for about n * interval_ms.
   //
-  // Inputs: port identifier of gyro sensor port
+  // Inputs: port identifier of the colour sensor
+  //         number of samples in [1, BT_BURST_MAX_SAMPLES]
+  //         interval between samples in ms, in [0, 10000]
+  //         array of n samples to fill in
   //
-  // Returns: angle on success
-  //          -1 if EV3 returned an error response
+  // Returns: n on success
+  //          -1 otherwise
   //////////////////////////////////////////////////////////////////////////////////////////////////
-  void *p;
-  unsigned char reply[1024];
-  memset(&reply[0], 0, 1024);
-  unsigned char *cp;
-  int angle = 0;
-
-  unsigned char cmd_string[15] = {0x00, 0x00, 0x00, 0x00, 0x00,
-                                  0x04, 0x00, 0x00, 0x00, 0x00,
-                                  0x00, 0x00, 0x00, 0x00, 0x00};
-  //                          |length-2| | cnt_id | |type| | header |   |cmd|
-  //                          |layer|  |port| |type| |mode| |format| |# vals|
-  //                          |global var addr|
+  BT_STAT_FUNCTION();
+  BT_batch batch;
+  int at[BT_BURST_MAX_SAMPLES];
+  uint32_t first;
 
   if (sensor_port > 8) {
-    fprintf(stderr, "BT_read_gyro_sensor: Invalid port id value\n");
+    fprintf(stderr, "BT_read_colour_burst: Invalid port id value\n");
+    return (-1);
+  }
+  if (n < 1 || n > BT_BURST_MAX_SAMPLES || interval_ms < 0 || interval_ms > 10000) {
+    fprintf(stderr, "BT_read_colour_burst: Invalid sample count or interval\n");
     return (-1);
   }
 
-  cmd_string[0] = LC0(13);
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
-
-  cmd_string[7] = opINPUT_READEXT;
-  cmd_string[9] = sensor_port;
-  cmd_string[10] = LC0(0);         // don't change type
-  cmd_string[11] = LC0(-1);        // don't change mode
-  cmd_string[12] = LC0(DATA_RAW);  // format
-  cmd_string[13] = LC0(0x01);      // data set
-  cmd_string[14] = GV0(0x00);      // global var
+  BT_batch_begin(&batch);
+  batch.locals = 4;  // LV 0: timer for the next sample
+  batch.timeout_ms = BT_timeout_after(n * interval_ms);
+  BT_note_sensor_mode(sensor_port, 29, 4);
+  for (int i = 0; i < n; i++) {
+    if ((at[i] = BT_batch_alloc(&batch, 27, 16)) < 0) return (-1);
+    if (i < n - 1) {
+      batch.cmd[batch.len++] = opTIMER_WAIT;
+      BT_batch_put_const(&batch, interval_ms);
+      BT_batch_put_lv(&batch, 0);
+    }
+    batch.cmd[batch.len++] = opTIMER_READ_US;
+    BT_batch_put_gv(&batch, at[i]);
+    batch.cmd[batch.len++] = opINPUT_DEVICE;
+    batch.cmd[batch.len++] = LC0(READY_RAW);
+    batch.cmd[batch.len++] = LC0(0);  // layer
+    batch.cmd[batch.len++] = sensor_port;
+    batch.cmd[batch.len++] = LC0(29);    // type
+    batch.cmd[batch.len++] = LC0(0x04);  // mode
+    batch.cmd[batch.len++] = LC0(3);     // data set
+    BT_batch_put_gv(&batch, at[i] + 4);
+    BT_batch_put_gv(&batch, at[i] + 8);
+    BT_batch_put_gv(&batch, at[i] + 12);
+    if (i < n - 1) {
+      batch.cmd[batch.len++] = opTIMER_READY;
+      BT_batch_put_lv(&batch, 0);
+    }
+  }
 
-#ifdef __BT_debug
-  fprintf(stderr, "BT_read_gyro_sensor command string\n");
-  for (int i = 0; i < 15; i++) {
-    fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
+  if (BT_batch_commit(&batch) < 0) return (-1);
+  first = (uint32_t)BT_batch_get32(&batch, at[0]);
+  for (int i = 0; i < n; i++) {
+    samples[i].time_us = (int)((uint32_t)BT_batch_get32(&batch, at[i]) - first);
+    BT_batch_get_colour_RGB(&batch, at[i] + 4, samples[i].RGB);
   }
-  fprintf(stderr, "\n");
-#endif
+  return (n);
+}
 
-  write(*socket_id, &cmd_string[0], 15);
-  read(*socket_id, &reply[0], 1023);
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reconnecting
+//
+// When a command finds the link broken - a write or read error, or BT_RECONNECT_AFTER_TIMEOUTS
+// commands in a row without a reply - the connection is reopened with backoff by the transport
+// layer. The brick keeps running whatever it was told last, so once it is reachable again all
+// motors are stopped and the sensors are put back in the mode they were last read in before any
+// other command goes through. The command that hit the failure still returns -1 (it may or may
+// not have been executed), and the program is told through its reconnect handler so it can redo
+// its last step with the state it already has.
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void BT_set_reconnect_attempts(int attempts) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Set how many times a dropped link is reopened before giving up (the first
+  // attempt is immediate, then the delay doubles from 250 ms up to 4 s). 0
+  // turns reconnecting off.
+  //
+  // Applies to the calling thread's session and to sessions opened afterwards.
+  //
+  // Default: BT_RECONNECT_ATTEMPTS
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_session *s = BT_cur();
+  bt_reconnect_attempts = attempts > 0 ? attempts : 0;
+  if (s != NULL) s->reconnect_attempts = bt_reconnect_attempts;
+}
 
-  message_id_counter++;
+void BT_set_reconnect_handler(BT_reconnect_handler handler, void *arg) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  // Install a function called (with arg) after each successful reconnect,
+  // once the motors have been stopped and the sensor modes restored. It runs
+  // on the thread whose command hit the failure, and may issue commands.
+  // Applies to the calling thread's session and to sessions opened afterwards.
+  //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_session *s = BT_cur();
+  bt_reconnect_handler = handler;
+  bt_reconnect_arg = arg;
+  if (s != NULL) {
+    pthread_mutex_lock(&s->reconnect_lock);
+    s->reconnect_handler = handler;
+    s->reconnect_arg = arg;
+    pthread_mutex_unlock(&s->reconnect_lock);
+  }
+}
 
-  if (reply[4] == 0x02) {
-#ifdef __BT_debug
-    fprintf(stderr, "BT_read_gyro_sensor(): Command successful\n");
-    fprintf(stderr, "BT_read_gyro_sensor response string:\n");
-    for (int i = 0; i < 9; i++) {
-      fprintf(stderr, "%X, ", reply[i] & 0xff);
+static int BT_restore_sensor_modes(BT_session *s) {
+  // Read every input port once in the type and mode it was last used in, which
+  // switches the sensor back to that mode. Returns 0 on success, -1 otherwise
+  BT_batch batch;
+  int any = 0;
+
+  BT_batch_begin(&batch);
+  for (int port = 0; port < 4; port++) {
+    if (s->sensor_modes[port].type < 0) continue;
+    int offset = BT_batch_alloc(&batch, 10, 4);
+    batch.cmd[batch.len++] = opINPUT_DEVICE;
+    batch.cmd[batch.len++] = LC0(READY_RAW);
+    batch.cmd[batch.len++] = LC0(0);  // layer
+    batch.cmd[batch.len++] = port;
+    BT_batch_put_const(&batch, s->sensor_modes[port].type);
+    BT_batch_put_const(&batch, s->sensor_modes[port].mode);
+    batch.cmd[batch.len++] = LC0(1);  // data set
+    BT_batch_put_gv(&batch, offset);
+    any = 1;
+  }
+  return (any ? BT_batch_commit(&batch) : 0);
+}
+
+static int BT_reconnect(BT_session *s) {
+  // Reopen the session's link and bring the brick back to a safe, known state
+  // (the caller holds s->reconnect_lock). Returns 0 on success, -1 otherwise
+  BT_session *previous;
+  int ok;
+
+  fprintf(stderr, "BT_reconnect(): Link to the EV3 lost, reconnecting\n");
+  BT_io_stop(s);
+
+  // The write lock is held from the generation change until the transport has been reopened: a
+  // command part way through its write finishes first, and any sent meanwhile finds the new
+  // generation once it gets the lock and fails, instead of writing to a transport being closed
+  pthread_mutex_lock(&s->write_lock);
+
+  // Commands still waiting for a reply on the old connection fail now
+  pthread_mutex_lock(&s->lock);
+  s->link_generation++;
+  s->timeouts_in_row = 0;
+  for (int i = 0; i < 4; i++) s->motors[i].state = BT_MOTOR_UNKNOWN;
+  for (int i = 0; i < BT_MAX_IN_FLIGHT; i++) {
+    if (s->slots[i].busy && !s->slots[i].done) {
+      s->slots[i].done = 1;
+      s->slots[i].len = -1;
     }
-    fprintf(stderr, "\n");
-    angle |= reply[8];
-    angle <<= 8;
-    angle |= reply[7];
-    angle <<= 8;
-    angle |= reply[6];
-    angle <<= 8;
-    angle |= reply[5];
-    fprintf(stderr, "angle: %d\n", angle);
+  }
+  pthread_cond_broadcast(&s->reply_ready);
+  pthread_mutex_unlock(&s->lock);
 
-    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    // EDITED LINES SINCE ORIGINAL API BY THE LEGORIANS - BEGIN BLOCK
-    //  We noticed that the gyro only worked in debug mode. 
-    //  This was because the API originally only updated the angle value in debug mode.
-    //  Therefore, we simply added the code in the debug block that updated the angle to an else block
-    //  Now it works as intended with only one caveat:
-    //  If the robot's program ends, the gyro sensor will keep accumulating rotation regardless of how much it moves
-    //  This effect also happens when a new program is run with it.
-    //  In order to stop this effect, the gyro sensor must be unplugged and plugged back in so that the angle
-    //    reset back to 0 and stopped accumulating. Restarting the robot also fixes this issue.
-#else
-    angle |= reply[8];
-    angle <<= 8;
-    angle |= reply[7];
-    angle <<= 8;
-    angle |= reply[6];
-    angle <<= 8;
-    angle |= reply[5];
-    //END BLOCK
-    /////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#endif
-  } else {
-    fprintf(stderr, "BT_read_gyro_sensor: Command failed\n");
+  ok = BT_transport_reconnect(&s->transport, s->reconnect_attempts) == 0;
+  pthread_mutex_unlock(&s->write_lock);
+  if (!ok) {
+    fprintf(stderr, "BT_reconnect(): Unable to reach the EV3, giving up\n");
     return (-1);
   }
+  if (BT_io_start(s) < 0) return (-1);
+
+  // Failures from here on are reported, not reconnected
+  previous = BT_session_use(s);
+  s->restoring_owner = pthread_self();
+  __atomic_store_n(&s->restoring, 1, __ATOMIC_RELEASE);
+  ok = BT_all_stop(1) == 0 && BT_restore_sensor_modes(s) == 0;
+  __atomic_store_n(&s->restoring, 0, __ATOMIC_RELEASE);
+  BT_session_use(previous);
+  if (!ok) {
+    fprintf(stderr, "BT_reconnect(): Reconnected, but the EV3 did not accept the safe stop\n");
+    return (-1);
+  }
+  fprintf(stderr, "BT_reconnect(): Reconnected, motors stopped and sensor modes restored\n");
+  return (0);
+}
 
-  return (angle);
+static void BT_link_failed(BT_session *s, int generation) {
+  // Called by a command that found the session's link broken while it was
+  // using link 'generation'. The first such call reconnects; calls about a
+  // generation that has already been replaced (other threads that saw the
+  // same failure) just wait for that to finish.
+  BT_reconnect_handler handler;
+  void *arg;
+  int ok;
+
+  if (s->reconnect_attempts == 0) return;
+  if (__atomic_load_n(&s->restoring, __ATOMIC_ACQUIRE) && pthread_equal(s->restoring_owner, pthread_self()))
+    return;
+
+  pthread_mutex_lock(&s->reconnect_lock);
+  if (generation != s->link_generation) {
+    pthread_mutex_unlock(&s->reconnect_lock);
+    return;
+  }
+  ok = BT_reconnect(s) == 0;
+  handler = s->reconnect_handler;
+  arg = s->reconnect_arg;
+  pthread_mutex_unlock(&s->reconnect_lock);
+
+  if (ok && handler != NULL) handler(arg);
 }
 
 int BT_play_sound_file(const char *path, int volume) {
@@ -1348,11 +3419,9 @@ int BT_play_sound_file(const char *path, int volume) {
   // Returns: success code on successfull execution
   //          error code on error
   //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
 
-  void *p;
   char reply[1024];
-  memset(&reply[0], 0, 1024);
-  unsigned char *cp;
   int msg_length = 0;
   int path_len = 0;
   path_len = strnlen(path, 1011);
@@ -1361,12 +3430,6 @@ int BT_play_sound_file(const char *path, int volume) {
 
   cmd_string[0] = LX_byte1(12 + path_len + 1 - 2);  // length-2
   cmd_string[1] = LX_byte2(12 + path_len + 1 - 2);  // length-2
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
-
   cmd_string[4] = 0;  // command type - with reply
   cmd_string[5] = 0;  // global and local memory
   cmd_string[6] = 0;
@@ -1387,9 +3450,7 @@ int BT_play_sound_file(const char *path, int volume) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 12 + path_len + 1);
-  read(*socket_id, &reply[0], 1023);
-  message_id_counter++;
+  BT_exchange(&cmd_string[0], 12 + path_len + 1, &reply[0]);
 
   if (reply[4] == 0x02) {
     fprintf(stderr, "BT_play_sound_file(): Command successful\n");
@@ -1428,12 +3489,10 @@ int BT_list_files(char *path, char **msg_reply) {
   // Returns: success code on successfull execution
   //          error code on error
   //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
 
-  void *p;
   int i;
   char reply[1024];
-  memset(reply, 0, 1024);
-  unsigned char *cp;
   unsigned int msg_length = 0;
   int path_len = 0;
   path_len = strnlen(path, 1011);
@@ -1442,12 +3501,6 @@ int BT_list_files(char *path, char **msg_reply) {
 
   cmd_string[0] = LX_byte1(8 + path_len - 2 + 1);  // length-2
   cmd_string[1] = LX_byte2(8 + path_len - 2 + 1);  // length-2
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
-
   cmd_string[4] = SYSTEM_COMMAND_REPLY;  // type
   cmd_string[5] = LIST_FILES;            // system_cmd
   cmd_string[6] = LX_byte1(1012);        // max bytes to read
@@ -1465,10 +3518,8 @@ int BT_list_files(char *path, char **msg_reply) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 8 + path_len + 1);
-  read(*socket_id, &reply, 1023);
+  BT_exchange(&cmd_string[0], 8 + path_len + 1, &reply[0]);
 
-  message_id_counter++;
 
   if (reply[4] == SYSTEM_REPLY) {
     msg_length |= (unsigned char)reply[1];
@@ -1483,14 +3534,18 @@ int BT_list_files(char *path, char **msg_reply) {
     }
     fprintf(stderr, "\n");
 #endif
-    *msg_reply = (char *)calloc(msg_length - 11, sizeof(char));
+    // The listing is reply[12] .. reply[msg_length - 1], not NUL terminated in the frame
+    if (msg_length < 12) msg_length = 12;
+    if (msg_length > 1024) msg_length = 1024;
+    *msg_reply = (char *)calloc(msg_length - 10, sizeof(char));
     if (*msg_reply == NULL) {
       perror("calloc");
       return (-1);
     }
 
     if (reply[6] == SUCCESS || reply[6] == END_OF_FILE) {
-      strncpy(*msg_reply, &reply[12], msg_length - 11);
+      memcpy(*msg_reply, &reply[12], msg_length - 12);
+      (*msg_reply)[msg_length - 12] = 0;
     } else {
       return reply[6];
     }
@@ -1518,29 +3573,29 @@ int BT_upload_file(char const *dest, char const *src) {
   //         visible in the EV3 display. The path will be truncated at 1011
   //         bytes, not including the null-byte.
   //
+  // The file is mapped into memory and sent in PARTITION_SIZE chunks, with up
+  // to BT_UPLOAD_IN_FLIGHT chunks on their way at once. The brick handles them
+  // in order, and each reply is matched to its chunk, so the upload costs about
+  // one round trip per BT_UPLOAD_IN_FLIGHT chunks instead of one per chunk. The
+  // throughput achieved is reported on stderr.
   //
   // Returns: success code on successfull execution
   //          error code on error
   //////////////////////////////////////////////////////////////////////////////////////////////////
-
-  FILE *fp;
-  void *p;
-  char buffer[PARTITION_SIZE];
-  int i, size, remainder, n;
-  char reply[1024];
-  memset(&reply[0], 0, 1024);
-  unsigned char *cp;
+  BT_STAT_FUNCTION();
   const char *p1 = "/home/root/lms2012/apps";
   const char *p2 = "/home/root/lms2012/prjs";
   const char *p3 = "/home/root/lms2012/tools";
-
+  int tickets[BT_UPLOAD_IN_FLIGHT];
+  int i, fd, size, sent = 0, chunk, head = 0, tail = 0, status = SUCCESS;
   int path_len = 0;
   unsigned int msg_length = 0;
   int handle;
-
+  const unsigned char *data = NULL;
+  char reply[1024];
   unsigned char cmd_string[1024];
-  memset(&cmd_string[0], 0, 1024);
   struct stat st;
+  double start;
 
   if ((dest[0] == '/') && (strncmp(p1, dest, strlen(p1)) != 0) &&
       (strncmp(p2, dest, strlen(p2)) != 0) &&
@@ -1552,19 +3607,25 @@ int BT_upload_file(char const *dest, char const *src) {
     return (-1);
   }
 
-  path_len = strnlen(dest, 1011);
-
-  stat(src, &st);
+  if ((fd = open(src, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    perror(src);
+    if (fd >= 0) close(fd);
+    return (-1);
+  }
   size = st.st_size;
+  if (size > 0 &&
+      (data = (const unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+          MAP_FAILED) {
+    perror(src);
+    close(fd);
+    return (-1);
+  }
+  close(fd);
 
+  path_len = strnlen(dest, 1011);
+  memset(&cmd_string[0], 0, 1024);
   cmd_string[0] = LX_byte1(10 + path_len - 2 + 1);  // length-2
   cmd_string[1] = LX_byte2(10 + path_len - 2 + 1);  // length-2
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
-
   cmd_string[4] = SYSTEM_COMMAND_REPLY;  // type
   cmd_string[5] = BEGIN_DOWNLOAD;        // system_cmd
   cmd_string[6] = LX_byte1(size);        // file size
@@ -1584,11 +3645,9 @@ int BT_upload_file(char const *dest, char const *src) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0],
-        10 + path_len + 1);  // this will return a handle to the file
-  read(*socket_id, &reply[0], 1023);
-
-  message_id_counter++;
+  start = BT_clock();
+  BT_exchange(&cmd_string[0], 10 + path_len + 1,
+              &reply[0]);  // this will return a handle to the file
 
   if (reply[4] == SYSTEM_REPLY) {
     msg_length = (unsigned char)reply[1];
@@ -1602,91 +3661,58 @@ int BT_upload_file(char const *dest, char const *src) {
     }
     fprintf(stderr, "\n");
 #endif
-    if (reply[6] == SUCCESS) {
-      fprintf(stderr, "BT_upload_file(): Command successful\n");
-      handle = reply[8];
-    } else {
+    if (reply[6] != SUCCESS) {
+      if (data != NULL) munmap((void *)data, size);
       return reply[6];
     }
-    fprintf(stderr, "\n");
+    fprintf(stderr, "BT_upload_file(): Command successful\n");
+    handle = (unsigned char)reply[7];  // |status| |handle| follow the system command
   } else {
     fprintf(stderr, "BT_upload_file: Command failed\n");
+    if (data != NULL) munmap((void *)data, size);
     return (reply[4]);
   }
 
-  if ((fp = fopen(src, "rb")) == NULL) {
-    perror(src);
-    return (-1);
-  }
-
-  remainder = size > PARTITION_SIZE ? PARTITION_SIZE : size;
-  while (remainder > 0) {
-    memset(&cmd_string[0], 0, 1024);
-
-    n = fread(buffer, 1, remainder, fp);
-    cmd_string[0] = LX_byte1(7 + remainder - 2);  // length-2
-    cmd_string[1] = LX_byte2(7 + remainder - 2);  // length-2
-    // Set message count id
-    p = (void *)&message_id_counter;
-    cp = (unsigned char *)p;
-    cmd_string[2] = *cp;
-    cmd_string[3] = *(cp + 1);
-
-    cmd_string[4] = SYSTEM_COMMAND_REPLY;  // type
-    cmd_string[5] = CONTINUE_DOWNLOAD;     // system_cmd
-    cmd_string[6] = LX_byte1(handle);      // handle
-    for (i = 0; i < remainder; i++) {
-      cmd_string[i + 7] = buffer[i];
-    }
-
-#ifdef __BT_debug
-    fprintf(stderr, "BT_upload_file command string\n");
-    for (i = 0; i < 7 + remainder; i++) {
-      fprintf(stderr, "%X, ", cmd_string[i] & 0xff);
+  // Keep up to BT_UPLOAD_IN_FLIGHT chunks on their way, tickets[] is a ring
+  // of the ones waiting for their reply (head: oldest, tail: next free)
+  cmd_string[4] = SYSTEM_COMMAND_REPLY;  // type
+  cmd_string[5] = CONTINUE_DOWNLOAD;     // system_cmd
+  cmd_string[6] = LX_byte1(handle);      // handle
+  while (sent < size || head != tail) {
+    if (sent < size && status == SUCCESS && tail - head < BT_UPLOAD_IN_FLIGHT) {
+      chunk = size - sent > PARTITION_SIZE ? PARTITION_SIZE : size - sent;
+      cmd_string[0] = LX_byte1(7 + chunk - 2);  // length-2
+      cmd_string[1] = LX_byte2(7 + chunk - 2);  // length-2
+      memcpy(&cmd_string[7], data + sent, chunk);
+      if ((tickets[tail % BT_UPLOAD_IN_FLIGHT] = BT_submit(&cmd_string[0], 7 + chunk)) < 0) {
+        status = -1;
+        continue;
+      }
+      tail++;
+      sent += chunk;
+      continue;
     }
-    fprintf(stderr, "\n");
-#endif
-
-    write(*socket_id, &cmd_string[0], 7 + remainder);
-    read(*socket_id, &reply[0], 1023);
+    if (head == tail) break;  // an error stopped the upload, and every reply is in
 
-    message_id_counter++;
-
-    if (reply[4] == SYSTEM_REPLY) {
-      msg_length = (unsigned char)reply[1];
-      msg_length <<= 8;
-      msg_length |= (unsigned char)reply[0];
-      msg_length += 2;
-#ifdef __BT_debug
-      fprintf(stderr, "BT_upload_file response string:\n");
-      for (int i = 0; i < msg_length; i++) {
-        fprintf(stderr, "%X, ", reply[i] & 0xff);
-      }
-      fprintf(stderr, "\n");
-#endif
-      if (reply[6] == SUCCESS) {
-#ifdef __BT_debug
-        fprintf(stderr, "BT_upload_file(): Command successful\n");
-#endif
-      } else if (reply[6] == END_OF_FILE) {
-#ifdef __BT_debug
-        fprintf(stderr, "BT_upload_file(): Command completed\n");
-#endif
-      } else {
-        return reply[6];
-      }
-      fprintf(stderr, "\n");
-    } else {
+    BT_complete(tickets[head++ % BT_UPLOAD_IN_FLIGHT], &reply[0], 1024);
+    if (status != SUCCESS && status != END_OF_FILE) continue;  // first error is reported
+    if (reply[4] != SYSTEM_REPLY) {
 #ifdef __BT_debug
       fprintf(stderr, "BT_upload_file: Command failed\n");
 #endif
-      return (reply[4]);
+      status = reply[4] ? reply[4] : -1;
+    } else {
+      status = reply[6];  // SUCCESS, END_OF_FILE after the last chunk, or an error
     }
-    size -= n;
-    remainder = size > PARTITION_SIZE ? PARTITION_SIZE : size;
   }
-  fclose(fp);
-  return (reply[6]);
+  if (data != NULL) munmap((void *)data, size);
+
+  if (status == SUCCESS || status == END_OF_FILE) {
+    double t = BT_clock() - start;
+    fprintf(stderr, "BT_upload_file(): %d bytes in %.3f s (%.1f KB/s)\n", size, t,
+            t > 0 ? size / t / 1024.0 : 0.0);
+  }
+  return (status);
 }
 
 int BT_set_LED_colour(int colour) {
@@ -1702,16 +3728,14 @@ int BT_set_LED_colour(int colour) {
   // Returns: success code on successfull execution
   //          error code on error
   //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
 
   unsigned char cmd_string[10] = {0x00, 0x00, 0x00, 0x00, 0x00,
                                   0x00, 0x00, 0x00, 0x00, 0x00};
   //                          |length-2| | cnt_id | |type| | header |   |cmd|
   //                          |ui cmd | |colour|
 
-  void *p;
-  unsigned char *cp;
   char reply[1024];
-  memset(&reply[0], 0, 1024);
 
   if (colour != LED_BLACK && colour != LED_GREEN && colour != LED_RED &&
       colour != LED_ORANGE && colour != LED_GREEN_FLASH &&
@@ -1721,11 +3745,7 @@ int BT_set_LED_colour(int colour) {
     return (-1);
   }
 
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
   cmd_string[0] = LC0(8);
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
   cmd_string[7] = opUI_WRITE;
   cmd_string[8] = LED;
   cmd_string[9] = colour;
@@ -1738,10 +3758,8 @@ int BT_set_LED_colour(int colour) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 10);
-  read(*socket_id, &reply[0], 1023);
+  BT_exchange(&cmd_string[0], 10, &reply[0]);
 
-  message_id_counter++;
 
 #ifdef __BT_debug
   fprintf(stderr, "BT_set_LED_colour(): response string\n");
@@ -1777,12 +3795,10 @@ int BT_draw_image_from_file(int colour, int x_0, int y_0,
   // Returns: success code on successfull execution
   //          error code on error
   //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
 
-  void *p;
-  unsigned char *cp;
   int i;
   char reply[1024];
-  memset(&reply[0], 0, 1024);
 
   int msg_length = 0;
   int path_len = 0;
@@ -1808,10 +3824,6 @@ int BT_draw_image_from_file(int colour, int x_0, int y_0,
   cmd_string[0] = LX_byte1(20 + path_len - 2 + 1);  // length-2
   cmd_string[1] = LX_byte2(20 + path_len - 2 + 1);  // length-2
 
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
   cmd_string[7] = opUI_DRAW;
   cmd_string[8] = BMPFILE;
   cmd_string[9] = LC1_byte0();  // colour
@@ -1838,10 +3850,8 @@ int BT_draw_image_from_file(int colour, int x_0, int y_0,
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 20 + path_len + 1);
-  read(*socket_id, &reply[0], 1023);
+  BT_exchange(&cmd_string[0], 20 + path_len + 1, &reply[0]);
 
-  message_id_counter++;
 
 #ifdef __BT_debug
   fprintf(stderr, "BT_draw_image_from_file(): response string\n");
@@ -1873,22 +3883,16 @@ int BT_store_current_display(int no) {
   // Returns: success code on successfull execution
   //          error code on error
   //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
 
   unsigned char cmd_string[10] = {0x00, 0x00, 0x00, 0x00, 0x00,
                                   0x00, 0x00, 0x00, 0x00, 0x00};
   //                          |length-2| | cnt_id | |type| | header |   |cmd|
   //                          |ui cmd |    |no|
 
-  void *p;
-  unsigned char *cp;
   char reply[1024];
-  memset(&reply[0], 0, 1024);
 
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
   cmd_string[0] = LC0(8);
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
   cmd_string[7] = opUI_DRAW;
   cmd_string[8] = STORE;
   cmd_string[9] = no;
@@ -1901,10 +3905,8 @@ int BT_store_current_display(int no) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 10);
-  read(*socket_id, &reply[0], 1023);
+  BT_exchange(&cmd_string[0], 10, &reply[0]);
 
-  message_id_counter++;
 
 #ifdef __BT_debug
   fprintf(stderr, "BT_set_current_display(): response string\n");
@@ -1937,22 +3939,16 @@ int BT_restore_previous_display(int no) {
   // Returns: success code on successfull execution
   //          error code on error
   //////////////////////////////////////////////////////////////////////////////////////////////////
+  BT_STAT_FUNCTION();
 
   unsigned char cmd_string[12] = {0x00, 0x00, 0x00, 0x00, 0x00,
                                   0x00, 0x00, 0x00, 0x00, 0x00};
   //                          |length-2| | cnt_id | |type| | header |   |cmd|
   //                          |ui cmd |    |no|
 
-  void *p;
-  unsigned char *cp;
   char reply[1024];
-  memset(&reply[0], 0, 1024);
 
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
   cmd_string[0] = LC0(10);
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
   cmd_string[7] = opUI_DRAW;
   cmd_string[8] = RESTORE;
   cmd_string[9] = no;
@@ -1968,10 +3964,8 @@ int BT_restore_previous_display(int no) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 12);
-  read(*socket_id, &reply[0], 1023);
+  BT_exchange(&cmd_string[0], 12, &reply[0]);
 
-  message_id_counter++;
 
 #ifdef __BT_debug
   fprintf(stderr, "BT_restore_previous_display(): response string\n");
@@ -52,27 +52,37 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include "stdio.h"
 
 // Bluetooth libraries - make sure they are installed in your machine
+// (not needed when compiling with -DBT_NO_BLUETOOTH, see bttransport.h)
+#ifndef BT_NO_BLUETOOTH
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 #include <bluetooth/rfcomm.h>
+#endif
+
+#include "bttransport.h"  // RFCOMM / TCP / Unix socket / loopback transports
 
 #include "bytecodes.h"  // <-- This is provided by Lego, from the EV3 development kit,
 #include "c_com.h"  //     and is distributed under GPL. Please see the license
                     //     file included with this distribution for details.
 
-extern int message_id_counter;  // <-- Global message id counter
-
 // Hex identifiers for the 4 motor ports (defined by Lego)
 #define MOTOR_A 0x01
 #define MOTOR_B 0x02
@@ -89,6 +99,7 @@ extern int message_id_counter;  // <-- Global message id counter
 #define EV3_INFRARED 33
 #define EV3_GYRO 32
 #define PARTITION_SIZE 1017
+#define BT_UPLOAD_IN_FLIGHT 8  // file upload chunks on their way at once (<= BT_MAX_IN_FLIGHT)
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Command string encoding://   Prefix format:  |0x00:0x00|   |0x00:0x00| |0x00|
@@ -140,18 +151,98 @@ extern int message_id_counter;  // <-- Global message id counter
 //
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-// Set up a socket to communicate with your Lego EV3 kit
+// Set up a socket to communicate with your Lego EV3 kit. device_id is the
+// EV3's hex ID, or one of the other device strings listed in bttransport.h
+// (e.g. "tcp:localhost:5555") to talk to a stand-in brick instead
 int BT_open(const char *device_id);
 
 // Close open socket to your EV3 ending the communication with the bot
 int BT_close();
 
+// Sessions
+// Each connection to an EV3 is a session, holding its own message id counter,
+// commands in flight, settings, and an I/O thread that reads its replies.
+// BT_open() opens the default session. Every other BT_* call acts on the
+// calling thread's session: the default one, unless the thread has picked
+// another with BT_session_use(). Any number of threads may issue commands on
+// the same session at once, and one program can drive several EV3s by
+// opening a session to each, e.g.
+//
+//   BT_session *second = BT_session_open("00:16:53:56:56:04");
+//   BT_session_use(second);          // this thread now talks to the second EV3
+//   BT_drive(MOTOR_A, MOTOR_D, 30);
+//
+// The trace file (BT_trace_open()) is shared by all sessions.
+typedef struct BT_session BT_session;
+BT_session *BT_session_open(const char *device_id);
+void BT_session_close(BT_session *s);
+BT_session *BT_session_use(BT_session *s);  // NULL -> default session, returns previous
+BT_session *BT_session_current(void);
+
+// Pipelined command section
+// Commands sent with BT_submit() do not wait for their reply - the returned
+// ticket (made from the command's message id) is later passed to BT_complete(),
+// which waits for the reply with that id. Up to BT_MAX_IN_FLIGHT commands requesting
+// a reply can be outstanding per session, and a ticket must be completed by a
+// thread using the same session. Replies are matched by the session's I/O
+// thread as they arrive (BT_pipeline_start() and BT_pipeline_stop() are kept
+// for older programs and do nothing). The blocking BT_* calls below can be
+// mixed freely with these.
+//
+// Every command must have its reply in within a timeout (BT_set_timeout(),
+// or per command with BT_submit_timeout()), otherwise BT_complete() and the
+// blocking calls return -1 after that long instead of waiting forever. Late
+// replies are recognized by their message id and dropped.
+#define BT_MAX_IN_FLIGHT 16
+#define BT_DEFAULT_TIMEOUT_MS 2000
+int BT_pipeline_start(void);
+void BT_pipeline_stop(void);
+void BT_set_timeout(int timeout_ms);  // 0 -> no timeout
+int BT_submit(void *cmd_string, int len);
+int BT_submit_timeout(void *cmd_string, int len, int timeout_ms);
+int BT_complete(int ticket, void *reply, int max_len);
+
+// Reconnecting
+// If the link drops (or BT_RECONNECT_AFTER_TIMEOUTS commands in a row get no
+// reply), the next command to notice reopens it, retrying with backoff up to
+// BT_set_reconnect_attempts() times. Once reconnected, all motors are stopped
+// and the sensors put back in the modes they were last read in, then the
+// handler set with BT_set_reconnect_handler() is called. The command that hit
+// the failure still returns an error.
+#define BT_RECONNECT_ATTEMPTS 8
+#define BT_RECONNECT_AFTER_TIMEOUTS 3
+typedef void (*BT_reconnect_handler)(void *arg);
+void BT_set_reconnect_attempts(int attempts);  // 0 -> never reconnect
+void BT_set_reconnect_handler(BT_reconnect_handler handler, void *arg);
+
+// Record/replay
+// BT_trace_open() records all commands and replies, with their timing, to a
+// trace file (also enabled by setting EV3_TRACE=file before BT_open()). Open
+// "replay:file" instead of the EV3's hex ID to play the recorded replies back.
+int BT_trace_open(const char *path);
+void BT_trace_close(void);
+
+// Call statistics
+// Every command is counted by opcode, by the BT_* call that sent it and by
+// the caller tag set with BT_stats_tag(), with p50/p95/p99 reply latencies
+// and the time spent waiting. The table is printed to stderr at exit (or to
+// the file named by EV3_STATS) and whenever the process gets SIGUSR1.
+void BT_stats_dump(FILE *f);
+void BT_stats_reset(void);
+const char *BT_stats_tag(const char *tag);  // returns the previous tag
+
 // Change your Bot's name - the length should be up to 12 characters
 int BT_setEV3name(const char *name);
 
 // Play a sequence of musical notes of specified frequencies, durations, and
 // volume
 int BT_play_tone_sequence(const int tone_data[50][3]);
+// Same, queued and played by a background thread, so the call and the
+// commands sent after it do not wait for the notes. BT_audio_wait() waits
+// until the queue has been played out.
+#define BT_AUDIO_QUEUE 64  // tones that can wait in a session's audio queue
+int BT_play_tone_sequence_async(const int tone_data[50][3]);
+void BT_audio_wait(void);
 
 // Motor control section
 int BT_motor_port_start(char port_ids,
@@ -164,6 +255,32 @@ int BT_drive(char lport, char rport,
 int BT_turn(char lport, char lpower, char rport,
             char rpower);  // Individual control for two wheels for turning
 
+// No-reply motor control
+// Same as the calls above, but sent as direct commands without reply (type
+// 0x80), so they return as soon as the command is written instead of waiting a
+// full round trip. The brick still executes commands in the order they are
+// sent. Since a failed no-reply command is silent, every n-th one can be sent
+// with a reply requested and checked - see BT_set_noreply_sync_interval().
+int BT_motor_port_start_noreply(char port_ids, char power);
+int BT_motor_port_stop_noreply(char port_ids, int brake_mode);
+int BT_all_stop_noreply(int brake_mode);
+int BT_drive_noreply(char lport, char rport, char power);
+int BT_turn_noreply(char lport, char lpower, char rport, char rpower);
+void BT_set_noreply_sync_interval(int n);
+
+// Actuator coalescing
+// The session remembers what the calls above last told each motor, and drops
+// a call that would not change it (e.g. stopping motors that are already
+// stopped with the same brake mode). Calls between BT_actuator_begin() and
+// BT_actuator_flush() are gathered and sent as one packet when flushed, so
+// both wheels of a turn start together and cost a single write. Inside such a
+// control tick the calls return 0, errors are reported by the flush.
+// Programs that drive the motors with their own BT_submit() commands should
+// call BT_actuator_forget() afterwards.
+void BT_actuator_begin(void);
+int BT_actuator_flush(void);
+void BT_actuator_forget(void);
+
 // Timed functions will allow you to build carefully programmed motions. The
 // motor is set to the specified power for the specified time, and then stopped.
 // The more general version allows for smooth speed control by providing you
@@ -173,6 +290,16 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time,
                               int run_time, int ramp_down_time);
 int BT_timed_motor_port_start_v2(char port_id, char power, int time);
 
+// Tacho counts and synchronized moves
+// The EV3 counts the degrees each motor has turned. The sync calls run the
+// two wheels together for a given rotation or time and brake at the end, so
+// a turn or a short push is a single command (see BT_step_sync() for the
+// turn ratio).
+int BT_motor_get_count(char port_id, int *count);
+int BT_motor_clear_count(char port_ids);
+int BT_step_sync(char lport, char rport, char power, int turn, int degrees, int wait);
+int BT_time_sync(char lport, char rport, char power, int turn, int time, int wait);
+
 // Sensor operation section
 // If no sensor is plugged into the sensor_port the readings will be 0 for that
 // sensor. If the wrong sensor is plugged into the port then there will be
@@ -194,9 +321,80 @@ void BT_sensor_set_mode(char sensor_port, char mode);
 int BT_check_if_busy(char sensor_port);
 int BT_play_sound_file(const char *path, int volume);
 
+// Sensor modes
+// The session remembers the type and mode each port was last read in. A read
+// in another mode (e.g. the colour index right after an RGB read) makes the
+// sensor switch and settle before it answers, so reading one port in a single
+// mode is faster. BT_sensor_mode_switches() counts the reads that switched.
+int BT_sensor_get_mode(char sensor_port, int *type, int *mode);  // -1 if never read
+int BT_sensor_mode_switches(void);
+
+// Pipelined sensor reads
+// The _submit() half sends the request and returns a ticket immediately, the
+// _complete() half waits for the matching reply and returns the same values
+// as the blocking call. Several requests can be in flight at once, so a
+// polling loop can have its next sample on the way while it processes the
+// current one.
+int BT_read_touch_sensor_submit(char sensor_port);
+int BT_read_touch_sensor_complete(int ticket);
+int BT_read_colour_sensor_RGB_submit(char sensor_port);
+int BT_read_colour_sensor_RGB_complete(int ticket, int RGB[3]);
+int BT_read_gyro_sensor_submit(char sensor_port);
+int BT_read_gyro_sensor_complete(int ticket);
+
+// Batched sensor reads
+// Several reads packed into one direct command, each result at its own offset
+// in the global variable area, so the whole batch costs one round trip. Each
+// BT_batch_add_*() returns the offset to pass to the matching BT_batch_get_*()
+// once the batch has been committed (or submitted and completed).
+#define BT_BATCH_MAX_GLOBALS 1019
+typedef struct {
+  unsigned char cmd[1024];    // command being assembled
+  int len;                    // bytes of cmd[] used so far
+  int globals;                // bytes of global variable area reserved so far
+  int locals;                 // bytes of local variable area used (brick-side loops)
+  int timeout_ms;             // reply timeout, BT_set_timeout()'s by default (0 = none)
+  unsigned char reply[1024];  // reply to the committed batch
+  int reply_len;              // 0 until a valid reply has been received
+} BT_batch;
+void BT_batch_begin(BT_batch *batch);
+int BT_batch_add_colour_RGB(BT_batch *batch, char sensor_port);
+int BT_batch_add_gyro(BT_batch *batch, char sensor_port);
+int BT_batch_add_touch(BT_batch *batch, char sensor_port);
+int BT_batch_add_wait(BT_batch *batch, int ms);  // spaces out the reads around it
+int BT_batch_commit(BT_batch *batch);
+int BT_batch_submit(BT_batch *batch);
+int BT_batch_complete(BT_batch *batch, int ticket);
+int BT_batch_get_colour_RGB(BT_batch *batch, int offset, int RGB[3]);
+int BT_batch_get_gyro(BT_batch *batch, int offset);
+int BT_batch_get_touch(BT_batch *batch, int offset);
+
+// Brick-side loops
+// Direct commands that loop on the EV3 until a sensor condition holds and
+// act on it there, replying once when done - the reaction time no longer
+// depends on the Bluetooth round trip. They block until the loop ends.
+int BT_drive_until_colour_change(char lport, char rport, char power, char sensor_port,
+                                 const int RGB_min[3], const int RGB_max[3], int timeout_ms,
+                                 int RGB[3]);
+#define BT_TOUCH_POLL_MS 5  // spacing of BT_motor_until_touch()'s touch reads
+int BT_motor_until_touch(char port, char power, char touch_port, int debounce, int timeout_ms,
+                         int *elapsed_ms);
+
+// Burst sampling
+// Up to BT_BURST_MAX_SAMPLES colour readings taken on the EV3 at a fixed
+// interval and returned together in one reply, with brick timestamps.
+#define BT_BURST_MAX_SAMPLES 32
+typedef struct {
+  int time_us;  // microseconds since the first sample of the burst
+  int RGB[3];   // raw readings, as BT_read_colour_sensor_RGB()
+} BT_colour_sample;
+int BT_read_colour_burst(char sensor_port, int n, int interval_ms, BT_colour_sample *samples);
+
 // System command section
 // Used for uploading files to the EV3 such as image and sound files in proper
 // format. EV3 accepts .rgf image files and .rsf sound files.
+// BT_upload_file() sends the file in pipelined chunks and reports the
+// throughput it achieved on stderr.
 int BT_list_files(char *path, char **contents);
 int BT_upload_file(const char *path_dest, const char *path_src);
 
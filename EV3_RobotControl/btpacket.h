@@ -0,0 +1,139 @@
+/* EV3 API
+ *  Copyright (C) 2018-2019 Francisco Estrada and Lioudmila Tishkina
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/***********************************************************************************************************************
+ *
+ * 	Compile-time command templates - used by btcomm.c for the commands sent
+ * most often (motor control, sensor reads and queued tones).
+ *
+ * 	A command is declared once as a type listing its bytes after the 7-byte
+ * prefix. Fixed bytes are BT_B<value>, and bytes taken from the call's
+ * arguments are BT_P<i> (the i-th argument), or BT_P<i, k> for byte k of a
+ * multi-byte value. For instance, "set power and start" (declared at the end
+ * of this file with the other btcomm.c commands) is
+ *
+ * 	typedef BT_packet<0, 0, BT_B<opOUTPUT_POWER>, BT_B<LC0(0)>, BT_P<0>,
+ * 	                  BT_B<LC1_byte0()>, BT_P<1>,
+ * 	                  BT_B<opOUTPUT_START>, BT_B<LC0(0)>, BT_P<0>> BT_power_start_packet;
+ *
+ * 	and the length field, type byte, variable sizes and every fixed byte are
+ * worked out by the compiler. At run time,
+ *
+ * 	unsigned char cmd[BT_power_start_packet::len];
+ * 	BT_power_start_packet::encode(cmd, ports, power);
+ *
+ * 	copies the template and stores the arguments at offsets known at compile
+ * time, nothing else. The message id is stamped by BT_submit() as usual.
+ *
+ * 	This needs C++17 (the default of current g++).
+ * ********************************************************************************************************************/
+
+#ifndef __btpacket_header
+#define __btpacket_header
+
+#include <string.h>
+
+#include "bytecodes.h"
+#include "c_com.h"
+
+// A fixed byte of a command template
+template <int V>
+struct BT_B {
+  static constexpr int arg = -1;
+  static constexpr int shift = 0;
+  static constexpr unsigned char value = V & 0xFF;
+};
+
+// A byte filled in from argument I of encode() (byte K of it, little endian)
+template <int I, int K = 0>
+struct BT_P {
+  static constexpr int arg = I;
+  static constexpr int shift = 8 * K;
+  static constexpr unsigned char value = 0;
+};
+
+// A direct command (reply requested) with the given global/local variable
+// sizes and the listed bytes after the prefix
+template <int Globals, int Locals, class... Fields>
+struct BT_packet {
+  static constexpr int len = 7 + sizeof...(Fields);
+  static constexpr int globals = Globals;
+  static_assert(len <= 1024, "EV3 commands are at most 1024 bytes");
+  static_assert(Globals <= 1019 && Locals <= 63, "Variable area too large");
+
+  static constexpr unsigned char bytes[len] = {
+      (len - 2) & 0xFF, ((len - 2) >> 8) & 0xFF, 0x00, 0x00, DIRECT_COMMAND_REPLY,
+      Globals & 0xFF, ((Globals >> 8) & 0x03) | (Locals << 2), Fields::value...};
+
+  template <class... Args>
+  static int encode(unsigned char *cmd, Args... args) {
+    // Copy the template and store the arguments. Every BT_P expands to one store
+    // at a constant offset, every BT_B to nothing. Returns the command length.
+    const int values[sizeof...(Args) + 1] = {(int)args..., 0};
+    int at = 7;
+
+    memcpy(cmd, bytes, len);
+    ((Fields::arg >= 0
+          ? (void)(cmd[at] = (values[Fields::arg < 0 ? 0 : Fields::arg] >> Fields::shift) & 0xFF)
+          : (void)0,
+      at++),
+     ...);
+    return (len);
+  }
+};
+
+// Templates of the commands built by btcomm.c. Arguments are listed after each one.
+
+// |set power| |layer| |ports| |power| |start| |layer| |ports|         (ports, power)
+typedef BT_packet<0, 0, BT_B<opOUTPUT_POWER>, BT_B<LC0(0)>, BT_P<0>, BT_B<LC1_byte0()>, BT_P<1>,
+                  BT_B<opOUTPUT_START>, BT_B<LC0(0)>, BT_P<0>>
+    BT_power_start_packet;
+// |stop| |layer| |ports| |brake|                                          (ports, brake)
+typedef BT_packet<0, 0, BT_B<opOUTPUT_STOP>, BT_B<LC0(0)>, BT_P<0>, BT_P<1>> BT_stop_packet;
+// |set power| |layer| |lport| |power| |set power| |layer| |rport| |power| |start| |layer| |ports|
+//                                                   (lport, lpower, rport, rpower, ports)
+typedef BT_packet<0, 0, BT_B<opOUTPUT_POWER>, BT_B<LC0(0)>, BT_P<0>, BT_B<LC1_byte0()>, BT_P<1>,
+                  BT_B<opOUTPUT_POWER>, BT_B<LC0(0)>, BT_P<2>, BT_B<LC1_byte0()>, BT_P<3>,
+                  BT_B<opOUTPUT_START>, BT_B<LC0(0)>, BT_P<4>>
+    BT_turn_packet;
+// |input device| |ready pct| |layer| |port| |type| |mode| |data set| |global var|     (port)
+typedef BT_packet<1, 0, BT_B<opINPUT_DEVICE>, BT_B<LC0(READY_PCT)>, BT_B<LC0(0)>, BT_P<0>,
+                  BT_B<LC0(0x10)>, BT_B<LC0(0)>, BT_B<LC0(1)>, BT_B<GV0(0)>>
+    BT_touch_packet;
+// |input device| |ready raw| |layer| |port| |type| |mode| |data set| |global var|     (port)
+typedef BT_packet<1, 0, BT_B<opINPUT_DEVICE>, BT_B<LC0(READY_RAW)>, BT_B<LC0(0)>, BT_P<0>,
+                  BT_B<LC0(29)>, BT_B<LC0(2)>, BT_B<LC0(1)>, BT_B<GV0(0)>>
+    BT_colour_packet;
+// |input device| |ready raw| |layer| |port| |type| |mode| |data set| |global vars x3| (port)
+typedef BT_packet<12, 0, BT_B<opINPUT_DEVICE>, BT_B<LC0(READY_RAW)>, BT_B<LC0(0)>, BT_P<0>,
+                  BT_B<LC0(29)>, BT_B<LC0(4)>, BT_B<LC0(3)>, BT_B<GV0(0)>, BT_B<GV0(4)>,
+                  BT_B<GV0(8)>>
+    BT_colour_RGB_packet;
+// |input device| |ready raw| |layer| |port| |type| |mode| |data set| |global var|     (port)
+typedef BT_packet<1, 0, BT_B<opINPUT_DEVICE>, BT_B<LC0(READY_RAW)>, BT_B<LC0(0)>, BT_P<0>,
+                  BT_B<LC0(30)>, BT_B<LC0(0)>, BT_B<LC0(1)>, BT_B<GV0(0)>>
+    BT_ultrasonic_packet;
+// |read ext| |layer| |port| |type| |mode| |format| |data set| |global var|           (port)
+typedef BT_packet<4, 0, BT_B<opINPUT_READEXT>, BT_B<LC0(0)>, BT_P<0>, BT_B<LC0(0)>, BT_B<LC0(-1)>,
+                  BT_B<LC0(DATA_RAW)>, BT_B<LC0(1)>, BT_B<GV0(0)>>
+    BT_gyro_packet;
+// |sound| |tone| |volume| |frequency| |duration|                     (volume, freq, duration)
+typedef BT_packet<0, 0, BT_B<opSOUND>, BT_B<LC0(TONE)>, BT_B<LC1_byte0()>, BT_P<0>,
+                  BT_B<LC2_byte0()>, BT_P<1>, BT_P<1, 1>, BT_B<LC2_byte0()>, BT_P<2>, BT_P<2, 1>>
+    BT_tone_packet;
+
+#endif
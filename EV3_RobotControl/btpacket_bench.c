@@ -0,0 +1,99 @@
+// Microbenchmark for the compile-time command templates in btpacket.h. Compares
+// building a BT_drive() command the way btcomm.c used to (byte array filled in
+// by hand, message id copied through a void pointer, 1 KB reply buffer cleared)
+// with BT_power_start_packet::encode(), first on its own and then with the
+// command dispatched over the in-process "loop:" transport without reply.
+//
+// g++ -O2 btpacket_bench.c btcomm.c bttransport.c -DBT_NO_BLUETOOTH -pthread -o btpacket_bench
+// ./btpacket_bench [iterations]
+
+#include "btcomm.h"
+#include "btpacket.h"
+
+volatile unsigned char sink;
+static int message_id_counter=1;   // stands in for the session's counter
+
+static double now(void)
+{
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return(ts.tv_sec+ts.tv_nsec*1e-9);
+}
+
+__attribute__((noinline)) static int legacy_drive_encode(unsigned char *cmd, char lport, char rport, char power)
+{
+ // BT_drive() before the templates
+ void *p;
+ unsigned char *cp;
+ char reply[1024];
+ unsigned char cmd_string[15]={0x0D,0x00,0x00,0x00,0x00,0x00,0x00,0xA4,0x00,0x00,0x81,0x00,0xA6,0x00,0x00};
+ char ports;
+
+ memset(&reply[0],0,1024);
+ if (power>100||power<-100) return(-1);
+ if (lport>8||rport>8) return(-1);
+ ports=lport|rport;
+ p=(void *)&message_id_counter;
+ cp=(unsigned char *)p;
+ cmd_string[2]=*cp;
+ cmd_string[3]=*(cp+1);
+ cmd_string[9]=ports;
+ cmd_string[11]=power;
+ cmd_string[14]=ports;
+ memcpy(cmd,cmd_string,15);
+ sink=reply[(unsigned char)power&0xFF];
+ return(15);
+}
+
+__attribute__((noinline)) static int template_drive_encode(unsigned char *cmd, char lport, char rport, char power)
+{
+ if (power>100||power<-100) return(-1);
+ if (lport>8||rport>8) return(-1);
+ int len=BT_power_start_packet::encode(cmd,lport|rport,power);
+ cmd[2]=message_id_counter&0xFF;
+ cmd[3]=(message_id_counter>>8)&0xFF;
+ return(len);
+}
+
+int main(int argc, char *argv[])
+{
+ int n=argc>1?atoi(argv[1]):10000000;
+ unsigned char a[1024],b[1024];
+ double t0,t_legacy,t_template,d_legacy,d_template;
+
+ // Both must produce the same bytes
+ legacy_drive_encode(a,MOTOR_D,MOTOR_A,-35);
+ template_drive_encode(b,MOTOR_D,MOTOR_A,-35);
+ if (memcmp(a,b,15)!=0)
+ {
+  fprintf(stderr,"Encoders disagree\n");
+  exit(1);
+ }
+
+ t0=now();
+ for (int i=0;i<n;i++) { legacy_drive_encode(a,MOTOR_D,MOTOR_A,i%100); sink=a[11]; }
+ t_legacy=(now()-t0)/n;
+ t0=now();
+ for (int i=0;i<n;i++) { template_drive_encode(b,MOTOR_D,MOTOR_A,i%100); sink=b[11]; }
+ t_template=(now()-t0)/n;
+ printf("encode only:          legacy %7.1f ns   template %7.1f ns   (%.1fx)\n",t_legacy*1e9,t_template*1e9,t_legacy/t_template);
+
+ // Encode and dispatch through the loopback transport, no reply requested
+ if (BT_open("loop:")!=0) exit(1);
+ BT_set_noreply_sync_interval(0);
+ n=n/20>0?n/20:1;
+ t0=now();
+ for (int i=0;i<n;i++)
+ {
+  int len=legacy_drive_encode(a,MOTOR_D,MOTOR_A,i%100);
+  a[4]=DIRECT_COMMAND_NO_REPLY;
+  BT_submit(a,len);
+ }
+ d_legacy=(now()-t0)/n;
+ t0=now();
+ for (int i=0;i<n;i++) BT_drive_noreply(MOTOR_D,MOTOR_A,i%100);
+ d_template=(now()-t0)/n;
+ BT_close();
+ printf("encode + dispatch:    legacy %7.1f ns   template %7.1f ns   (%.1fx)\n",d_legacy*1e9,d_template*1e9,d_legacy/d_template);
+ return(0);
+}
@@ -0,0 +1,73 @@
+// Prints a trace file recorded with BT_trace_open() (or EV3_TRACE=file), and
+// summarizes the round-trip pattern: how many commands asked for a reply, how
+// long each waited for it, and how many were in flight at once.
+//
+// g++ bttrace_dump.c bttransport.c -DBT_NO_BLUETOOTH -pthread -o bttrace_dump
+// ./bttrace_dump [-q] trace_file       (-q: summary only)
+
+#include "btcomm.h"
+
+int main(int argc, char *argv[])
+{
+ static double sent_at[65536];          // send time of the command with each message id
+ unsigned char frame[1024];
+ double t=0, rtt, rtt_sum=0, rtt_min=1e9, rtt_max=0;
+ int type, len, id, quiet=0, cmds=0, waited=0, replies=0, in_flight=0, max_in_flight=0;
+ int opcodes[256];
+ FILE *f;
+
+ if (argc>1&&strcmp(argv[1],"-q")==0) { quiet=1; argc--; argv++; }
+ if (argc<2)
+ {
+  fprintf(stderr,"Usage: bttrace_dump [-q] trace_file\n");
+  exit(1);
+ }
+ f=BT_trace_read_open(argv[1]);
+ if (f==NULL) exit(1);
+
+ memset(opcodes,0,sizeof(opcodes));
+ for (int i=0;i<65536;i++) sent_at[i]=-1;
+
+ while ((len=BT_trace_read(f,&type,&t,frame))>0)
+ {
+  id=frame[2]|(frame[3]<<8);
+  if (type==BT_TRACE_COMMAND)
+  {
+   cmds++;
+   if (len>7) opcodes[(frame[4]&0x7F)==SYSTEM_COMMAND_REPLY?frame[5]:frame[7]]++;
+   if ((frame[4]&0x80)==0)
+   {
+    waited++;
+    sent_at[id]=t;
+    if (++in_flight>max_in_flight) max_in_flight=in_flight;
+   }
+  }
+  else
+  {
+   replies++;
+   if (sent_at[id]>=0)
+   {
+    rtt=t-sent_at[id];
+    rtt_sum+=rtt;
+    if (rtt<rtt_min) rtt_min=rtt;
+    if (rtt>rtt_max) rtt_max=rtt;
+    sent_at[id]=-1;
+    in_flight--;
+   }
+  }
+  if (!quiet)
+  {
+   printf("%10.6f %s id=%5d len=%4d ",t,type==BT_TRACE_COMMAND?"cmd  ":"reply",id,len);
+   for (int i=4;i<len&&i<24;i++) printf(" %02X",frame[i]);
+   printf(len>24?" ...\n":"\n");
+  }
+ }
+ if (len<0) fprintf(stderr,"Trace file is corrupt, stopped early\n");
+ fclose(f);
+
+ printf("\n%.3f s, %d commands, %d asked for a reply, %d replies, up to %d in flight\n",t,cmds,waited,replies,max_in_flight);
+ if (replies>0) printf("round trip: min %.2f ms, avg %.2f ms, max %.2f ms\n",rtt_min*1e3,rtt_sum/replies*1e3,rtt_max*1e3);
+ printf("first opcode (system command for system commands):\n");
+ for (int i=0;i<256;i++) if (opcodes[i]) printf("  0x%02X: %d\n",i,opcodes[i]);
+ return(0);
+}
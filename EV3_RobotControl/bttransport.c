@@ -0,0 +1,525 @@
+/* EV3 API
+ *  Copyright (C) 2018-2019 Francisco Estrada and Lioudmila Tishkina
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/***********************************************************************************************************************
+ *
+ * 	Transports for the EV3 communications library - see bttransport.h for
+ * the device strings that select each of them.
+ *
+ * ********************************************************************************************************************/
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "btcomm.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Socket transports (RFCOMM, TCP, Unix-domain) - all of them end up with a
+// connected stream socket in t->fd, so they share read/write/close
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+static int BT_fd_read(BT_transport *t, void *buf, int n) {
+  return (read(t->fd, buf, n));
+}
+
+static int BT_fd_write(BT_transport *t, const void *buf, int n) {
+  // MSG_NOSIGNAL - if the other end went away, report an error instead of
+  // killing the program with SIGPIPE
+  return (send(t->fd, buf, n, MSG_NOSIGNAL));
+}
+
+static void BT_fd_close(BT_transport *t) {
+  close(t->fd);
+  t->fd = -1;
+}
+
+#ifndef BT_NO_BLUETOOTH
+static int BT_rfcomm_open(BT_transport *t, const char *address) {
+  // Derived from bluetooth.c by Don Neumann
+  struct sockaddr_rc addr = {0};
+
+  t->fd = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+  if (t->fd < 0) return (-1);
+  // set the connection parameters (who to connect to)
+  addr.rc_family = AF_BLUETOOTH;
+  addr.rc_channel = (uint8_t)1;
+  str2ba(address, &addr.rc_bdaddr);
+
+  if (connect(t->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    BT_fd_close(t);
+    return (-1);
+  }
+  return (0);
+}
+#endif
+
+static int BT_tcp_open(BT_transport *t, const char *address) {
+  // address is host:port, the host may be a name or a numeric address
+  struct addrinfo hints, *res, *ai;
+  char host[256];
+  const char *port;
+  int one = 1;
+
+  port = strrchr(address, ':');
+  if (port == NULL || port == address || port - address >= (int)sizeof(host)) {
+    fprintf(stderr, "BT_tcp_open(): Expected tcp:host:port, got tcp:%s\n",
+            address);
+    return (-1);
+  }
+  memcpy(host, address, port - address);
+  host[port - address] = '\0';
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port + 1, &hints, &res) != 0) {
+    fprintf(stderr, "BT_tcp_open(): Unable to resolve %s\n", address);
+    return (-1);
+  }
+  t->fd = -1;
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    t->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (t->fd < 0) continue;
+    if (connect(t->fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+    BT_fd_close(t);
+  }
+  freeaddrinfo(res);
+  if (t->fd < 0) return (-1);
+
+  // Commands are small and latency bound, don't let Nagle hold them back
+  setsockopt(t->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return (0);
+}
+
+static int BT_unix_open(BT_transport *t, const char *address) {
+  struct sockaddr_un addr;
+
+  if (strlen(address) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "BT_unix_open(): Socket path too long: %s\n", address);
+    return (-1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, address);
+
+  t->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (t->fd < 0) return (-1);
+  if (connect(t->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    BT_fd_close(t);
+    return (-1);
+  }
+  return (0);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// In-process loopback - the library talks to one end of a socket pair, and a
+// thread on the other end hands each command to the installed handler and
+// writes back whatever reply it produces.
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+typedef struct {
+  int peer;  // brick side of the socket pair
+  pthread_t thread;
+  BT_loopback_handler handler;
+  void *arg;
+} BT_loop_state;
+
+static BT_loopback_handler bt_loop_handler = NULL;
+static void *bt_loop_arg = NULL;
+
+static int BT_loop_default_handler(const unsigned char *cmd, int len,
+                                   unsigned char *reply, void *arg) {
+  // Answer every command that asks for a reply with success, and all global
+  // variables set to zero
+  int globals, n;
+
+  if (len < 5 || (cmd[4] & 0x80)) return (0);
+  if (cmd[4] == SYSTEM_COMMAND_REPLY) {
+    n = 7;  // id, type, echoed system command, status, file handle
+    memset(reply, 0, n + 2);
+    reply[4] = SYSTEM_REPLY;
+    reply[5] = len > 5 ? cmd[5] : 0;
+  } else {
+    globals = len > 6 ? (cmd[5] | (cmd[6] << 8)) & 0x3FF : 0;
+    n = 3 + globals;
+    memset(reply, 0, n + 2);
+    reply[4] = DIRECT_REPLY;
+  }
+  reply[0] = n & 0xFF;
+  reply[1] = (n >> 8) & 0xFF;
+  reply[2] = cmd[2];
+  reply[3] = cmd[3];
+  return (n + 2);
+}
+
+static int BT_loop_read_full(int fd, unsigned char *buf, int n) {
+  int got = 0, r;
+  while (got < n) {
+    r = read(fd, buf + got, n - got);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return (-1);
+    got += r;
+  }
+  return (0);
+}
+
+static void *BT_loop_main(void *arg) {
+  BT_loop_state *ls = (BT_loop_state *)arg;
+  unsigned char cmd[1024], reply[1024], discard[256];
+  int len, keep, extra, n, sent, r;
+
+  while (1) {
+    if (BT_loop_read_full(ls->peer, cmd, 2) < 0) return (NULL);
+    len = cmd[0] | (cmd[1] << 8);
+    keep = len > 1022 ? 1022 : len;
+    if (BT_loop_read_full(ls->peer, cmd + 2, keep) < 0) return (NULL);
+    for (extra = len - keep; extra > 0; extra -= 256)
+      if (BT_loop_read_full(ls->peer, discard, extra > 256 ? 256 : extra) < 0)
+        return (NULL);
+
+    n = ls->handler(cmd, keep + 2, reply, ls->arg);
+    for (sent = 0; sent < n; sent += r) {
+      r = write(ls->peer, reply + sent, n - sent);
+      if (r < 0 && errno == EINTR) r = 0;
+      else if (r <= 0) return (NULL);
+    }
+  }
+}
+
+static int BT_loop_open(BT_transport *t, const char *address) {
+  BT_loop_state *ls;
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return (-1);
+  ls = (BT_loop_state *)calloc(1, sizeof(BT_loop_state));
+  ls->peer = sv[1];
+  ls->handler = bt_loop_handler ? bt_loop_handler : BT_loop_default_handler;
+  ls->arg = bt_loop_arg;
+  if (pthread_create(&ls->thread, NULL, BT_loop_main, ls) != 0) {
+    close(sv[0]);
+    close(sv[1]);
+    free(ls);
+    return (-1);
+  }
+  t->fd = sv[0];
+  t->state = ls;
+  return (0);
+}
+
+static void BT_loop_close(BT_transport *t) {
+  BT_loop_state *ls = (BT_loop_state *)t->state;
+  // Closing our end makes the handler thread see EOF and exit
+  BT_fd_close(t);
+  pthread_join(ls->thread, NULL);
+  close(ls->peer);
+  free(ls);
+  t->state = NULL;
+}
+
+void BT_transport_set_loopback(BT_loopback_handler handler, void *arg) {
+  bt_loop_handler = handler;
+  bt_loop_arg = arg;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Replay - like the loopback, but the thread on the other end of the socket
+// pair plays back a trace file. Records are served in the recorded order: each
+// recorded command waits for the program to send its next command, and each
+// recorded reply is sent (with the message id of the live command it answers)
+// once every command recorded before it has been received. Unless replaying
+// fast, a reply is also held back until as much time has passed since the
+// last command as did in the recording.
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+typedef struct {
+  int peer;
+  pthread_t thread;
+  FILE *trace;
+  int fast;
+  unsigned short id_map[65536];  // recorded message id -> live id
+} BT_replay_state;
+
+FILE *BT_trace_read_open(const char *path) {
+  char magic[BT_TRACE_MAGIC_LEN];
+  FILE *f = fopen(path, "rb");
+
+  if (f == NULL) {
+    perror(path);
+    return (NULL);
+  }
+  if (fread(magic, 1, BT_TRACE_MAGIC_LEN, f) != BT_TRACE_MAGIC_LEN ||
+      memcmp(magic, BT_TRACE_MAGIC, BT_TRACE_MAGIC_LEN) != 0) {
+    fprintf(stderr, "BT_trace_read_open(): %s is not an EV3 trace file\n",
+            path);
+    fclose(f);
+    return (NULL);
+  }
+  return (f);
+}
+
+int BT_trace_read(FILE *f, int *type, double *time, unsigned char frame[1024]) {
+  unsigned char hdr[7];
+  int len;
+
+  if (fread(hdr, 1, 7, f) != 7) return (0);
+  len = hdr[5] | (hdr[6] << 8);
+  if (hdr[0] > BT_TRACE_REPLY || len < 5 || len > 1024 ||
+      (int)fread(frame, 1, len, f) != len)
+    return (-1);
+  *type = hdr[0];
+  *time += (hdr[1] | (hdr[2] << 8) | (hdr[3] << 16) |
+            ((unsigned int)hdr[4] << 24)) * 1e-6;
+  return (len);
+}
+
+static double BT_replay_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static void *BT_replay_main(void *arg) {
+  BT_replay_state *rs = (BT_replay_state *)arg;
+  unsigned char rec[1024], cmd[1024], discard[256];
+  double t = 0, rec_cmd_time = 0, live_cmd_time = 0, wait;
+  int type, len, live_len, keep, extra, n_cmds = 0, warned = 0, rid;
+
+  for (int i = 0; i < 65536; i++) rs->id_map[i] = i;
+  while ((len = BT_trace_read(rs->trace, &type, &t, rec)) > 0) {
+    if (type == BT_TRACE_COMMAND) {
+      if (BT_loop_read_full(rs->peer, cmd, 2) < 0) return (NULL);
+      live_len = cmd[0] | (cmd[1] << 8);
+      keep = live_len > 1022 ? 1022 : live_len;
+      if (BT_loop_read_full(rs->peer, cmd + 2, keep) < 0) return (NULL);
+      for (extra = live_len - keep; extra > 0; extra -= 256)
+        if (BT_loop_read_full(rs->peer, discard, extra > 256 ? 256 : extra) < 0)
+          return (NULL);
+      live_cmd_time = BT_replay_now();
+      rec_cmd_time = t;
+      n_cmds++;
+
+      // Same command apart from the message id? If not, the run has diverged
+      // from the recording - keep going, but say so once
+      if (!warned && (keep + 2 != len || memcmp(cmd, rec, 2) ||
+                      memcmp(cmd + 4, rec + 4, len - 4))) {
+        fprintf(stderr,
+                "replay: command %d differs from the recorded one, replies "
+                "may not match\n",
+                n_cmds);
+        warned = 1;
+      }
+      rs->id_map[rec[2] | (rec[3] << 8)] = cmd[2] | (cmd[3] << 8);
+    } else {
+      if (!rs->fast) {
+        wait = live_cmd_time + (t - rec_cmd_time) - BT_replay_now();
+        if (wait > 0) usleep((useconds_t)(wait * 1e6));
+      }
+      rid = rs->id_map[rec[2] | (rec[3] << 8)];
+      rec[2] = rid & 0xFF;
+      rec[3] = (rid >> 8) & 0xFF;
+      for (int sent = 0, r; sent < len; sent += r) {
+        r = write(rs->peer, rec + sent, len - sent);
+        if (r < 0 && errno == EINTR) r = 0;
+        else if (r <= 0) return (NULL);
+      }
+    }
+  }
+  if (len < 0) fprintf(stderr, "replay: trace file is corrupt\n");
+  fprintf(stderr, "replay: end of trace after %d commands\n", n_cmds);
+  // Hang up, so the program sees the link go down instead of waiting forever
+  shutdown(rs->peer, SHUT_RDWR);
+  return (NULL);
+}
+
+static int BT_replay_start(BT_transport *t, const char *path, int fast) {
+  BT_replay_state *rs;
+  int sv[2];
+  FILE *f = BT_trace_read_open(path);
+
+  if (f == NULL) return (-1);
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    fclose(f);
+    return (-1);
+  }
+  rs = (BT_replay_state *)calloc(1, sizeof(BT_replay_state));
+  rs->peer = sv[1];
+  rs->trace = f;
+  rs->fast = fast;
+  if (pthread_create(&rs->thread, NULL, BT_replay_main, rs) != 0) {
+    close(sv[0]);
+    close(sv[1]);
+    fclose(f);
+    free(rs);
+    return (-1);
+  }
+  t->fd = sv[0];
+  t->state = rs;
+  return (0);
+}
+
+static int BT_replay_open(BT_transport *t, const char *address) {
+  return (BT_replay_start(t, address, 0));
+}
+
+static int BT_replay_fast_open(BT_transport *t, const char *address) {
+  return (BT_replay_start(t, address, 1));
+}
+
+static void BT_replay_close(BT_transport *t) {
+  BT_replay_state *rs = (BT_replay_state *)t->state;
+  BT_fd_close(t);
+  pthread_join(rs->thread, NULL);
+  close(rs->peer);
+  fclose(rs->trace);
+  free(rs);
+  t->state = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Transport selection
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+static const BT_transport_ops bt_transports[] = {
+#ifndef BT_NO_BLUETOOTH
+    {"rfcomm:", BT_rfcomm_open, BT_fd_read, BT_fd_write, BT_fd_close},
+#endif
+    {"tcp:", BT_tcp_open, BT_fd_read, BT_fd_write, BT_fd_close},
+    {"unix:", BT_unix_open, BT_fd_read, BT_fd_write, BT_fd_close},
+    {"loop:", BT_loop_open, BT_fd_read, BT_fd_write, BT_loop_close},
+    {"replay:", BT_replay_open, BT_fd_read, BT_fd_write, BT_replay_close},
+    {"replay-fast:", BT_replay_fast_open, BT_fd_read, BT_fd_write,
+     BT_replay_close},
+};
+
+int BT_transport_open(BT_transport *t, const char *device) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Pick the transport named by the device string prefix and open it. A device
+  // string without a prefix is taken to be the EV3's Bluetooth hex ID. The
+  // EV3_DEVICE environment variable, if set, replaces the device string.
+  //
+  // Returns: 0 on success
+  //          -1 otherwise
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  const char *env = getenv("EV3_DEVICE");
+  const BT_transport_ops *ops = NULL;
+  const char *address = device;
+  int n = sizeof(bt_transports) / sizeof(bt_transports[0]);
+
+  if (env != NULL && *env != '\0') device = address = env;
+
+  for (int i = 0; i < n; i++) {
+    int plen = strlen(bt_transports[i].scheme);
+    if (strncmp(device, bt_transports[i].scheme, plen) == 0) {
+      ops = &bt_transports[i];
+      address = device + plen;
+      break;
+    }
+  }
+#ifndef BT_NO_BLUETOOTH
+  if (ops == NULL) ops = &bt_transports[0];  // bare hex ID -> RFCOMM
+#endif
+  if (ops == NULL) {
+    fprintf(stderr, "BT_transport_open(): No transport for device %s\n",
+            device);
+    return (-1);
+  }
+
+  t->ops = NULL;
+  t->fd = -1;
+  t->state = NULL;
+  if (t->device != device) snprintf(t->device, sizeof(t->device), "%s", device);
+  if (ops->open(t, address) < 0) return (-1);
+  t->ops = ops;
+  // Non-blocking from here on - btcomm.c waits with BT_transport_wait() so
+  // that no read or write can outlast the deadline of the command it is for
+  fcntl(t->fd, F_SETFL, fcntl(t->fd, F_GETFL) | O_NONBLOCK);
+  return (0);
+}
+
+int BT_transport_reconnect(BT_transport *t, int attempts) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Drop the current connection and reopen the same device. The first attempt
+  // is made right away (the brick keeps driving until it hears from us again),
+  // later ones back off so a brick that is out of range or rebooting is not
+  // hammered with connection requests.
+  //
+  // Returns: 0 on success
+  //          -1 if all attempts failed
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  int delay = BT_RECONNECT_FIRST_DELAY_MS;
+
+  BT_transport_close(t);
+  for (int i = 1; i <= attempts; i++) {
+    if (i > 1) {
+      usleep(delay * 1000);
+      delay = MIN(2 * delay, BT_RECONNECT_MAX_DELAY_MS);
+    }
+    fprintf(stderr, "BT_transport_reconnect(): Attempt %d of %d to reach %s\n", i, attempts,
+            t->device);
+    if (BT_transport_open(t, t->device) == 0) return (0);
+  }
+  return (-1);
+}
+
+int BT_transport_wait(BT_transport *t, int events, int timeout_ms) {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Wait until the transport is ready for reading (events=POLLIN) or writing
+  // (events=POLLOUT), for at most timeout_ms milliseconds (-1 waits with no
+  // limit). Interrupted waits are restarted with the time that is left.
+  //
+  // Returns: 1 if the transport is ready (or has hung up - the next read/write
+  //            then reports it)
+  //          0 if the time ran out
+  //          -1 on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  struct pollfd pfd;
+  struct timespec t0, t1;
+  int r, left = timeout_ms;
+
+  if (t->ops == NULL) return (-1);
+  pfd.fd = t->fd;
+  pfd.events = events;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  while ((r = poll(&pfd, 1, left)) < 0 && errno == EINTR) {
+    if (timeout_ms < 0) continue;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    left = timeout_ms - (int)((t1.tv_sec - t0.tv_sec) * 1000 +
+                              (t1.tv_nsec - t0.tv_nsec) / 1000000);
+    if (left < 0) left = 0;
+  }
+  return (r < 0 ? -1 : r > 0);
+}
+
+int BT_transport_read(BT_transport *t, void *buf, int n) {
+  if (t->ops == NULL) return (-1);
+  return (t->ops->read(t, buf, n));
+}
+
+int BT_transport_write(BT_transport *t, const void *buf, int n) {
+  if (t->ops == NULL) return (-1);
+  return (t->ops->write(t, buf, n));
+}
+
+void BT_transport_shutdown_read(BT_transport *t) {
+  // Every transport is a socket, so shutdown() reaches them all
+  if (t->ops == NULL) return;
+  shutdown(t->fd, SHUT_RD);
+}
+
+void BT_transport_close(BT_transport *t) {
+  if (t->ops == NULL) return;
+  t->ops->close(t);
+  t->ops = NULL;
+}
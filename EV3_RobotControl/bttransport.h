@@ -0,0 +1,124 @@
+/* EV3 API
+ *  Copyright (C) 2018-2019 Francisco Estrada and Lioudmila Tishkina
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/***********************************************************************************************************************
+ *
+ * 	Transport layer for the EV3 communications library - BT_open() no longer
+ * talks to an RFCOMM socket directly. Instead, the device string given to it
+ * selects one of the transports below, and every command/reply goes through
+ * that transport's read/write calls:
+ *
+ * 	"00:16:53:56:56:03"       - Bluetooth RFCOMM to the EV3 with that hex ID
+ * 	"rfcomm:00:16:53:56:56:03" - same as above
+ * 	"tcp:host:port"            - TCP connection to a stand-in brick
+ * 	"unix:/path/to/socket"     - Unix-domain socket to a stand-in brick
+ * 	"loop:"                    - in-process loopback, commands are answered
+ * 	                             by a handler function in this program
+ * 	"replay:/path/to/trace"    - serve the replies recorded in a trace file
+ * 	                             (see BT_trace_open()), with recorded timing
+ * 	"replay-fast:/path/to/trace" - same, without waiting between replies
+ *
+ * 	If the EV3_DEVICE environment variable is set, it replaces the device
+ * string passed to BT_open(), so an unmodified program can be pointed at a
+ * stand-in brick, e.g.  EV3_DEVICE=tcp:localhost:5555 ./localisation ...
+ *
+ * 	Compiling with -DBT_NO_BLUETOOTH leaves out the RFCOMM transport, so the
+ * library builds and links without libbluetooth.
+ * ********************************************************************************************************************/
+
+#ifndef __bttransport_header
+#define __bttransport_header
+
+#include <stdio.h>
+
+typedef struct BT_transport BT_transport;
+
+// Operations implemented by each transport. read() and write() behave like
+// read(2)/write(2) - they may transfer fewer than n bytes, and return -1 on
+// error or 0 on EOF (read only). The descriptor is non-blocking once open, so
+// they also fail with errno EAGAIN when nothing can be transferred yet.
+typedef struct {
+  const char *scheme;  // device string prefix selecting this transport
+  int (*open)(BT_transport *t, const char *address);
+  int (*read)(BT_transport *t, void *buf, int n);
+  int (*write)(BT_transport *t, const void *buf, int n);
+  void (*close)(BT_transport *t);
+} BT_transport_ops;
+
+struct BT_transport {
+  const BT_transport_ops *ops;  // NULL while the transport is closed
+  int fd;                       // descriptor used by the socket transports
+  void *state;                  // transport private data
+  char device[256];             // device string it was opened with, for reconnecting
+};
+
+// Handler answering commands sent over the "loop:" transport. cmd holds one
+// complete command (length field included, len bytes). The handler writes the
+// complete reply frame to reply[] (up to 1024 bytes) and returns its length,
+// or returns 0 if the command gets no reply.
+typedef int (*BT_loopback_handler)(const unsigned char *cmd, int len,
+                                   unsigned char *reply, void *arg);
+
+// Open the transport selected by the device string (after applying the
+// EV3_DEVICE override). Returns 0 on success, -1 otherwise
+int BT_transport_open(BT_transport *t, const char *device);
+int BT_transport_read(BT_transport *t, void *buf, int n);
+int BT_transport_write(BT_transport *t, const void *buf, int n);
+void BT_transport_close(BT_transport *t);
+// Make reads see EOF from now on (a reader waiting in BT_transport_wait() wakes
+// up), while writes still go through. This is how the reading thread is stopped
+void BT_transport_shutdown_read(BT_transport *t);
+// Close the transport and open it again with the same device string, retrying
+// up to 'attempts' times. The first retry waits BT_RECONNECT_FIRST_DELAY_MS, and
+// the wait doubles up to BT_RECONNECT_MAX_DELAY_MS. Returns 0 once reconnected, -1
+// if every attempt failed
+#define BT_RECONNECT_FIRST_DELAY_MS 250
+#define BT_RECONNECT_MAX_DELAY_MS 4000
+int BT_transport_reconnect(BT_transport *t, int attempts);
+// Wait for the transport to become readable (POLLIN) or writable (POLLOUT),
+// for at most timeout_ms (-1 = no limit). Returns 1 if ready, 0 if the time
+// ran out, -1 on error
+int BT_transport_wait(BT_transport *t, int events, int timeout_ms);
+
+// Trace files
+// Written by BT_trace_open() in btcomm.c, read back by the replay transports.
+// After the BT_TRACE_MAGIC header, each record is
+//
+//   |type| |time delta (us)| |length|  |.... frame ....|
+//    1 B    4 B               2 B       length bytes
+//
+// type is BT_TRACE_COMMAND or BT_TRACE_REPLY, the time delta is measured on
+// the monotonic clock from the previous record (from the header for the first
+// one), and frame is the complete command/reply including its length field.
+// Multi-byte fields are little endian, like the EV3 protocol.
+#define BT_TRACE_MAGIC "EV3TRACE1\n"
+#define BT_TRACE_MAGIC_LEN 10
+#define BT_TRACE_COMMAND 0
+#define BT_TRACE_REPLY 1
+
+// Read the next record from a trace file opened with BT_trace_read_open().
+// Returns the frame length, 0 at the end of the file, -1 if it is corrupt.
+// *time is advanced by the record's time delta (in seconds)
+FILE *BT_trace_read_open(const char *path);
+int BT_trace_read(FILE *f, int *type, double *time, unsigned char frame[1024]);
+
+// Install the handler used by "loop:" transports opened after this call. With
+// no handler installed, every command requesting a reply gets a successful
+// reply with all global variables set to zero.
+void BT_transport_set_loopback(BT_loopback_handler handler, void *arg);
+
+#endif
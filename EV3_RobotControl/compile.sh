@@ -1 +1 @@
-g++ btcomm_test.c btcomm.c -lbluetooth
+g++ btcomm_test.c btcomm.c bttransport.c -lbluetooth -pthread
\ No newline at end of file
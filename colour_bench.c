@@ -0,0 +1,139 @@
+// Microbenchmark for the colour classifiers in EV3_Localization.c. Times the
+// ways of classifying a normalized RGB reading - the nearest calibration
+// sample search colourFromRGB2() used to do (scalar, pow() on every channel),
+// the vectorized k-nearest search in colourFromRGB_kNN() (reads
+// ./calibration), the thresholds in colourRules() that colourFromRGB() used to
+// run on every call, and the table lookup colourFromRGB() does now. Checks the
+// table agrees with the thresholds for every reading from 0 to 320 on each
+// channel, and that the vectorized search finds the same nearest sample.
+// Build with -mavx (or -march=native) for the 8-lane kernel.
+//
+// g++ -O2 colour_bench.c EV3_Localization.c ./EV3_RobotControl/btcomm.c ./EV3_RobotControl/bttransport.c -DEV3_LOCALIZATION_NO_MAIN -DBT_NO_BLUETOOTH -pthread -o colour_bench
+// ./colour_bench [iterations]
+
+#include "EV3_Localization.h"
+
+#define COLOUR_UNKNOWN 7
+#define SAMPLES 4096
+
+typedef struct {
+  int r;
+  int g;
+  int b;
+  int color;
+} colorReading;
+
+static colorReading calibration_readings[30*6];   // as colourFromRGB2() used to keep them
+int colourFromRGB(int RGB[3]);
+int colourFromRGB_kNN(int RGB[3], int k, double *nearest, double *margin);
+int colourRules(int RGB[3]);
+void build_colour_table(void);
+int load_calibration(const char *path);
+
+volatile int sink;
+
+static double now(void)
+{
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return(ts.tv_sec+ts.tv_nsec*1e-9);
+}
+
+__attribute__((noinline)) static int rules_colour(int RGB[3])
+{
+ // colourFromRGB() before the table
+ if (RGB[0] < 0 || RGB[0] > 1020 || RGB[1] < 0 || RGB[1] > 1020 || RGB[2] < 0 || RGB[2] > 1020) return COLOUR_UNKNOWN;
+ return(colourRules(RGB));
+}
+
+__attribute__((noinline)) static int legacy_colourFromRGB2(int buf[3])
+{
+ // colourFromRGB2() before the kNN kernel
+ int min_sqdiff = 100, min_color = 7, curr_sqdiff;
+ for (int i = 0; i < 30*6; i++) {
+   curr_sqdiff = pow(buf[0] - calibration_readings[i].r, 2);
+   curr_sqdiff += pow(buf[1] - calibration_readings[i].g, 2);
+   curr_sqdiff += pow(buf[2] - calibration_readings[i].b, 2);
+   if (curr_sqdiff < min_sqdiff) {
+     min_sqdiff = curr_sqdiff;
+     min_color = calibration_readings[i].color;
+   }
+ }
+ return min_color;
+}
+
+static int nearest_colour(int RGB[3])
+{
+ double nearest;
+ int c=colourFromRGB_kNN(RGB,1,&nearest,NULL);
+ return(nearest<10?c:7);
+}
+
+static int knn_colour(int RGB[3])
+{
+ return(colourFromRGB_kNN(RGB,5,NULL,NULL));
+}
+
+static double time_ns(int (*classify)(int RGB[3]), int samples[SAMPLES][3], int n)
+{
+ double t=now();
+ int acc=0;
+ for (int i=0;i<n;i++) acc+=classify(samples[i&(SAMPLES-1)]);
+ sink=acc;
+ return((now()-t)/n*1e9);
+}
+
+int main(int argc, char *argv[])
+{
+ int n=argc>1?atoi(argv[1]):10000000;
+ int samples[SAMPLES][3], RGB[3], mismatches=0;
+ double margin, low=0;
+ FILE *f;
+
+ if ((f=fopen("./calibration","r"))==NULL||fread(calibration_readings,sizeof(colorReading),30*6,f)!=30*6||
+     load_calibration("./calibration")!=30*6)
+ {
+  fprintf(stderr,"Run this where ./calibration holds 180 samples\n");
+  return(1);
+ }
+ fclose(f);
+
+ double t=now();
+ build_colour_table();
+ printf("Table built in %.2f ms\n",(now()-t)*1e3);
+
+ for (RGB[0]=0;RGB[0]<=320;RGB[0]++)
+  for (RGB[1]=0;RGB[1]<=320;RGB[1]++)
+   for (RGB[2]=0;RGB[2]<=320;RGB[2]++)
+    if (colourFromRGB(RGB)!=rules_colour(RGB)) mismatches++;
+ printf("Table and thresholds disagree on %d of %d readings\n",mismatches,321*321*321);
+
+ // Readings spread over what the sensor gives on the map: dark, coloured and white
+ srand(1);
+ for (int i=0;i<SAMPLES;i++)
+  for (int k=0;k<3;k++) samples[i][k]=rand()%320;
+
+ mismatches=0;
+ for (int i=0;i<SAMPLES;i++)
+ {
+  if (legacy_colourFromRGB2(samples[i])!=nearest_colour(samples[i])) mismatches++;
+  colourFromRGB_kNN(samples[i],5,NULL,&margin);
+  if (margin<5) low++;
+ }
+ printf("Nearest sample search and kNN kernel (k=1) disagree on %d of %d readings\n",mismatches,SAMPLES);
+ printf("%.1f%% of readings are within 5 of a second colour (k=5)\n",100.0*low/SAMPLES);
+
+ printf("old colourFromRGB2() (scalar search): %8.1f ns/call\n",time_ns(legacy_colourFromRGB2,samples,n/100));
+ printf("colourFromRGB_kNN() k=5 (%s):      %8.1f ns/call\n",
+#if defined(__AVX__)
+        "AVX ",
+#elif defined(__SSE2__)
+        "SSE2",
+#else
+        "C   ",
+#endif
+        time_ns(knn_colour,samples,n/10));
+ printf("thresholds (old colourFromRGB()):     %8.1f ns/call\n",time_ns(rules_colour,samples,n));
+ printf("table (colourFromRGB()):              %8.1f ns/call\n",time_ns(colourFromRGB,samples,n));
+ return(0);
+}
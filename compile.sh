@@ -1,7 +1,13 @@
 if [ "$1" = "-d" ] ; then
-    g++ debug.c ./EV3_RobotControl/btcomm.c -lbluetooth -o debug
+    g++ debug.c ./EV3_RobotControl/btcomm.c ./EV3_RobotControl/bttransport.c -lbluetooth -pthread -o debug
+elif [ "$1" = "-n" ] ; then
+    # No Bluetooth - only the tcp:/unix:/loop: transports, run with EV3_DEVICE set
+    g++ EV3_Localization.c -g ./EV3_RobotControl/btcomm.c ./EV3_RobotControl/bttransport.c -DBT_NO_BLUETOOTH -pthread  -o localisation
+elif [ "$1" = "-e" ] ; then
+    # Brick emulator, see EV3_Emulator.h
+    g++ EV3_Emulator.c EV3_Localization.c ./EV3_RobotControl/btcomm.c ./EV3_RobotControl/bttransport.c -DEV3_LOCALIZATION_NO_MAIN -DBT_NO_BLUETOOTH -pthread -o ev3emu
 elif [ "$1" = "" ] ; then
-    g++ EV3_Localization.c -g ./EV3_RobotControl/btcomm.c -lbluetooth  -o localisation
+    g++ EV3_Localization.c -g ./EV3_RobotControl/btcomm.c ./EV3_RobotControl/bttransport.c -lbluetooth -pthread  -o localisation
 else
-    g++ $1.c ./EV3_RobotControl/btcomm.c -lbluetooth  -o $1
-fi
\ No newline at end of file
+    g++ $1.c ./EV3_RobotControl/btcomm.c ./EV3_RobotControl/bttransport.c -lbluetooth -pthread  -o $1
+fi